@@ -0,0 +1,470 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HAVE_NO_BSDFUNCS
+#include <bsd/stdlib.h>
+#endif
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <arpa/inet.h>
+#include <err.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <geoloc.h>
+#include <addr.h>
+#include <control.h>
+#include <delta.h>
+#include <table.h>
+
+#define BENCH_RANGES            200000
+#define BENCH_LOOKUPS           4000000
+#define BENCH_BATCH             64
+#define BENCH_ROUNDS            100000
+
+void usage(void);
+uint32_t bench_rand(void);
+uint64_t bench_clock(void);
+void bench_addr(struct geoloc_addr *, uint32_t);
+struct delta *ranges_load(const char *);
+struct delta *ranges_synth(size_t);
+void bench_report(const char *, const char *, size_t, uint64_t);
+int bench_pton(const char *, struct geoloc_addr *);
+void bench_parse(const struct geoloc_addr *, size_t, size_t);
+void bench_serve(int, struct geoloc_table *, int);
+int bench_ns_cmp(const void *, const void *);
+void bench_wakeup(struct geoloc_table *, const struct geoloc_addr *, size_t,
+    size_t, int, int);
+
+static uint32_t seed = 2463534242U;
+
+void
+usage(void)
+{
+    extern char *__progname;
+
+    fprintf(stderr, "usage: %s [-b batch] [-c lookups] [-n ranges] "
+        "[-p cpu] [-r ranges] [-s seed] [-w rounds]\n", __progname);
+    exit(1);
+}
+
+uint32_t
+bench_rand(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    return (seed);
+}
+
+uint64_t
+bench_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * IPv4-mapped form of the address
+ */
+void
+bench_addr(struct geoloc_addr *addr, uint32_t v4)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->a[10] = addr->a[11] = 0xff;
+    v4 = htonl(v4);
+    memcpy(&addr->a[12], &v4, sizeof(v4));
+}
+
+struct delta *
+ranges_load(const char *path)
+{
+    struct delta *d;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        err(1, "%s", path);
+
+    if ((d = delta_read(fp, 0)) == NULL)
+        errx(1, "%s: invalid ranges", path);
+
+    fclose(fp);
+
+    return (d);
+}
+
+/*
+ * n ranges of random sizes over the IPv4 space,
+ * with two letters values like country codes
+ */
+struct delta *
+ranges_synth(size_t n)
+{
+    struct delta *d;
+    uint64_t first = 0, last, step;
+    size_t i;
+    char value[3];
+
+    if ((d = calloc(1, sizeof(*d))) == NULL ||
+        (d->ranges = calloc(n, sizeof(*d->ranges))) == NULL)
+        err(1, "ranges_synth");
+    d->rangesz = n;
+
+    step = (1ULL << 32) / n;
+    for (i = 0; i < n && first <= 0xffffffffULL; i++, first = last + 1) {
+        last = first + 1 + bench_rand() % (2 * step - 1);
+        if (i == n - 1 || last > 0xffffffffULL)
+            last = 0xffffffffULL;
+        bench_addr(&d->ranges[i].first, (uint32_t)first);
+        bench_addr(&d->ranges[i].last, (uint32_t)last);
+        value[0] = 'A' + bench_rand() % 26;
+        value[1] = 'A' + bench_rand() % 26;
+        value[2] = '\0';
+        if ((d->ranges[i].value = strdup(value)) == NULL)
+            err(1, "ranges_synth");
+        d->nranges++;
+    }
+
+    return (d);
+}
+
+void
+bench_report(const char *name, const char *what, size_t n, uint64_t ns)
+{
+    printf("%-16s %8.2f M%ss/s %8.1f ns/%s\n", name,
+        ns > 0 ? (double)n * 1000 / ns : 0.0, what, (double)ns / n, what);
+}
+
+/*
+ * The address parsing of the daemon before its own IPv4 parser
+ */
+int
+bench_pton(const char *s, struct geoloc_addr *addr)
+{
+    if (inet_pton(AF_INET, s, &addr->a[12]) == 1) {
+        memset(addr->a, 0, 10);
+        addr->a[10] = addr->a[11] = 0xff;
+        return (0);
+    }
+
+    return (inet_pton(AF_INET6, s, addr->a) == 1 ? 0 : -1);
+}
+
+/*
+ * Text addresses parsing, inet_pton against the scalar parser, the
+ * one picked for the CPU and the batch parsing of bulk requests
+ */
+void
+bench_parse(const struct geoloc_addr *addrs, size_t count, size_t batch)
+{
+    struct geoloc_addr *out, *ref;
+    const char **keys;
+    char *text, name[32];
+    size_t i, j;
+    uint64_t start, ns;
+    int *ret, r = 0;
+
+    if ((text = calloc(count, INET_ADDRSTRLEN)) == NULL ||
+        (keys = calloc(count, sizeof(*keys))) == NULL ||
+        (out = calloc(count, sizeof(*out))) == NULL ||
+        (ref = calloc(count, sizeof(*ref))) == NULL ||
+        (ret = calloc(count, sizeof(*ret))) == NULL)
+        err(1, "calloc");
+    for (i = 0; i < count; i++) {
+        keys[i] = text + i * INET_ADDRSTRLEN;
+        addr_format(&addrs[i], text + i * INET_ADDRSTRLEN, INET_ADDRSTRLEN);
+    }
+    /* the first parse picks the parser */
+    addr_parse(keys[0], &out[0]);
+
+    start = bench_clock();
+    for (i = 0; i < count; i++)
+        r |= bench_pton(keys[i], &ref[i]);
+    ns = bench_clock() - start;
+    bench_report("inet_pton", "parse", count, ns);
+
+    start = bench_clock();
+    for (i = 0; i < count; i++)
+        r |= addr_parse_v4_scalar(keys[i], &out[i].a[12]);
+    ns = bench_clock() - start;
+    bench_report("parse scalar", "parse", count, ns);
+
+    start = bench_clock();
+    for (i = 0; i < count; i++)
+        r |= addr_parse(keys[i], &out[i]);
+    ns = bench_clock() - start;
+    snprintf(name, sizeof(name), "parse %s", addr_parse_v4_name());
+    bench_report(name, "parse", count, ns);
+
+    start = bench_clock();
+    for (i = 0; i < count; i += j) {
+        j = (count - i < batch ? count - i : batch);
+        addr_parse_batch(&keys[i], j, &out[i], &ret[i]);
+    }
+    ns = bench_clock() - start;
+    snprintf(name, sizeof(name), "parse batch %zu", batch);
+    bench_report(name, "parse", count, ns);
+
+    for (i = 0; i < count; i++)
+        if (ret[i] != 0 || memcmp(&out[i], &ref[i], sizeof(out[i])) != 0)
+            errx(1, "parse %zu: %s differs from inet_pton", i, keys[i]);
+    if (r != 0)
+        errx(1, "valid address rejected");
+
+    free(text);
+    free(keys);
+    free(out);
+    free(ref);
+    free(ret);
+}
+
+/*
+ * Serving side of the round trips, answering the lookups of
+ * addresses as the main loop of the daemon does, sleeping in
+ * poll as by default or busy polling as in low latency mode
+ */
+void
+bench_serve(int fd, struct geoloc_table *t, int busy)
+{
+    struct pollfd pfd;
+    struct geoloc_addr addr;
+    const char *value;
+    ssize_t n;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+
+    for (;;) {
+        if (poll(&pfd, 1, busy ? 0 : CONTROL_POLL_TIMEOUT) <= 0)
+            continue;
+        if ((n = recv(fd, &addr, sizeof(addr), 0)) != sizeof(addr))
+            _exit(n == 0 ? 0 : 1);
+        if ((value = table_lookup(t, &addr)) == NULL)
+            value = "";
+        if (send(fd, value, strlen(value) + 1, 0) == -1)
+            _exit(1);
+    }
+}
+
+int
+bench_ns_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x < y ? -1 : x > y);
+}
+
+/*
+ * Round trip latency of single lookups to a serving process, pinned
+ * to cpu unless -1, waiting in poll or busy polling: percentiles
+ */
+void
+bench_wakeup(struct geoloc_table *t, const struct geoloc_addr *addrs,
+    size_t count, size_t rounds, int cpu, int busy)
+{
+    uint32_t *ns;
+    uint64_t start;
+    size_t i;
+    pid_t pid;
+    char buf[GEOLOC_ADDR_MAX];
+    int sv[2];
+
+    if ((ns = calloc(rounds, sizeof(*ns))) == NULL)
+        err(1, "calloc");
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1)
+        err(1, "socketpair");
+
+    switch ((pid = fork())) {
+    case -1:
+        err(1, "fork");
+    case 0:
+        close(sv[0]);
+        if (cpu != -1)
+            residency_pin(cpu);
+        bench_serve(sv[1], t, busy);
+        _exit(0);
+    }
+    close(sv[1]);
+
+    for (i = 0; i < rounds; i++) {
+        start = bench_clock();
+        if (send(sv[0], &addrs[i % count], sizeof(*addrs), 0) == -1 ||
+            recv(sv[0], buf, sizeof(buf), 0) <= 0)
+            errx(1, "round trip %zu failed", i);
+        start = bench_clock() - start;
+        ns[i] = (start > UINT32_MAX ? UINT32_MAX : start);
+    }
+
+    close(sv[0]);
+    waitpid(pid, NULL, 0);
+
+    qsort(ns, rounds, sizeof(*ns), bench_ns_cmp);
+    printf("%-16s %10zu %8u %8u %8u %8u\n", busy ? "busy poll" : "poll",
+        rounds, ns[rounds / 2], ns[rounds * 99 / 100],
+        ns[rounds * 999 / 1000], ns[rounds - 1]);
+
+    free(ns);
+}
+
+/*
+ * Lookup table throughput on one core, the sequential lookups
+ * against the interleaved batch ones, then against the compact form,
+ * then the parsing of the addresses as text, and the round trip
+ * latency of single lookups served as by default and busy polling
+ */
+int
+main(int argc, char *argv[])
+{
+    struct geoloc_table *t, *z;
+    struct geoloc_addr *addrs;
+    struct delta *d;
+    const char **seq, **bat, *errstr, *ranges = NULL;
+    size_t nranges = BENCH_RANGES, count = BENCH_LOOKUPS;
+    size_t batch = BENCH_BATCH, rounds = BENCH_ROUNDS, i, j;
+    uint64_t start, seqns, batns, zns;
+    char name[32];
+    int c, cpu = -1;
+
+    log_init(1);
+
+    while ((c = getopt(argc, argv, "b:c:n:p:r:s:w:")) != -1) {
+        switch (c) {
+        case 'b':
+            batch = strtonum(optarg, 1, 1 << 16, &errstr);
+            if (errstr != NULL)
+                errx(1, "batch %s: %s", optarg, errstr);
+            break;
+        case 'c':
+            count = strtonum(optarg, 1, 1 << 30, &errstr);
+            if (errstr != NULL)
+                errx(1, "lookups %s: %s", optarg, errstr);
+            break;
+        case 'n':
+            nranges = strtonum(optarg, 1, 1 << 30, &errstr);
+            if (errstr != NULL)
+                errx(1, "ranges %s: %s", optarg, errstr);
+            break;
+        case 'p':
+            cpu = strtonum(optarg, 0, 1023, &errstr);
+            if (errstr != NULL)
+                errx(1, "cpu %s: %s", optarg, errstr);
+            break;
+        case 'r':
+            ranges = optarg;
+            break;
+        case 's':
+            seed = strtonum(optarg, 1, UINT32_MAX, &errstr);
+            if (errstr != NULL)
+                errx(1, "seed %s: %s", optarg, errstr);
+            break;
+        case 'w':
+            rounds = strtonum(optarg, 0, 1 << 30, &errstr);
+            if (errstr != NULL)
+                errx(1, "rounds %s: %s", optarg, errstr);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    if (argc != optind)
+        usage();
+
+    d = (ranges != NULL ? ranges_load(ranges) : ranges_synth(nranges));
+    if ((t = table_ranges(GEOLOC_COUNTRY, 1, d)) == NULL ||
+        (z = table_ranges(GEOLOC_COUNTRY, 1, d)) == NULL)
+        errx(1, "cannot build the table");
+    delta_free(d);
+    if (table_compact(z) == -1)
+        errx(1, "cannot compact the table");
+
+    printf("table            %u ranges, %u pages, %zu KB\n", t->nranges,
+        t->npages, table_footprint(t) / 1024);
+
+    if ((addrs = calloc(count, sizeof(*addrs))) == NULL ||
+        (seq = calloc(count, sizeof(*seq))) == NULL ||
+        (bat = calloc(count, sizeof(*bat))) == NULL)
+        err(1, "calloc");
+    for (i = 0; i < count; i++)
+        bench_addr(&addrs[i], bench_rand());
+
+    start = bench_clock();
+    for (i = 0; i < count; i++)
+        seq[i] = table_lookup(t, &addrs[i]);
+    seqns = bench_clock() - start;
+
+    start = bench_clock();
+    for (i = 0; i < count; i += j) {
+        j = (count - i < batch ? count - i : batch);
+        table_lookup_batch(t, &addrs[i], j, &bat[i]);
+    }
+    batns = bench_clock() - start;
+
+    for (i = 0; i < count; i++)
+        if (seq[i] != bat[i])
+            errx(1, "lookup %zu: batch and sequential results differ", i);
+
+    start = bench_clock();
+    for (i = 0; i < count; i++)
+        bat[i] = table_lookup(z, &addrs[i]);
+    zns = bench_clock() - start;
+
+    for (i = 0; i < count; i++)
+        if (strcmp(seq[i], bat[i]) != 0)
+            errx(1, "lookup %zu: compact and sequential results differ", i);
+
+    bench_report("sequential", "lookup", count, seqns);
+    snprintf(name, sizeof(name), "batch %zu", batch);
+    bench_report(name, "lookup", count, batns);
+    printf("speedup          %8.2f\n",
+        batns > 0 ? (double)seqns / batns : 0.0);
+    printf("compact          %u runs, %u values, %zu KB\n",
+        z->compact->inet.nkeys + z->compact->inet6.nkeys,
+        z->compact->nvalues, table_footprint(z) / 1024);
+    bench_report("compact", "lookup", count, zns);
+
+    bench_parse(addrs, count, batch);
+
+    if (rounds > 0) {
+        /* a served process gone, the writes fail rather than kill */
+        signal(SIGPIPE, SIG_IGN);
+        printf("%-16s %10s %8s %8s %8s %8s\n", "round trip ns", "rounds",
+            "p50", "p99", "p99.9", "max");
+        bench_wakeup(t, addrs, count, rounds, cpu, 0);
+        bench_wakeup(t, addrs, count, rounds, cpu, 1);
+    }
+
+    free(addrs);
+    free(seq);
+    free(bat);
+    table_free(t);
+    table_free(z);
+
+    return (0);
+}
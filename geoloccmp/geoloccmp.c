@@ -0,0 +1,509 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#include <netinet/in.h>
+
+#ifdef HAVE_NO_BSDFUNCS
+#include <bsd/stdlib.h>
+#include <bsd/string.h>
+#endif
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <geoloc.h>
+#include <modules.h>
+
+#define CMP_ADDRS               100000
+#define CMP_TARGETS_MAX         8
+
+struct cmp_field {
+    uint32_t                *lat;
+    uint64_t                total;
+    size_t                  differ;
+    size_t                  empty;
+};
+
+/*
+ * One backend with its datafile and cache mode,
+ * the same backend possibly appearing several times
+ */
+struct cmp_target {
+    const char              *spec;
+    struct backend          *b;
+    char                    *datafile;
+    enum cache_mode         cache;
+    void                    *handler;
+    uint64_t                load;
+    long                    rss_load;
+    long                    rss_lookup;
+    size_t                  region;
+    struct cmp_field        fields[GEOLOC_NFIELDS];
+};
+
+void usage(void);
+uint32_t cmp_rand(void);
+uint64_t cmp_clock(void);
+long cmp_rss(void);
+void cmp_target_parse(struct cmp_target *, char *);
+void cmp_target_load(struct cmp_target *);
+int cmp_field_parse(const char *);
+size_t addrs_load(const char *, struct geoloc_addr **, char ***);
+size_t addrs_synth(size_t, struct geoloc_addr **, char ***);
+const char *cmp_lookup(struct cmp_target *, const struct geoloc_addr *,
+    const char *, enum lookup_info_type, void **);
+void cmp_run(struct cmp_target *, enum lookup_info_type,
+    const struct geoloc_addr *, char **, size_t);
+void cmp_compare(struct cmp_target *, size_t, enum lookup_info_type,
+    const struct geoloc_addr *, char **, size_t);
+int cmp_lat_cmp(const void *, const void *);
+void cmp_report(struct cmp_target *, size_t, enum lookup_info_type, size_t);
+
+static const char *field_names[GEOLOC_NFIELDS] = {
+    [GEOLOC_COUNTRY]    = "ccode",
+    [GEOLOC_ISP]        = "isp",
+    [GEOLOC_MNC]        = "mnc",
+    [GEOLOC_MCC]        = "mcc",
+    [GEOLOC_CITY]       = "city",
+    [GEOLOC_COORDS]     = "coords"
+};
+
+static uint32_t seed = 2463534242U;
+
+void
+usage(void)
+{
+    extern char *__progname;
+
+    fprintf(stderr, "usage: %s [-a addresses] [-c count] [-f field] "
+        "[-p plugin] [-s seed]\n"
+        "    backend:datafile[:cache] ...\n", __progname);
+    exit(1);
+}
+
+uint32_t
+cmp_rand(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+
+    return (seed);
+}
+
+uint64_t
+cmp_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * Peak resident size in kilobytes, the growth it shows being
+ * charged to the target loaded or run meanwhile
+ */
+long
+cmp_rss(void)
+{
+    struct rusage ru;
+
+    if (getrusage(RUSAGE_SELF, &ru) == -1)
+        err(1, "getrusage");
+
+    return (ru.ru_maxrss);
+}
+
+void
+cmp_target_parse(struct cmp_target *t, char *spec)
+{
+    struct backend *b;
+    char *name, *cache;
+
+    t->spec = strdup(spec);
+    name = strsep(&spec, ":");
+    if (spec == NULL || *spec == '\0')
+        errx(1, "%s: datafile missing", t->spec);
+    t->datafile = strsep(&spec, ":");
+    cache = spec;
+
+    TAILQ_FOREACH(b, &backends, entry)
+        if (strcasecmp(name, b->name) == 0)
+            break;
+    if (b == NULL)
+        errx(1, "%s: unknown backend %s", t->spec, name);
+    t->b = b;
+
+    if (cache == NULL)
+        t->cache = CACHE_DEFAULT;
+    else if (!strcmp(cache, "standard"))
+        t->cache = CACHE_STANDARD;
+    else if (!strcmp(cache, "memory"))
+        t->cache = CACHE_MEMORY;
+    else if (!strcmp(cache, "mmap"))
+        t->cache = CACHE_MMAP;
+    else if (!strcmp(cache, "shared"))
+        t->cache = CACHE_SHARED;
+    else
+        errx(1, "%s: unknown cache mode %s", t->spec, cache);
+}
+
+void
+cmp_target_load(struct cmp_target *t)
+{
+    uint64_t start;
+    long rss;
+    void *region;
+
+    rss = cmp_rss();
+    start = cmp_clock();
+    if ((t->handler = t->b->gl_bic(t->datafile, t->cache)) == NULL)
+        errx(1, "%s: cannot be loaded", t->spec);
+    t->load = cmp_clock() - start;
+    t->rss_load = cmp_rss() - rss;
+
+    if (t->b->gl_bmc != NULL &&
+        t->b->gl_bmc(t->handler, &region, &t->region) == -1)
+        t->region = 0;
+}
+
+int
+cmp_field_parse(const char *name)
+{
+    int i;
+
+    for (i = 0; i < GEOLOC_NFIELDS; i++)
+        if (strcmp(name, field_names[i]) == 0)
+            return (i);
+
+    errx(1, "unknown field %s", name);
+}
+
+/*
+ * Addresses from a file, one per line, the reserved
+ * ones being answered by geolocd without the backend
+ */
+size_t
+addrs_load(const char *path, struct geoloc_addr **addrs, char ***keys)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t linesz = 0, n = 0, sz = 0, skipped = 0;
+    ssize_t len;
+    struct geoloc_addr addr;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        err(1, "%s", path);
+
+    while ((len = getline(&line, &linesz, fp)) != -1) {
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        if (addr_parse(line, &addr) == -1 ||
+            addr_reserved(&addr) != RESERVED_NONE) {
+            skipped++;
+            continue;
+        }
+        if (n == sz) {
+            sz = (sz == 0 ? 1024 : sz * 2);
+            if ((*addrs = reallocarray(*addrs, sz, sizeof(**addrs))) == NULL ||
+                (*keys = reallocarray(*keys, sz, sizeof(**keys))) == NULL)
+                err(1, "reallocarray");
+        }
+        (*addrs)[n] = addr;
+        if (((*keys)[n] = strdup(line)) == NULL)
+            err(1, "strdup");
+        n++;
+    }
+    if (ferror(fp))
+        err(1, "%s", path);
+    free(line);
+    fclose(fp);
+
+    if (skipped > 0)
+        warnx("%s: %zu invalid or reserved addresses skipped", path, skipped);
+    if (n == 0)
+        errx(1, "%s: no address", path);
+
+    return (n);
+}
+
+/*
+ * Random public IPv4 addresses
+ */
+size_t
+addrs_synth(size_t n, struct geoloc_addr **addrs, char ***keys)
+{
+    char buf[INET6_ADDRSTRLEN];
+    uint32_t v4;
+    size_t i;
+
+    if ((*addrs = calloc(n, sizeof(**addrs))) == NULL ||
+        (*keys = calloc(n, sizeof(**keys))) == NULL)
+        err(1, "calloc");
+
+    for (i = 0; i < n; ) {
+        v4 = htonl(cmp_rand());
+        (*addrs)[i].a[10] = (*addrs)[i].a[11] = 0xff;
+        memcpy(&(*addrs)[i].a[12], &v4, sizeof(v4));
+        if (addr_reserved(&(*addrs)[i]) != RESERVED_NONE)
+            continue;
+        addr_format(&(*addrs)[i], buf, sizeof(buf));
+        if (((*keys)[i] = strdup(buf)) == NULL)
+            err(1, "strdup");
+        i++;
+    }
+
+    return (n);
+}
+
+/*
+ * As geolocd looks up a parsed address, through the
+ * address callback when the backend has one
+ */
+const char *
+cmp_lookup(struct cmp_target *t, const struct geoloc_addr *addr,
+    const char *key, enum lookup_info_type li, void **ref)
+{
+    const char *info = NULL;
+
+    if (t->b->gl_bac != NULL)
+        *ref = t->b->gl_bac(t->handler, addr, li, &info);
+    else
+        *ref = t->b->gl_blic(t->handler, key, li, &info);
+
+    return (info == NULL ? "" : info);
+}
+
+/*
+ * Times every lookup of the field, the latencies array
+ * being resident already not to count in the memory
+ */
+void
+cmp_run(struct cmp_target *t, enum lookup_info_type li,
+    const struct geoloc_addr *addrs, char **keys, size_t n)
+{
+    struct cmp_field *f = &t->fields[li];
+    const char *info;
+    uint64_t start, end, total = 0;
+    size_t i;
+    long rss;
+    void *ref;
+
+    rss = cmp_rss();
+    for (i = 0; i < n; i++) {
+        start = cmp_clock();
+        info = cmp_lookup(t, &addrs[i], keys[i], li, &ref);
+        end = cmp_clock();
+        f->lat[i] = (end - start > UINT32_MAX ? UINT32_MAX : end - start);
+        total += end - start;
+
+        if (*info == '\0')
+            f->empty++;
+        if (ref != NULL)
+            t->b->gl_blcc(t->handler, ref);
+    }
+    f->total = total;
+    t->rss_lookup += cmp_rss() - rss;
+}
+
+/*
+ * Answers of the first target compared with the others', once
+ * all are measured
+ */
+void
+cmp_compare(struct cmp_target *targets, size_t ntargets,
+    enum lookup_info_type li, const struct geoloc_addr *addrs, char **keys,
+    size_t n)
+{
+    char value[GEOLOC_VALUE_MAX];
+    const char *info;
+    size_t i, j;
+    void *ref;
+
+    for (i = 0; i < n; i++) {
+        info = cmp_lookup(&targets[0], &addrs[i], keys[i], li, &ref);
+        strlcpy(value, info, sizeof(value));
+        if (ref != NULL)
+            targets[0].b->gl_blcc(targets[0].handler, ref);
+
+        for (j = 1; j < ntargets; j++) {
+            info = cmp_lookup(&targets[j], &addrs[i], keys[i], li, &ref);
+            if (strncmp(info, value, sizeof(value) - 1) != 0)
+                targets[j].fields[li].differ++;
+            if (ref != NULL)
+                targets[j].b->gl_blcc(targets[j].handler, ref);
+        }
+    }
+}
+
+int
+cmp_lat_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x < y ? -1 : x > y);
+}
+
+/*
+ * Lookup latency in nanoseconds, with the rate of empty
+ * answers and of answers differing from the first target
+ */
+void
+cmp_report(struct cmp_target *targets, size_t ntargets,
+    enum lookup_info_type li, size_t n)
+{
+    struct cmp_field *f;
+    size_t i;
+
+    printf("\nfield %s, %zu addresses\n", field_names[li], n);
+    printf("%-32s %10s %7s %7s %7s %7s %9s %7s %7s\n", "ns", "lookups/s",
+        "p50", "p90", "p99", "p99.9", "max", "empty", "differ");
+    for (i = 0; i < ntargets; i++) {
+        f = &targets[i].fields[li];
+        qsort(f->lat, n, sizeof(*f->lat), cmp_lat_cmp);
+        printf("%-32s %10.0f %7u %7u %7u %7u %9u %6.2f%%", targets[i].spec,
+            f->total > 0 ? n * 1e9 / f->total : 0.0,
+            f->lat[n * 50 / 100], f->lat[n * 90 / 100], f->lat[n * 99 / 100],
+            f->lat[n * 999 / 1000], f->lat[n - 1], 100.0 * f->empty / n);
+        if (i == 0)
+            printf(" %7s\n", "-");
+        else
+            printf(" %6.2f%%\n", 100.0 * f->differ / n);
+        free(f->lat);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    struct geolocd_conf conf;
+    struct cmp_target targets[CMP_TARGETS_MAX];
+    struct cmp_field *f;
+    struct geoloc_addr *addrs = NULL;
+    uint32_t fields = 0;
+    const char *errstr, *path = NULL;
+    char **keys = NULL;
+    size_t count = CMP_ADDRS, n, ntargets, i;
+    int ch, li;
+
+    bzero(&conf, sizeof(conf));
+    bzero(targets, sizeof(targets));
+
+    while ((ch = getopt(argc, argv, "a:c:f:p:s:")) != -1) {
+        switch (ch) {
+        case 'a':
+            path = optarg;
+            break;
+        case 'c':
+            count = strtonum(optarg, 1, 100000000, &errstr);
+            if (errstr != NULL)
+                errx(1, "count %s: %s", optarg, errstr);
+            break;
+        case 'f':
+            fields |= 1U << cmp_field_parse(optarg);
+            break;
+        case 'p':
+            if (conf.nplugins == GEOLOC_PLUGINS_MAX)
+                errx(1, "too many plugins");
+            conf.plugins[conf.nplugins++] = optarg;
+            break;
+        case 's':
+            seed = strtonum(optarg, 1, UINT32_MAX, &errstr);
+            if (errstr != NULL)
+                errx(1, "seed %s: %s", optarg, errstr);
+            break;
+        default:
+            usage();
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc == 0)
+        usage();
+    if (argc > CMP_TARGETS_MAX)
+        errx(1, "%d backends at most", CMP_TARGETS_MAX);
+    if (fields == 0)
+        fields = 1U << GEOLOC_COUNTRY;
+
+    log_init(1);
+    init_modules(&conf);
+
+    ntargets = argc;
+    for (i = 0; i < ntargets; i++)
+        cmp_target_parse(&targets[i], argv[i]);
+
+    if (path != NULL)
+        n = addrs_load(path, &addrs, &keys);
+    else
+        n = addrs_synth(count, &addrs, &keys);
+    for (i = 0; i < ntargets; i++) {
+        for (li = 0; li < GEOLOC_NFIELDS; li++) {
+            if ((fields & (1U << li)) == 0)
+                continue;
+            f = &targets[i].fields[li];
+            if ((f->lat = reallocarray(NULL, n, sizeof(*f->lat))) == NULL)
+                err(1, "reallocarray");
+            /* resident before any measure */
+            memset(f->lat, 0, n * sizeof(*f->lat));
+        }
+    }
+
+    printf("%-32s %10s %10s %10s %10s\n", "backend", "load ms",
+        "region KB", "load KB", "lookup KB");
+    for (i = 0; i < ntargets; i++) {
+        cmp_target_load(&targets[i]);
+        for (li = 0; li < GEOLOC_NFIELDS; li++)
+            if (fields & (1U << li))
+                cmp_run(&targets[i], li, addrs, keys, n);
+        printf("%-32s %10.1f %10zu %10ld %10ld\n", targets[i].spec,
+            targets[i].load / 1e6, targets[i].region / 1024,
+            targets[i].rss_load, targets[i].rss_lookup);
+    }
+
+    for (li = 0; li < GEOLOC_NFIELDS; li++) {
+        if ((fields & (1U << li)) == 0)
+            continue;
+        cmp_compare(targets, ntargets, li, addrs, keys, n);
+        cmp_report(targets, ntargets, li, n);
+    }
+
+    for (i = 0; i < ntargets; i++) {
+        targets[i].b->gl_bsc(targets[i].handler);
+        free((char *)targets[i].spec);
+    }
+    for (i = 0; i < n; i++)
+        free(keys[i]);
+    free(keys);
+    free(addrs);
+    dispose_modules();
+
+    return (0);
+}
@@ -18,11 +18,18 @@
 
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef  HAVE_NO_BSDFUNCS
+#include <bsd/string.h>
+#endif
 
 #include <err.h>
 #include <pwd.h>
 #include <getopt.h>
 #include <errno.h>
+#include <netdb.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -31,35 +38,740 @@
 
 #include <geoloc.h>
 
+#include "ring.h"
+
+#define CTL_ENDPOINTS_MAX 16
+#define CTL_STRING_MAX 4096
+
+/*
+ * A daemon to send requests to, its local socket or its TCP
+ * listener, with the batch of keys of its slice being filled
+ */
+struct ctl_endpoint {
+    const char *path;
+    const char *host;
+    int fd;
+    char *keys;
+    size_t len;
+    uint32_t count;
+};
+
+/*
+ * Statistics of the instances bound to a NUMA node, -1 for the
+ * unbound ones
+ */
+struct ctl_node {
+    int node;
+    unsigned instances;
+    unsigned long long lookups;
+    unsigned long long table_lookups;
+    unsigned long long usec;
+};
+
 struct geolocd_conf *conf = NULL;
+struct ctl_endpoint endpoints[CTL_ENDPOINTS_MAX];
+unsigned nendpoints = 0;
+/* endpoints that failed, their keys going to the next ones of the ring */
+uint8_t down[CTL_ENDPOINTS_MAX];
+struct ring ring;
+const char *ctl_port = NULL;
 void usage(void);
+void ctl_endpoint_add(const char *, const char *);
+const char *ctl_endpoint_name(const struct ctl_endpoint *);
+int ctl_connect(const struct ctl_endpoint *);
+int ctl_connect_tcp(const char *);
+int ctl_recv(int, void *, size_t);
+char *ctl_reply(int, struct msg_ctl_res *);
+int ctl_batch(int, struct msg_ctl_req, const char *, uint32_t, uint32_t);
+int ctl_class(int, enum msg_field);
+int ctl_bulk(struct msg_ctl_req);
+int ctl_shard_add(struct msg_ctl_req, const char *, size_t);
+int ctl_shard_flush(struct msg_ctl_req, unsigned);
+int ctl_keyed(struct msg_ctl_req, const char *);
+int ctl_request(int, struct msg_ctl_req, const char *);
+int ctl_stream(int);
+int ctl_string(int);
+int ctl_string_read(int, char *, size_t);
+int ctl_reload(void);
+int ctl_reload_phase(enum msg_field, const char *);
+int ctl_stats(struct msg_ctl_req);
 
 void
 usage(void)
 {
     extern char *__progname;
 
-    fprintf(stderr, "usage: %s -r <backend|property> (-f <field info requested> -p <value for property lookup> -c <config file path>)\n", __progname);
+    fprintf(stderr, "usage: %s -r <backend|property|bulk|enumerate|reverse|nearest|radius|stats|analytics|slowlog|build|delta> (-f <field info requested> -p <value for property lookup> -c <config file path> -s <daemon socket> ... -t <daemon host> ... -P <daemon port>)\n", __progname);
     exit(1);
 }
 
+void
+ctl_endpoint_add(const char *path, const char *host)
+{
+    struct ctl_endpoint *e;
+
+    if (nendpoints == CTL_ENDPOINTS_MAX)
+        errx(1, "too many endpoints, %d at most", CTL_ENDPOINTS_MAX);
+
+    e = &endpoints[nendpoints++];
+    e->path = path;
+    e->host = host;
+    e->fd = -1;
+}
+
+const char *
+ctl_endpoint_name(const struct ctl_endpoint *e)
+{
+    return (e->host != NULL ? e->host : e->path);
+}
+
+int
+ctl_connect(const struct ctl_endpoint *e)
+{
+    struct sockaddr_un sun;
+    int fd;
+
+    if (e->host != NULL)
+        return (ctl_connect_tcp(e->host));
+
+    bzero(&sun, sizeof(sun)); 
+    sun.sun_family = AF_UNIX;
+    if (strlcpy(sun.sun_path, e->path, sizeof(sun.sun_path)) >=
+        sizeof(sun.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", e->path);
+        return (-1);
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        fprintf(stderr, "cannot create ctl socket\n");
+        return (-1);
+    }
+
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+        fprintf(stderr, "cannot connect to %s\n", e->path);
+        close(fd);
+        return (-1);
+    }
+
+    return (fd);
+}
+
+/*
+ * Same protocol over TCP, Nagle off as requests are written whole
+ */
+int
+ctl_connect_tcp(const char *host)
+{
+    struct addrinfo hints, *res, *ai;
+    char port[8];
+    int fd = -1, on = 1, error;
+
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (ctl_port == NULL)
+        snprintf(port, sizeof(port), "%u", GEOLOCD_PORT);
+    else
+        strlcpy(port, ctl_port, sizeof(port));
+
+    if ((error = getaddrinfo(host, port, &hints, &res)) != 0) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(error));
+        return (-1);
+    }
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype,
+            ai->ai_protocol)) == -1)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd == -1) {
+        fprintf(stderr, "cannot connect to %s port %s\n", host, port);
+        return (-1);
+    }
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    return (fd);
+}
+
+int
+ctl_recv(int fd, void *buf, size_t len)
+{
+    size_t off = 0;
+    ssize_t n;
+
+    while (off < len) {
+        if ((n = recv(fd, (char *)buf + off, len - off, 0)) <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            return (-1);
+        }
+        off += n;
+    }
+
+    return (0);
+}
+
+/*
+ * Reads a vectored reply, the strings are returned
+ * in a single buffer to be freed by the caller
+ */
+char *
+ctl_reply(int fd, struct msg_ctl_res *res)
+{
+    char *data;
+
+    if (ctl_recv(fd, res, sizeof(*res)) == -1) {
+        fprintf(stderr, "cannot read reply\n");
+        return (NULL);
+    }
+
+    if (res->status == MSG_STATUS_OVERLOADED)
+        fprintf(stderr, "server overloaded\n");
+    else if (res->status != MSG_STATUS_OK)
+        fprintf(stderr, "invalid request\n");
+
+    if ((data = malloc(res->len + 1)) == NULL)
+        err(1, "malloc");
+
+    if (ctl_recv(fd, data, res->len) == -1) {
+        fprintf(stderr, "truncated reply\n");
+        free(data);
+        return (NULL);
+    }
+    data[res->len] = '\0';
+
+    return (data);
+}
+
+/*
+ * Prints a string reply, whatever its length
+ */
+int
+ctl_string(int fd)
+{
+    char buf[1024];
+    ssize_t n, i;
+
+    for (;;) {
+        if ((n = recv(fd, buf, sizeof(buf), 0)) <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            printf("\n");
+            return (-1);
+        }
+        for (i = 0; i < n && buf[i] != '\0'; i++)
+            ;
+        fwrite(buf, 1, i, stdout);
+        if (i < n)
+            break;
+    }
+    printf("\n");
+
+    return (0);
+}
+
+/*
+ * Reads a string reply into buf, truncated to its size
+ */
+int
+ctl_string_read(int fd, char *buf, size_t len)
+{
+    char chunk[1024];
+    size_t off = 0;
+    ssize_t n, i;
+
+    for (;;) {
+        if ((n = recv(fd, chunk, sizeof(chunk), 0)) <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            buf[off] = '\0';
+            return (-1);
+        }
+        for (i = 0; i < n && chunk[i] != '\0'; i++)
+            if (off < len - 1)
+                buf[off++] = chunk[i];
+        if (i < n)
+            break;
+    }
+    buf[off] = '\0';
+
+    return (0);
+}
+
+/*
+ * Sends a reload phase to every connected endpoint, then reads their
+ * replies, the ones differing from expected failing the phase. The
+ * commits all go out before any reply is awaited, for the instances
+ * to swap their data together.
+ */
+int
+ctl_reload_phase(enum msg_field phase, const char *expected)
+{
+    struct msg_ctl_req req;
+    char info[64];
+    unsigned i;
+    int ret = 0;
+
+    bzero(&req, sizeof(req));
+    req.type = MSG_CTL_RELOAD;
+    req.field = phase;
+
+    for (i = 0; i < nendpoints; i++)
+        if (endpoints[i].fd != -1 &&
+            send(endpoints[i].fd, &req, sizeof(req), 0) != sizeof(req)) {
+            close(endpoints[i].fd);
+            endpoints[i].fd = -1;
+            printf("Endpoint %s: unreachable\n",
+                ctl_endpoint_name(&endpoints[i]));
+            ret = -1;
+        }
+
+    for (i = 0; i < nendpoints; i++) {
+        if (endpoints[i].fd == -1)
+            continue;
+        if (ctl_string_read(endpoints[i].fd, info, sizeof(info)) == -1) {
+            close(endpoints[i].fd);
+            endpoints[i].fd = -1;
+            strlcpy(info, "unreachable", sizeof(info));
+        }
+        printf("Endpoint %s: %s\n", ctl_endpoint_name(&endpoints[i]), info);
+        if (strcmp(info, expected) != 0)
+            ret = -1;
+    }
+
+    return (ret);
+}
+
+/*
+ * Reloads several instances in two phases, all of them loading the
+ * new data aside first then swapping it in, or none of them when one
+ * fails to load it
+ */
+int
+ctl_reload(void)
+{
+    unsigned i;
+    int ret = 0;
+
+    for (i = 0; i < nendpoints; i++)
+        if ((endpoints[i].fd = ctl_connect(&endpoints[i])) == -1) {
+            printf("Endpoint %s: unreachable\n",
+                ctl_endpoint_name(&endpoints[i]));
+            ret = -1;
+        }
+
+    if (ret == 0 && ctl_reload_phase(MSG_RELOAD_PREPARE, "prepared") == 0) {
+        ret = ctl_reload_phase(MSG_RELOAD_COMMIT, "reloaded");
+    } else {
+        ctl_reload_phase(MSG_RELOAD_ABORT, "aborted");
+        ret = -1;
+    }
+
+    for (i = 0; i < nendpoints; i++)
+        if (endpoints[i].fd != -1) {
+            close(endpoints[i].fd);
+            endpoints[i].fd = -1;
+        }
+
+    return (ret);
+}
+
+/*
+ * Prints the statistics of every instance, followed by their lookups
+ * and lookup time summed up per NUMA node when there are several
+ */
+int
+ctl_stats(struct msg_ctl_req req)
+{
+    struct ctl_node nodes[CTL_ENDPOINTS_MAX];
+    struct ctl_node *n;
+    char info[CTL_STRING_MAX];
+    char *line, *last;
+    unsigned long long lookups, table_lookups, usec, v;
+    unsigned i, j, nnodes = 0;
+    int node, fd, ret = 0;
+
+    for (i = 0; i < nendpoints; i++) {
+        if (nendpoints > 1)
+            printf("Endpoint %s\n", ctl_endpoint_name(&endpoints[i]));
+        if ((fd = ctl_connect(&endpoints[i])) == -1) {
+            ret = -1;
+            continue;
+        }
+        if (send(fd, &req, sizeof(req), 0) != sizeof(req) ||
+            ctl_string_read(fd, info, sizeof(info)) == -1) {
+            close(fd);
+            ret = -1;
+            continue;
+        }
+        close(fd);
+        printf("%s\n", info);
+
+        node = -1;
+        lookups = table_lookups = usec = 0;
+        for (line = strtok_r(info, "\n", &last); line != NULL;
+            line = strtok_r(NULL, "\n", &last)) {
+            if (sscanf(line, "lookups %llu", &v) == 1)
+                lookups = v;
+            else if (sscanf(line, "table lookups %llu", &v) == 1)
+                table_lookups = v;
+            else if (sscanf(line, "lookup usec %llu", &v) == 1)
+                usec = v;
+            else
+                sscanf(line, "numa node %d", &node);
+        }
+
+        for (j = 0; j < nnodes && nodes[j].node != node; j++)
+            ;
+        n = &nodes[j];
+        if (j == nnodes) {
+            bzero(n, sizeof(*n));
+            n->node = node;
+            nnodes++;
+        }
+        n->instances++;
+        n->lookups += lookups;
+        n->table_lookups += table_lookups;
+        n->usec += usec;
+    }
+
+    if (nendpoints < 2)
+        return (ret);
+
+    printf("Per NUMA node\n");
+    for (j = 0; j < nnodes; j++) {
+        n = &nodes[j];
+        if (n->node == -1)
+            printf("unbound");
+        else
+            printf("node %d", n->node);
+        printf(" instances %u lookups %llu table lookups %llu "
+            "lookup usec %llu usec per lookup %.2f\n", n->instances,
+            n->lookups, n->table_lookups, n->usec, n->lookups == 0 ? 0.0 :
+            (double)n->usec / n->lookups);
+    }
+
+    return (ret);
+}
+
+/*
+ * Sets the connection priority class, acknowledged by a string reply
+ */
+int
+ctl_class(int fd, enum msg_field class)
+{
+    struct msg_ctl_req req;
+    char ack[16];
+    size_t off = 0;
+
+    bzero(&req, sizeof(req));
+    req.type = MSG_CTL_CLASS;
+    req.field = class;
+    send(fd, &req, sizeof(req), 0);
+
+    do {
+        if (ctl_recv(fd, ack + off, 1) == -1)
+            return (-1);
+    } while (ack[off] != '\0' && ++off < sizeof(ack));
+
+    return (0);
+}
+
+/*
+ * Sends a batch and prints its replies: -1 when the endpoint fails
+ * before replying, nothing of the batch being printed then, 1 when
+ * it replies with an error status
+ */
+int
+ctl_batch(int fd, struct msg_ctl_req req, const char *keys, uint32_t count, uint32_t len)
+{
+    struct msg_ctl_batch batch;
+    struct msg_ctl_res res;
+    const char *key;
+    char *data, *val;
+    uint32_t i;
+
+    batch.count = count;
+    batch.len = len;
+
+    if (send(fd, &req, sizeof(req), 0) != sizeof(req) ||
+        send(fd, &batch, sizeof(batch), 0) != sizeof(batch) ||
+        send(fd, keys, len, 0) != (ssize_t)len)
+        return (-1);
+
+    if ((data = ctl_reply(fd, &res)) == NULL)
+        return (-1);
+
+    if (res.status != MSG_STATUS_OK) {
+        free(data);
+        return (1);
+    }
+
+    key = keys;
+    val = data;
+    for (i = 0; i < res.count && i < count; i++) {
+        printf("%s %s\n", key, val);
+        key += strlen(key) + 1;
+        val += strlen(val) + 1;
+    }
+
+    free(data);
+
+    return (0);
+}
+
+/*
+ * Streamed reply of (prefix, value) pairs, up to an empty frame
+ */
+int
+ctl_stream(int fd)
+{
+    struct msg_ctl_res res;
+    char *data, *prefix, *val;
+    uint32_t i;
+
+    for (;;) {
+        if ((data = ctl_reply(fd, &res)) == NULL)
+            return (-1);
+
+        prefix = data;
+        for (i = 0; i + 1 < res.count; i += 2) {
+            val = prefix + strlen(prefix) + 1;
+            printf("%s %s\n", prefix, val);
+            prefix = val + strlen(val) + 1;
+        }
+
+        free(data);
+        if (res.count == 0)
+            break;
+    }
+
+    return (res.status == MSG_STATUS_OK ? 0 : -1);
+}
+
+/*
+ * Addresses are read from the standard input, one per line, and
+ * sent per GEOLOC_BATCH_MAX over a single bulk class connection per
+ * endpoint, each one getting the addresses of its slice of the ring
+ */
+int
+ctl_bulk(struct msg_ctl_req req)
+{
+    char *line = NULL;
+    size_t linesz = 0, n;
+    ssize_t linelen;
+    unsigned i;
+    int ret = 0;
+
+    for (i = 0; i < nendpoints; i++)
+        if ((endpoints[i].keys =
+            malloc(GEOLOC_BATCH_MAX * GEOLOC_ADDR_MAX)) == NULL)
+            err(1, "malloc");
+
+    while (ret == 0 && (linelen = getline(&line, &linesz, stdin)) != -1) {
+        line[strcspn(line, " \t\r\n")] = '\0';
+        if ((n = strlen(line)) == 0 || n >= GEOLOC_ADDR_MAX)
+            continue;
+        ret = ctl_shard_add(req, line, n);
+    }
+
+    for (i = 0; ret == 0 && i < nendpoints; i++)
+        if (endpoints[i].count > 0)
+            ret = ctl_shard_flush(req, i);
+
+    for (i = 0; i < nendpoints; i++) {
+        if (endpoints[i].fd != -1)
+            close(endpoints[i].fd);
+        free(endpoints[i].keys);
+    }
+    free(line);
+
+    return (ret);
+}
+
+/*
+ * Appends the key to the batch of its endpoint, sent once full
+ */
+int
+ctl_shard_add(struct msg_ctl_req req, const char *key, size_t n)
+{
+    struct ctl_endpoint *e;
+    unsigned node;
+
+    if ((node = ring_node(&ring, ring_key(key), down)) == RING_NONE) {
+        fprintf(stderr, "no endpoint left\n");
+        return (-1);
+    }
+
+    e = &endpoints[node];
+    memcpy(e->keys + e->len, key, n + 1);
+    e->len += n + 1;
+
+    if (++e->count == GEOLOC_BATCH_MAX)
+        return (ctl_shard_flush(req, node));
+
+    return (0);
+}
+
+/*
+ * Sends the batch of the endpoint. When the endpoint cannot be
+ * reached, or fails before replying to the batch, it is marked
+ * down and the keys of the batch, none printed yet, are spread
+ * again, going to the next nodes of the ring. An error reply is
+ * not failed over, the endpoint having answered.
+ */
+int
+ctl_shard_flush(struct msg_ctl_req req, unsigned node)
+{
+    struct ctl_endpoint *e = &endpoints[node];
+    char *keys, *key;
+    uint32_t i, count;
+    int ret = 0;
+
+    if (e->fd == -1 && (e->fd = ctl_connect(e)) != -1 &&
+        ctl_class(e->fd, MSG_CLASS_BULK) == -1) {
+        close(e->fd);
+        e->fd = -1;
+    }
+
+    if (e->fd != -1 &&
+        (ret = ctl_batch(e->fd, req, e->keys, e->count, e->len)) != -1) {
+        e->count = 0;
+        e->len = 0;
+        return (ret == 0 ? 0 : -1);
+    }
+    ret = 0;
+
+    fprintf(stderr, "%s down, its addresses sent to the next endpoints\n",
+        ctl_endpoint_name(e));
+    down[node] = 1;
+    if (e->fd != -1) {
+        close(e->fd);
+        e->fd = -1;
+    }
+
+    /* the batch is taken out, the endpoint having no slice anymore */
+    keys = e->keys;
+    count = e->count;
+    if ((e->keys = malloc(GEOLOC_BATCH_MAX * GEOLOC_ADDR_MAX)) == NULL)
+        err(1, "malloc");
+    e->count = 0;
+    e->len = 0;
+
+    for (i = 0, key = keys; ret == 0 && i < count; i++) {
+        ret = ctl_shard_add(req, key, strlen(key));
+        key += strlen(key) + 1;
+    }
+    free(keys);
+
+    return (ret);
+}
+
+/*
+ * A request about an address goes to the endpoint of its slice,
+ * or to the next ones of the ring while they cannot be reached
+ */
+int
+ctl_keyed(struct msg_ctl_req req, const char *proparg)
+{
+    char key[GEOLOC_ADDR_MAX];
+    unsigned node;
+    uint64_t hash;
+    int fd, ret;
+
+    strlcpy(key, proparg, sizeof(key));
+    key[strcspn(key, " /")] = '\0';
+    hash = ring_key(key);
+
+    while ((node = ring_node(&ring, hash, down)) != RING_NONE) {
+        if ((fd = ctl_connect(&endpoints[node])) != -1) {
+            ret = ctl_request(fd, req, proparg);
+            close(fd);
+            return (ret);
+        }
+        fprintf(stderr, "%s down, trying the next endpoint\n",
+            ctl_endpoint_name(&endpoints[node]));
+        down[node] = 1;
+    }
+
+    fprintf(stderr, "no endpoint left\n");
+    return (-1);
+}
+
+/*
+ * Sends the request and prints its reply
+ */
+int
+ctl_request(int fd, struct msg_ctl_req req, const char *proparg)
+{
+    send(fd, &req, sizeof(struct msg_ctl_req), 0); 
+    if (proparg != NULL)
+        send(fd, proparg, strlen(proparg) + 1, 0);
+
+    if (req.type == MSG_CTL_PROPERTY_ALL) {
+        static const char *labels[] = { "ccode", "isp", "mnc", "mcc", "city",
+            "coords" };
+        struct msg_ctl_res res;
+        char *data, *val;
+        uint32_t i;
+
+        if ((data = ctl_reply(fd, &res)) == NULL)
+            return (-1);
+        val = data;
+        for (i = 0; i < res.count && i < nitems(labels); i++) {
+            printf("%s: %s\n", labels[i], val);
+            val += strlen(val) + 1;
+        }
+        free(data);
+        return (0);
+    }
+
+    if (req.type == MSG_CTL_NEAREST) {
+        struct msg_ctl_res res;
+        char *data, *val;
+        uint32_t i;
+
+        if ((data = ctl_reply(fd, &res)) == NULL)
+            return (-1);
+        for (i = 0, val = data; i < res.count; i++) {
+            printf("%s\n", val);
+            val += strlen(val) + 1;
+        }
+        free(data);
+        return (0);
+    }
+
+    if (req.type == MSG_CTL_ENUMERATE || req.type == MSG_CTL_REVERSE ||
+        req.type == MSG_CTL_RADIUS)
+        return (ctl_stream(fd));
+
+    return (ctl_string(fd));
+}
+
 int
 main(int argc, char *argv[])
 {
     int c;
-    int ctl_fd; 
+    int ctl_fd, local = 0, ret = 0;
+    unsigned i;
+    int bulk = 0, allfields = 0, enumerate = 0, reverse = 0, delta = 0;
     const char *reqarg = NULL, *fieldarg = NULL, *proparg = NULL;
     const char *conffile = CONF_FILE;
-    char resdata[1024];
     struct msg_ctl_req req;
     extern char         *__progname;
 
-    resdata[0] = '\0';
     bzero(&req, sizeof(req));
     req.type = MSG_CTL_NONE;
     req.field = MSG_NONE;
 
-    while ((c = getopt(argc, argv, "r:f:p:c:")) != -1) {
+    while ((c = getopt(argc, argv, "r:f:p:c:s:t:P:")) != -1) {
         switch(c) {
         case 'r':
             reqarg = optarg;
@@ -71,6 +783,35 @@ main(int argc, char *argv[])
                 req.type = MSG_CTL_PROPERTY;
                 if (req.field == MSG_NONE)
                     req.field = MSG_PROPERTY_CCODE;
+            } else if (strcasecmp(reqarg, "bulk") == 0) {
+                bulk = 1;
+            } else if (strcasecmp(reqarg, "enumerate") == 0) {
+                enumerate = 1;
+            } else if (strcasecmp(reqarg, "reverse") == 0) {
+                reverse = 1;
+            } else if (strcasecmp(reqarg, "delta") == 0) {
+                delta = 1;
+            } else if (strcasecmp(reqarg, "nearest") == 0) {
+                req.type = MSG_CTL_NEAREST;
+                req.field = MSG_NONE;
+            } else if (strcasecmp(reqarg, "radius") == 0) {
+                req.type = MSG_CTL_RADIUS;
+                req.field = MSG_NONE;
+            } else if (strcasecmp(reqarg, "slowlog") == 0) {
+                req.type = MSG_CTL_SLOWLOG;
+                req.field = MSG_NONE;
+            } else if (strcasecmp(reqarg, "stats") == 0) {
+                req.type = MSG_CTL_STATS;
+                req.field = MSG_NONE;
+            } else if (strcasecmp(reqarg, "build") == 0) {
+                req.type = MSG_CTL_BUILD;
+                req.field = MSG_NONE;
+            } else if (strcasecmp(reqarg, "memory") == 0) {
+                req.type = MSG_CTL_MEMORY;
+                req.field = MSG_NONE;
+            } else if (strcasecmp(reqarg, "analytics") == 0) {
+                req.type = MSG_CTL_ANALYTICS;
+                req.field = MSG_NONE;
             } else if (strcasecmp(reqarg, "shutdown") == 0) {
                 req.type = MSG_CTL_SHUTDOWN;
                 req.field = MSG_NONE;
@@ -105,6 +846,14 @@ main(int argc, char *argv[])
             } else if (strcasecmp(fieldarg, "mcc") == 0) {
                 req.field = MSG_PROPERTY_MCC;
                 req.type = MSG_CTL_PROPERTY;
+            } else if (strcasecmp(fieldarg, "city") == 0) {
+                req.field = MSG_PROPERTY_CITY;
+                req.type = MSG_CTL_PROPERTY;
+            } else if (strcasecmp(fieldarg, "coords") == 0) {
+                req.field = MSG_PROPERTY_COORDS;
+                req.type = MSG_CTL_PROPERTY;
+            } else if (strcasecmp(fieldarg, "all") == 0) {
+                allfields = 1;
             } else {
                 fprintf(stderr, "invalid field\n");
                 exit(-1);
@@ -116,6 +865,16 @@ main(int argc, char *argv[])
         case 'c':
             conffile = optarg;
             break;
+        case 's':
+            ctl_endpoint_add(optarg, NULL);
+            local = 1;
+            break;
+        case 't':
+            ctl_endpoint_add(NULL, optarg);
+            break;
+        case 'P':
+            ctl_port = optarg;
+            break;
         default:
             fprintf(stderr, "invalid arguments");
             exit(-1);
@@ -124,35 +883,67 @@ main(int argc, char *argv[])
 
 	argc -= optind;
 	argv += optind;
+
+    if (bulk) {
+        req.type = MSG_CTL_PROPERTY_BATCH;
+        if (req.field < MSG_PROPERTY_CCODE)
+            req.field = MSG_PROPERTY_CCODE;
+    } else if (enumerate || reverse || delta) {
+        req.type = (enumerate ? MSG_CTL_ENUMERATE :
+            (reverse ? MSG_CTL_REVERSE : MSG_CTL_DELTA));
+        if (req.field < MSG_PROPERTY_CCODE)
+            req.field = MSG_PROPERTY_CCODE;
+    } else if (allfields) {
+        req.type = MSG_CTL_PROPERTY_ALL;
+        req.field = MSG_NONE;
+    }
+
 	if (argc > 0 || reqarg == NULL ||
-        (req.type == MSG_CTL_PROPERTY && proparg == NULL))
+        ((bulk || enumerate || reverse || delta) && allfields) ||
+        ((req.type == MSG_CTL_PROPERTY || req.type == MSG_CTL_PROPERTY_ALL ||
+        req.type == MSG_CTL_ENUMERATE || req.type == MSG_CTL_REVERSE ||
+        req.type == MSG_CTL_DELTA || req.type == MSG_CTL_NEAREST ||
+        req.type == MSG_CTL_RADIUS) &&
+        proparg == NULL))
 		usage();
 
-    if ((conf = parse_config(conffile)) == NULL)
-        exit(1);
+    if (nendpoints == 0 || local) {
+        if ((conf = parse_config(conffile)) == NULL)
+            exit(1);
 
-    if (geteuid())
-        errx(1, "need root privileges");
+        if (geteuid())
+            errx(1, "need root privileges");
 
-    if (getpwnam(GEOLOCD_USER) == NULL)
-        errx(1, "unknown user %s", GEOLOCD_USER);
+        if (getpwnam(GEOLOCD_USER) == NULL)
+            errx(1, "unknown user %s", GEOLOCD_USER);
 
-    struct sockaddr_un sun;
-    bzero(&sun, sizeof(sun)); 
-    sun.sun_family = AF_UNIX;
-    strlcpy(sun.sun_path, GEOLOCD_SOCKET, sizeof(sun.sun_path));
+        if (nendpoints == 0) {
+            ctl_endpoint_add(conf->socket != NULL ? conf->socket :
+                GEOLOCD_SOCKET, NULL);
+            local = 1;
+        }
+    }
 
-    if ((ctl_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
-        fprintf(stderr, "cannot create ctl socket\n");
-        exit(1);
+    /* the ring spreads the addresses over the endpoints, by their names */
+    {
+        const char *names[CTL_ENDPOINTS_MAX];
+
+        for (i = 0; i < nendpoints; i++)
+            names[i] = ctl_endpoint_name(&endpoints[i]);
+        if (ring_init(&ring, names, nendpoints) == -1)
+            err(1, "ring_init");
     }
 
-    if (connect(ctl_fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
-        fprintf(stderr, "cannot create ctl connect\n");
-        goto shutdown;
+    signal(SIGPIPE, SIG_IGN);
+
+    if (req.type == MSG_CTL_PROPERTY_BATCH) {
+        ret = ctl_bulk(req);
+        ring_free(&ring);
+        return (ret);
     }
 
-    printf("Config file %s used\n", conffile);
+    if (local)
+        printf("Config file %s used\n", conffile);
 
     switch (req.type) {
     case MSG_CTL_RELOAD:
@@ -167,6 +958,39 @@ main(int argc, char *argv[])
     case MSG_CTL_PROPERTY:
         printf("Property lookup request\n");
         break;
+    case MSG_CTL_PROPERTY_ALL:
+        printf("All properties lookup request\n");
+        break;
+    case MSG_CTL_STATS:
+        printf("Statistics request\n");
+        break;
+    case MSG_CTL_SLOWLOG:
+        printf("Slow requests log request\n");
+        break;
+    case MSG_CTL_BUILD:
+        printf("Index build request\n");
+        break;
+    case MSG_CTL_MEMORY:
+        printf("Memory usage request\n");
+        break;
+    case MSG_CTL_ANALYTICS:
+        printf("Request analytics request\n");
+        break;
+    case MSG_CTL_DELTA:
+        printf("Delta update request\n");
+        break;
+    case MSG_CTL_ENUMERATE:
+        printf("Prefix enumeration request\n");
+        break;
+    case MSG_CTL_REVERSE:
+        printf("Reverse lookup request\n");
+        break;
+    case MSG_CTL_NEAREST:
+        printf("Nearest points of presence request\n");
+        break;
+    case MSG_CTL_RADIUS:
+        printf("Ranges within radius request\n");
+        break;
     default:
         break;
     }
@@ -193,6 +1017,12 @@ main(int argc, char *argv[])
     case MSG_PROPERTY_MNC:
         printf("MCC\n");
         break;
+    case MSG_PROPERTY_CITY:
+        printf("City\n");
+        break;
+    case MSG_PROPERTY_COORDS:
+        printf("Coordinates\n");
+        break;
     default:
         break;
     }
@@ -200,16 +1030,52 @@ main(int argc, char *argv[])
     if (proparg != NULL)
         printf("With property %s\n", proparg);
 
-    send(ctl_fd, &req, sizeof(struct msg_ctl_req), 0); 
-    if (proparg != NULL)
-        send(ctl_fd, proparg, strlen(proparg) + 1, 0);
-
-    recv(ctl_fd, resdata, sizeof(resdata), 0);
-
-    printf("%s\n", resdata);
+    switch (req.type) {
+    case MSG_CTL_PROPERTY:
+    case MSG_CTL_PROPERTY_ALL:
+    case MSG_CTL_NEAREST:
+    case MSG_CTL_RADIUS:
+    case MSG_CTL_ENUMERATE:
+        ret = ctl_keyed(req, proparg);
+        break;
+    case MSG_CTL_BACKEND_INFO:
+    case MSG_CTL_REVERSE:
+        /* every instance serves the whole data, the first reached answers */
+        for (i = 0; i < nendpoints; i++)
+            if ((ctl_fd = ctl_connect(&endpoints[i])) != -1)
+                break;
+        if (i == nendpoints) {
+            ret = -1;
+            break;
+        }
+        ret = ctl_request(ctl_fd, req, proparg);
+        close(ctl_fd);
+        break;
+    case MSG_CTL_STATS:
+        ret = ctl_stats(req);
+        break;
+    case MSG_CTL_RELOAD:
+        /* several instances swap their data together */
+        if (nendpoints > 1) {
+            ret = ctl_reload();
+            break;
+        }
+        /* FALLTHROUGH */
+    default:
+        /* statistics, logs and administration are per instance */
+        for (i = 0; i < nendpoints; i++) {
+            if (nendpoints > 1)
+                printf("Endpoint %s\n", ctl_endpoint_name(&endpoints[i]));
+            if ((ctl_fd = ctl_connect(&endpoints[i])) == -1 ||
+                ctl_request(ctl_fd, req, proparg) == -1)
+                ret = -1;
+            if (ctl_fd != -1)
+                close(ctl_fd);
+        }
+        break;
+    }
 
-shutdown:
-    close(ctl_fd); 
+    ring_free(&ring);
 
-    return (0);
+    return (ret == 0 ? 0 : 1);
 }
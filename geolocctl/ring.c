@@ -0,0 +1,141 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "addr.h"
+#include "ring.h"
+
+static uint64_t ring_hash(const void *, size_t);
+static int ring_cmp(const void *, const void *);
+
+/*
+ * FNV-1a, its bits mixed so that close keys spread over the ring
+ */
+static uint64_t
+ring_hash(const void *buf, size_t len)
+{
+    const uint8_t   *p = buf;
+    uint64_t        h = 14695981039346656037ULL;
+    size_t          i;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ p[i]) * 1099511628211ULL;
+
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return (h);
+}
+
+static int
+ring_cmp(const void *a, const void *b)
+{
+    const struct ring_point *pa = a, *pb = b;
+
+    if (pa->hash != pb->hash)
+        return (pa->hash < pb->hash ? -1 : 1);
+
+    return (pa->node < pb->node ? -1 : pa->node > pb->node);
+}
+
+/*
+ * The points of a node come from its name, the ring of a given
+ * set of endpoints being the same for every client
+ */
+int
+ring_init(struct ring *r, const char **names, unsigned n)
+{
+    char        buf[1024];
+    unsigned    i, v;
+    size_t      len;
+
+    bzero(r, sizeof(*r));
+    if (n == 0 ||
+        (r->points = calloc((size_t)n * RING_VNODES, sizeof(*r->points))) == NULL)
+        return (-1);
+
+    for (i = 0; i < n; i++)
+        for (v = 0; v < RING_VNODES; v++) {
+            len = snprintf(buf, sizeof(buf), "%s#%u", names[i], v);
+            if (len >= sizeof(buf))
+                len = sizeof(buf) - 1;
+            r->points[r->npoints].hash = ring_hash(buf, len);
+            r->points[r->npoints++].node = i;
+        }
+
+    qsort(r->points, r->npoints, sizeof(*r->points), ring_cmp);
+    r->nnodes = n;
+
+    return (0);
+}
+
+/*
+ * Hash of the prefix of an address, of the string itself
+ * for anything else
+ */
+uint64_t
+ring_key(const char *key)
+{
+    struct geoloc_addr  addr;
+
+    if (addr_parse(key, &addr) == 0)
+        return (ring_hash(addr.a, (addr_isv4(&addr) ? 15 : 6)));
+
+    return (ring_hash(key, strlen(key)));
+}
+
+/*
+ * First node at or after the hash going round, skipping the
+ * ones marked down, RING_NONE when they all are
+ */
+unsigned
+ring_node(const struct ring *r, uint64_t hash, const uint8_t *down)
+{
+    size_t  lo = 0, hi = r->npoints, mid, i;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (r->points[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (i = 0; i < r->npoints; i++) {
+        mid = (lo + i) % r->npoints;
+        if (down == NULL || !down[r->points[mid].node])
+            return (r->points[mid].node);
+    }
+
+    return (RING_NONE);
+}
+
+void
+ring_free(struct ring *r)
+{
+    free(r->points);
+    bzero(r, sizeof(*r));
+}
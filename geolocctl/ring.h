@@ -0,0 +1,51 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GEOLOC_RING_H_
+#define _GEOLOC_RING_H_             1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* points per node on the ring */
+#define RING_VNODES                 64
+#define RING_NONE                   ((unsigned)-1)
+
+/*
+ * Consistent hashing ring of geolocd endpoints. Addresses hash
+ * by their /24 (IPv4) or /48 (IPv6) so that a prefix is always
+ * served by the same instance, adding or removing an endpoint
+ * moving only the prefixes of its own slice.
+ */
+struct ring_point {
+    uint64_t                hash;
+    unsigned                node;
+};
+
+struct ring {
+    struct ring_point       *points;
+    size_t                  npoints;
+    unsigned                nnodes;
+};
+
+int ring_init(struct ring *, const char **, unsigned);
+uint64_t ring_key(const char *);
+unsigned ring_node(const struct ring *, uint64_t, const uint8_t *);
+void ring_free(struct ring *);
+
+#endif
@@ -0,0 +1,520 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define ADDR_SSE42          1
+#endif
+
+#include "addr.h"
+
+static int addr_parse_v4_resolve(const char *, uint8_t *);
+#ifdef ADDR_SSE42
+static int addr_parse_v4_sse42(const char *, uint8_t *);
+#endif
+
+/*
+ * the IPv4 parser of the CPU, picked by addr_parse_init before any
+ * thread starts, or at the first call in single threaded programs
+ */
+static int (*addr_parse_v4_impl)(const char *, uint8_t *) =
+    addr_parse_v4_resolve;
+static const char *addr_parse_v4_impl_name = "scalar";
+
+/* IPv4-mapped prefix length of an IPv4 one */
+#define V4(a, b, c, d, len, cl) \
+    { { { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, a, b, c, d } }, \
+      (len) + 96, cl }
+#define V6(a0, a1, a2, a3, len, cl) \
+    { { { (a0) >> 8, (a0) & 0xff, (a1) >> 8, (a1) & 0xff, \
+          (a2) >> 8, (a2) & 0xff, (a3) >> 8, (a3) & 0xff, \
+          0, 0, 0, 0, 0, 0, 0, 0 } }, len, cl }
+#define V6LAST(b15, len, cl) \
+    { { { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, b15 } }, len, cl }
+
+/*
+ * Special purpose ranges (RFC 6890 and updates) which cannot
+ * geolocate, checked before the backend is involved, the first
+ * match in order. Globally reachable addresses within one come
+ * first as not reserved.
+ */
+static const struct reserved_prefix {
+    struct geoloc_addr  prefix;
+    int                 plen;
+    enum reserved_class cl;
+} reserved[] = {
+    V4(0, 0, 0, 0,          8, RESERVED_THIS),
+    V4(10, 0, 0, 0,         8, RESERVED_PRIVATE),
+    V4(100, 64, 0, 0,      10, RESERVED_SHARED),
+    V4(127, 0, 0, 0,        8, RESERVED_LOOPBACK),
+    V4(169, 254, 0, 0,     16, RESERVED_LINKLOCAL),
+    V4(172, 16, 0, 0,      12, RESERVED_PRIVATE),
+    /* PCP anycast (RFC 7723) and TURN anycast (RFC 8155) */
+    V4(192, 0, 0, 9,       32, RESERVED_NONE),
+    V4(192, 0, 0, 10,      32, RESERVED_NONE),
+    V4(192, 0, 0, 0,       24, RESERVED_PRIVATE),
+    V4(192, 0, 2, 0,       24, RESERVED_DOCUMENTATION),
+    V4(192, 168, 0, 0,     16, RESERVED_PRIVATE),
+    V4(198, 18, 0, 0,      15, RESERVED_BENCHMARK),
+    V4(198, 51, 100, 0,    24, RESERVED_DOCUMENTATION),
+    V4(203, 0, 113, 0,     24, RESERVED_DOCUMENTATION),
+    V4(224, 0, 0, 0,        4, RESERVED_MULTICAST),
+    V4(240, 0, 0, 0,        4, RESERVED_FUTURE),
+    V6LAST(0,             128, RESERVED_THIS),
+    V6LAST(1,             128, RESERVED_LOOPBACK),
+    V6(0x0100, 0, 0, 0,    64, RESERVED_DISCARD),
+    V6(0x2001, 0x0002, 0, 0, 48, RESERVED_BENCHMARK),
+    V6(0x2001, 0x0db8, 0, 0, 32, RESERVED_DOCUMENTATION),
+    V6(0xfc00, 0, 0, 0,     7, RESERVED_ULA),
+    V6(0xfe80, 0, 0, 0,    10, RESERVED_LINKLOCAL),
+    V6(0xff00, 0, 0, 0,     8, RESERVED_MULTICAST)
+};
+
+static const char *reserved_names[RESERVED_MAX] = {
+    [RESERVED_NONE]             = "none",
+    [RESERVED_THIS]             = "this-network",
+    [RESERVED_PRIVATE]          = "private",
+    [RESERVED_SHARED]           = "shared",
+    [RESERVED_LOOPBACK]         = "loopback",
+    [RESERVED_LINKLOCAL]        = "link-local",
+    [RESERVED_DOCUMENTATION]    = "documentation",
+    [RESERVED_BENCHMARK]        = "benchmark",
+    [RESERVED_MULTICAST]        = "multicast",
+    [RESERVED_FUTURE]           = "future-use",
+    [RESERVED_ULA]              = "unique-local",
+    [RESERVED_DISCARD]          = "discard"
+};
+
+static const uint8_t v4mapped[12] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+};
+
+/*
+ * Dotted quad as inet_pton takes it, four decimal bytes without
+ * leading zeros, written to a only when valid
+ */
+int
+addr_parse_v4_scalar(const char *s, uint8_t *a)
+{
+    uint8_t     b[4];
+    unsigned    v, n, digits;
+
+    for (n = 0; ; s++) {
+        for (v = 0, digits = 0; digits < 3 &&
+            s[digits] >= '0' && s[digits] <= '9'; digits++)
+            v = v * 10 + (s[digits] - '0');
+        if (digits == 0 || v > 255 || (digits > 1 && *s == '0'))
+            return (-1);
+        s += digits;
+        b[n++] = v;
+        if (n == 4)
+            break;
+        if (*s != '.')
+            return (-1);
+    }
+
+    if (*s != '\0')
+        return (-1);
+    memcpy(a, b, sizeof(b));
+
+    return (0);
+}
+
+#ifdef ADDR_SSE42
+/*
+ * Shuffles right aligning the digits of each byte of the address
+ * in a 32 bits lane, per the lengths of the four of them
+ */
+static uint8_t addr_v4_shuffles[81][16];
+
+static void
+addr_v4_shuffles_init(void)
+{
+    unsigned    k, f, l, start, len[4], i;
+    uint8_t     *shuf;
+
+    for (k = 0; k < 81; k++) {
+        shuf = addr_v4_shuffles[k];
+        for (f = 0, l = k; f < 4; f++, l /= 3)
+            len[3 - f] = l % 3 + 1;
+        for (f = 0, start = 0; f < 4; start += len[f++] + 1) {
+            for (i = 0; i < 3; i++)
+                shuf[f * 4 + i] = (i < 3 - len[f] ? 0x80 :
+                    start + i - (3 - len[f]));
+            shuf[f * 4 + 3] = 0x80;
+        }
+    }
+}
+
+/*
+ * The characters are checked at once against the digits and the
+ * dot, the digits of each byte then converted together by the
+ * shuffle of the byte lengths
+ */
+__attribute__((target("sse4.2")))
+static int
+addr_parse_v4_sse42(const char *s, uint8_t *a)
+{
+    char        buf[16];
+    size_t      len;
+    unsigned    dots, p0, p1, p2, l0, l1, l2, l3;
+    uint32_t    out;
+    __m128i     v, d, x;
+
+    /* the string only, never read past its end */
+    if ((len = strnlen(s, sizeof(buf))) < 7 || len > 15)
+        return (-1);
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, s, len);
+    v = _mm_loadu_si128((const __m128i *)buf);
+
+    if ((size_t)_mm_cmpistri(_mm_setr_epi8('0', '9', '.', '.', 0, 0, 0, 0,
+        0, 0, 0, 0, 0, 0, 0, 0), v, _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+        _SIDD_NEGATIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT) != len)
+        return (-1);
+
+    dots = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+    if (__builtin_popcount(dots) != 3)
+        return (-1);
+    p0 = __builtin_ctz(dots);
+    dots &= dots - 1;
+    p1 = __builtin_ctz(dots);
+    dots &= dots - 1;
+    p2 = __builtin_ctz(dots);
+
+    l0 = p0;
+    l1 = p1 - p0 - 1;
+    l2 = p2 - p1 - 1;
+    l3 = len - p2 - 1;
+    if (l0 - 1 > 2 || l1 - 1 > 2 || l2 - 1 > 2 || l3 - 1 > 2 ||
+        (l0 > 1 && buf[0] == '0') || (l1 > 1 && buf[p0 + 1] == '0') ||
+        (l2 > 1 && buf[p1 + 1] == '0') || (l3 > 1 && buf[p2 + 1] == '0'))
+        return (-1);
+
+    d = _mm_sub_epi8(v, _mm_set1_epi8('0'));
+    x = _mm_shuffle_epi8(d, _mm_loadu_si128((const __m128i *)
+        addr_v4_shuffles[(l0 - 1) * 27 + (l1 - 1) * 9 + (l2 - 1) * 3 +
+        (l3 - 1)]));
+    /* 100 * h + 10 * t and u per 16 bits, then summed per 32 bits */
+    x = _mm_maddubs_epi16(x, _mm_setr_epi8(100, 10, 1, 0, 100, 10, 1, 0,
+        100, 10, 1, 0, 100, 10, 1, 0));
+    x = _mm_madd_epi16(x, _mm_set1_epi16(1));
+    if (_mm_movemask_epi8(_mm_cmpgt_epi32(x, _mm_set1_epi32(255))) != 0)
+        return (-1);
+
+    x = _mm_packus_epi16(_mm_packs_epi32(x, x), x);
+    out = (uint32_t)_mm_cvtsi128_si32(x);
+    memcpy(a, &out, sizeof(out));
+
+    return (0);
+}
+#endif
+
+/*
+ * Picks the IPv4 parser of the CPU, its tables being set up, to be
+ * done before the threads parsing addresses are started
+ */
+void
+addr_parse_init(void)
+{
+    int (*impl)(const char *, uint8_t *) = addr_parse_v4_scalar;
+
+#ifdef ADDR_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        addr_v4_shuffles_init();
+        impl = addr_parse_v4_sse42;
+        addr_parse_v4_impl_name = "sse4.2";
+    }
+#endif
+    __atomic_store_n(&addr_parse_v4_impl, impl, __ATOMIC_RELEASE);
+}
+
+static int
+addr_parse_v4_resolve(const char *s, uint8_t *a)
+{
+    addr_parse_init();
+
+    return (addr_parse_v4(s, a));
+}
+
+int
+addr_parse_v4(const char *s, uint8_t *a)
+{
+    return (__atomic_load_n(&addr_parse_v4_impl, __ATOMIC_ACQUIRE)(s, a));
+}
+
+/*
+ * The IPv4 parser used, after the first parse
+ */
+const char *
+addr_parse_v4_name(void)
+{
+    return (addr_parse_v4_impl_name);
+}
+
+int
+addr_parse(const char *s, struct geoloc_addr *addr)
+{
+    if (addr_parse_v4(s, &addr->a[12]) == 0) {
+        memcpy(addr->a, v4mapped, sizeof(v4mapped));
+        return (0);
+    }
+
+    /* no need for the IPv6 parser without a colon */
+    if (strchr(s, ':') != NULL && inet_pton(AF_INET6, s, addr->a) == 1)
+        return (0);
+
+    return (-1);
+}
+
+/*
+ * The n addresses at once before any lookup, ret telling
+ * for each one whether it is valid
+ */
+void
+addr_parse_batch(const char * const *keys, size_t n, struct geoloc_addr *addrs,
+                 int *ret)
+{
+    int (*v4)(const char *, uint8_t *);
+    size_t  i;
+
+    if (n == 0)
+        return;
+
+    /* the first one picks the IPv4 parser when not done yet */
+    ret[0] = addr_parse(keys[0], &addrs[0]);
+    v4 = __atomic_load_n(&addr_parse_v4_impl, __ATOMIC_ACQUIRE);
+
+    for (i = 1; i < n; i++) {
+        if (v4(keys[i], &addrs[i].a[12]) == 0) {
+            memcpy(addrs[i].a, v4mapped, sizeof(v4mapped));
+            ret[i] = 0;
+        } else
+            ret[i] = (strchr(keys[i], ':') != NULL &&
+                inet_pton(AF_INET6, keys[i], addrs[i].a) == 1 ? 0 : -1);
+    }
+}
+
+/*
+ * Parses address/length, IPv4 lengths being translated
+ * to their IPv4-mapped counterpart. No length means a single address
+ */
+int
+addr_parse_prefix(const char *s, struct geoloc_addr *addr, int *plen)
+{
+    char        buf[GEOLOC_PREFIX_MAX], *slash, *end;
+    long        len;
+
+    if (strlen(s) >= sizeof(buf))
+        return (-1);
+    strcpy(buf, s);
+
+    if ((slash = strchr(buf, '/')) != NULL)
+        *slash++ = '\0';
+
+    if (addr_parse(buf, addr) == -1)
+        return (-1);
+
+    if (slash == NULL) {
+        *plen = 128;
+        return (0);
+    }
+
+    len = strtol(slash, &end, 10);
+    if (*slash == '\0' || *end != '\0' || len < 0 ||
+        len > (addr_isv4(addr) ? 32 : 128))
+        return (-1);
+
+    *plen = (int)len + (addr_isv4(addr) ? 96 : 0);
+    addr_prefix_first(addr, *plen, addr);
+
+    return (0);
+}
+
+void
+addr_format(const struct geoloc_addr *addr, char *buf, size_t len)
+{
+    if (addr_isv4(addr))
+        inet_ntop(AF_INET, &addr->a[12], buf, len);
+    else
+        inet_ntop(AF_INET6, addr->a, buf, len);
+}
+
+void
+addr_format_prefix(const struct geoloc_addr *addr, int plen, char *buf,
+                   size_t len)
+{
+    size_t  n;
+
+    addr_format(addr, buf, len);
+    n = strlen(buf);
+    snprintf(buf + n, len - n, "/%d",
+        (addr_isv4(addr) && plen >= 96 ? plen - 96 : plen));
+}
+
+int
+addr_isv4(const struct geoloc_addr *addr)
+{
+    return (memcmp(addr->a, v4mapped, sizeof(v4mapped)) == 0);
+}
+
+int
+addr_cmp(const struct geoloc_addr *a, const struct geoloc_addr *b)
+{
+    return (memcmp(a->a, b->a, sizeof(a->a)));
+}
+
+/*
+ * Next address, returns 1 when wrapping around
+ */
+int
+addr_incr(struct geoloc_addr *addr)
+{
+    int     i;
+
+    for (i = sizeof(addr->a) - 1; i >= 0; i--)
+        if (++addr->a[i] != 0)
+            return (0);
+
+    return (1);
+}
+
+/*
+ * Previous address, returns 1 when wrapping around
+ */
+int
+addr_decr(struct geoloc_addr *addr)
+{
+    int     i;
+
+    for (i = sizeof(addr->a) - 1; i >= 0; i--)
+        if (addr->a[i]-- != 0)
+            return (0);
+
+    return (1);
+}
+
+void
+addr_prefix_first(const struct geoloc_addr *addr, int plen,
+                  struct geoloc_addr *first)
+{
+    int     i, bits;
+
+    for (i = 0; i < (int)sizeof(addr->a); i++) {
+        bits = plen - i * 8;
+        if (bits >= 8)
+            first->a[i] = addr->a[i];
+        else if (bits <= 0)
+            first->a[i] = 0;
+        else
+            first->a[i] = addr->a[i] & (uint8_t)(0xff << (8 - bits));
+    }
+}
+
+void
+addr_prefix_last(const struct geoloc_addr *addr, int plen,
+                 struct geoloc_addr *last)
+{
+    int     i, bits;
+
+    for (i = 0; i < (int)sizeof(addr->a); i++) {
+        bits = plen - i * 8;
+        if (bits >= 8)
+            last->a[i] = addr->a[i];
+        else if (bits <= 0)
+            last->a[i] = 0xff;
+        else
+            last->a[i] = addr->a[i] | (uint8_t)(0xff >> bits);
+    }
+}
+
+/*
+ * Length of the largest prefix starting at first and
+ * not going beyond last, to split ranges into CIDR blocks
+ */
+int
+addr_range_prefix(const struct geoloc_addr *first,
+                  const struct geoloc_addr *last)
+{
+    struct geoloc_addr  p;
+    int                 plen;
+
+    for (plen = 0; plen < 128; plen++) {
+        addr_prefix_first(first, plen, &p);
+        if (addr_cmp(&p, first) != 0)
+            continue;
+        addr_prefix_last(first, plen, &p);
+        if (addr_cmp(&p, last) <= 0)
+            break;
+    }
+
+    return (plen);
+}
+
+/*
+ * Does the address belong to prefix/plen
+ */
+int
+addr_match(const struct geoloc_addr *addr, const struct geoloc_addr *prefix,
+           int plen)
+{
+    int     bytes = plen / 8, bits = plen % 8;
+    uint8_t mask;
+
+    if (memcmp(addr->a, prefix->a, bytes) != 0)
+        return (0);
+
+    if (bits == 0)
+        return (1);
+
+    mask = (uint8_t)(0xff << (8 - bits));
+
+    return ((addr->a[bytes] & mask) == (prefix->a[bytes] & mask));
+}
+
+enum reserved_class
+addr_reserved(const struct geoloc_addr *addr)
+{
+    size_t  i;
+
+    for (i = 0; i < sizeof(reserved) / sizeof(reserved[0]); i++)
+        if (addr_match(addr, &reserved[i].prefix, reserved[i].plen))
+            return (reserved[i].cl);
+
+    return (RESERVED_NONE);
+}
+
+const char *
+addr_reserved_name(enum reserved_class cl)
+{
+    if (cl >= RESERVED_MAX)
+        return (reserved_names[RESERVED_NONE]);
+
+    return (reserved_names[cl]);
+}
@@ -0,0 +1,71 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GEOLOC_ADDR_H_
+#define _GEOLOC_ADDR_H_             1
+
+#include <stdint.h>
+
+/*
+ * IPv4 and IPv6 addresses in a single binary form,
+ * IPv4 ones being IPv4-mapped (::ffff:a.b.c.d)
+ */
+struct geoloc_addr {
+    uint8_t             a[16];
+};
+
+enum reserved_class {
+    RESERVED_NONE,
+    RESERVED_THIS,
+    RESERVED_PRIVATE,
+    RESERVED_SHARED,
+    RESERVED_LOOPBACK,
+    RESERVED_LINKLOCAL,
+    RESERVED_DOCUMENTATION,
+    RESERVED_BENCHMARK,
+    RESERVED_MULTICAST,
+    RESERVED_FUTURE,
+    RESERVED_ULA,
+    RESERVED_DISCARD,
+    RESERVED_MAX
+};
+
+#define GEOLOC_RESERVED_INFO        "reserved"
+#define GEOLOC_PREFIX_MAX           64
+
+void addr_parse_init(void);
+int addr_parse(const char *, struct geoloc_addr *);
+void addr_parse_batch(const char * const *, size_t, struct geoloc_addr *, int *);
+int addr_parse_v4(const char *, uint8_t *);
+int addr_parse_v4_scalar(const char *, uint8_t *);
+const char *addr_parse_v4_name(void);
+int addr_parse_prefix(const char *, struct geoloc_addr *, int *);
+void addr_format(const struct geoloc_addr *, char *, size_t);
+void addr_format_prefix(const struct geoloc_addr *, int, char *, size_t);
+int addr_isv4(const struct geoloc_addr *);
+int addr_cmp(const struct geoloc_addr *, const struct geoloc_addr *);
+int addr_incr(struct geoloc_addr *);
+int addr_decr(struct geoloc_addr *);
+void addr_prefix_first(const struct geoloc_addr *, int, struct geoloc_addr *);
+void addr_prefix_last(const struct geoloc_addr *, int, struct geoloc_addr *);
+int addr_range_prefix(const struct geoloc_addr *, const struct geoloc_addr *);
+int addr_match(const struct geoloc_addr *, const struct geoloc_addr *, int);
+enum reserved_class addr_reserved(const struct geoloc_addr *);
+const char *addr_reserved_name(enum reserved_class);
+
+#endif
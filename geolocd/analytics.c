@@ -0,0 +1,362 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#ifdef  HAVE_NO_BSDFUNCS
+#include <bsd/string.h>
+#endif
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "analytics.h"
+
+#define ANALYTICS_BUCKETS   (ANALYTICS_COUNTERS * 2)
+
+/*
+ * A counted value, the count being over by at most error,
+ * the count of the value it took the place of
+ */
+struct analytics_counter {
+    char                value[ANALYTICS_VALUE_LEN];
+    uint64_t            count;
+    uint64_t            error;
+    /* next one of the bucket, -1 ending it */
+    int                 next;
+};
+
+/*
+ * Space-Saving counters of the values of a field
+ */
+struct analytics_counters {
+    struct analytics_counter    c[ANALYTICS_COUNTERS];
+    int                         buckets[ANALYTICS_BUCKETS];
+    unsigned                    n;
+    uint64_t                    total;
+};
+
+/*
+ * One HyperLogLog sketch per slot of the window, the window
+ * estimate merging them on demand. A slot is cleared when
+ * the clock comes back to it.
+ */
+struct analytics {
+    uint8_t                     regs[ANALYTICS_SLOTS][ANALYTICS_HLL_REGS];
+    /* slot number held plus one, 0 when empty */
+    uint64_t                    held[ANALYTICS_SLOTS];
+    uint64_t                    now;
+    unsigned                    slotlen;
+    struct analytics_counters   countries;
+    struct analytics_counters   isps;
+};
+
+static struct analytics *an = NULL;
+
+static uint64_t analytics_mix(uint64_t);
+static uint64_t analytics_estimate(const uint8_t *);
+static void analytics_count(struct analytics_counters *, const char *);
+static int analytics_find(const struct analytics_counters *, const char *, uint32_t);
+static uint32_t analytics_hash(const char *);
+static void analytics_unlink(struct analytics_counters *, int);
+static size_t analytics_list(char *, size_t, const struct analytics_counters *, const char *);
+static int analytics_cmp(const void *, const void *);
+
+int
+analytics_init(unsigned window)
+{
+    if ((an = calloc(1, sizeof(*an))) == NULL) {
+        log_warn("analytics_init");
+        return (-1);
+    }
+    an->slotlen = window / ANALYTICS_SLOTS;
+    memset(an->countries.buckets, 0xff, sizeof(an->countries.buckets));
+    memset(an->isps.buckets, 0xff, sizeof(an->isps.buckets));
+
+    return (0);
+}
+
+/*
+ * Moves to the slot of the clock, in microseconds, its
+ * sketch being cleared when it held an older one
+ */
+void
+analytics_tick(uint64_t usec)
+{
+    uint64_t    now;
+    size_t      i;
+
+    if (an == NULL)
+        return;
+
+    now = usec / 1000000 / an->slotlen;
+    i = now % ANALYTICS_SLOTS;
+    if (an->held[i] != now + 1) {
+        memset(an->regs[i], 0, sizeof(an->regs[i]));
+        an->held[i] = now + 1;
+    }
+    an->now = now;
+}
+
+static uint64_t
+analytics_mix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+
+    return (h);
+}
+
+/*
+ * The first bits of the address hash pick the register, which
+ * keeps the highest rank of the first set bit of the others
+ */
+void
+analytics_addr(const struct geoloc_addr *addr)
+{
+    uint64_t    w0, w1, h, rest;
+    uint8_t     *reg, rank;
+
+    if (an == NULL)
+        return;
+
+    memcpy(&w0, addr->a, sizeof(w0));
+    memcpy(&w1, addr->a + sizeof(w0), sizeof(w1));
+    h = analytics_mix(w0 ^ analytics_mix(w1));
+
+    reg = &an->regs[an->now % ANALYTICS_SLOTS][h >> (64 - ANALYTICS_HLL_BITS)];
+    rest = h << ANALYTICS_HLL_BITS;
+    rank = (rest == 0 ? 64 - ANALYTICS_HLL_BITS + 1 :
+        __builtin_clzll(rest) + 1);
+    if (rank > *reg)
+        *reg = rank;
+}
+
+/*
+ * Raw estimate, linear counting while registers are left empty
+ */
+static uint64_t
+analytics_estimate(const uint8_t *regs)
+{
+    const double    m = ANALYTICS_HLL_REGS;
+    double          sum = 0.0, e;
+    size_t          i, zeros = 0;
+
+    for (i = 0; i < ANALYTICS_HLL_REGS; i++) {
+        sum += ldexp(1.0, -regs[i]);
+        if (regs[i] == 0)
+            zeros++;
+    }
+
+    e = (0.7213 / (1.0 + 1.079 / m)) * m * m / sum;
+    if (e <= 2.5 * m && zeros > 0)
+        e = m * log(m / zeros);
+
+    return ((uint64_t)(e + 0.5));
+}
+
+void
+analytics_value(enum lookup_info_type li, const char *value)
+{
+    if (an == NULL || value == NULL || *value == '\0' ||
+        strcmp(value, GEOLOC_RESERVED_INFO) == 0)
+        return;
+
+    if (li == GEOLOC_COUNTRY)
+        analytics_count(&an->countries, value);
+    else if (li == GEOLOC_ISP)
+        analytics_count(&an->isps, value);
+}
+
+/*
+ * The bytes of the value which are kept
+ */
+static uint32_t
+analytics_hash(const char *value)
+{
+    uint32_t    h = 2166136261U;
+    size_t      i;
+
+    for (i = 0; i < ANALYTICS_VALUE_LEN - 1 && value[i] != '\0'; i++)
+        h = (h ^ (unsigned char)value[i]) * 16777619U;
+
+    return (h);
+}
+
+static int
+analytics_find(const struct analytics_counters *ac, const char *value,
+               uint32_t h)
+{
+    int     i;
+
+    for (i = ac->buckets[h % ANALYTICS_BUCKETS]; i != -1; i = ac->c[i].next)
+        if (strncmp(ac->c[i].value, value, ANALYTICS_VALUE_LEN - 1) == 0)
+            return (i);
+
+    return (-1);
+}
+
+static void
+analytics_unlink(struct analytics_counters *ac, int i)
+{
+    int     *p;
+
+    p = &ac->buckets[analytics_hash(ac->c[i].value) % ANALYTICS_BUCKETS];
+    while (*p != i)
+        p = &ac->c[*p].next;
+    *p = ac->c[i].next;
+}
+
+/*
+ * A new value takes the place of the least counted one once
+ * they are all taken, starting from its count
+ */
+static void
+analytics_count(struct analytics_counters *ac, const char *value)
+{
+    struct analytics_counter    *c;
+    uint32_t                    h = analytics_hash(value);
+    unsigned                    j;
+    int                         i;
+
+    ac->total++;
+
+    if ((i = analytics_find(ac, value, h)) != -1) {
+        ac->c[i].count++;
+        return;
+    }
+
+    if (ac->n < ANALYTICS_COUNTERS) {
+        i = ac->n++;
+        ac->c[i].count = 0;
+        ac->c[i].error = 0;
+    } else {
+        for (i = 0, j = 1; j < ANALYTICS_COUNTERS; j++)
+            if (ac->c[j].count < ac->c[i].count)
+                i = j;
+        analytics_unlink(ac, i);
+        ac->c[i].error = ac->c[i].count;
+    }
+
+    c = &ac->c[i];
+    strlcpy(c->value, value, sizeof(c->value));
+    c->count++;
+    c->next = ac->buckets[h % ANALYTICS_BUCKETS];
+    ac->buckets[h % ANALYTICS_BUCKETS] = i;
+}
+
+static int
+analytics_cmp(const void *a, const void *b)
+{
+    const struct analytics_counter  *ca = *(const struct analytics_counter * const *)a;
+    const struct analytics_counter  *cb = *(const struct analytics_counter * const *)b;
+
+    if (ca->count != cb->count)
+        return (ca->count < cb->count ? 1 : -1);
+
+    return (strcmp(ca->value, cb->value));
+}
+
+/*
+ * The values of a field, most counted first
+ */
+static size_t
+analytics_list(char *buf, size_t bufsz, const struct analytics_counters *ac,
+               const char *name)
+{
+    const struct analytics_counter  *sorted[ANALYTICS_COUNTERS];
+    size_t                          len = 0;
+    unsigned                        i;
+
+    for (i = 0; i < ac->n; i++)
+        sorted[i] = &ac->c[i];
+    qsort(sorted, ac->n, sizeof(sorted[0]), analytics_cmp);
+
+    for (i = 0; i < ac->n && len < bufsz; i++) {
+        if (sorted[i]->error > 0)
+            len += snprintf(buf + len, bufsz - len, "%s %s %llu (over by "
+                "%llu at most)\n", name, sorted[i]->value,
+                (unsigned long long)sorted[i]->count,
+                (unsigned long long)sorted[i]->error);
+        else
+            len += snprintf(buf + len, bufsz - len, "%s %s %llu\n", name,
+                sorted[i]->value, (unsigned long long)sorted[i]->count);
+    }
+
+    return (len < bufsz ? len : bufsz);
+}
+
+/*
+ * Unique addresses over the window and its current slot, then
+ * the request counts per country and per ISP
+ */
+size_t
+analytics_report(char *buf, size_t bufsz)
+{
+    uint8_t     merged[ANALYTICS_HLL_REGS];
+    size_t      len, i, r;
+
+    if (an == NULL)
+        return (strlcpy(buf, "analytics disabled\n", bufsz));
+
+    memset(merged, 0, sizeof(merged));
+    for (i = 0; i < ANALYTICS_SLOTS; i++) {
+        /* slots left behind by a clock which did not come back */
+        if (an->held[i] == 0 || an->now + 1 - an->held[i] >= ANALYTICS_SLOTS)
+            continue;
+        for (r = 0; r < ANALYTICS_HLL_REGS; r++)
+            if (an->regs[i][r] > merged[r])
+                merged[r] = an->regs[i][r];
+    }
+
+    len = snprintf(buf, bufsz,
+        "unique addresses %u s %llu\nunique addresses %u s %llu\n"
+        "countries %llu requests %u values\nisps %llu requests %u values\n",
+        an->slotlen * ANALYTICS_SLOTS,
+        (unsigned long long)analytics_estimate(merged), an->slotlen,
+        (unsigned long long)analytics_estimate(
+        an->regs[an->now % ANALYTICS_SLOTS]),
+        (unsigned long long)an->countries.total, an->countries.n,
+        (unsigned long long)an->isps.total, an->isps.n);
+
+    if (len < bufsz)
+        len += analytics_list(buf + len, bufsz - len, &an->countries,
+            "country");
+    if (len < bufsz)
+        len += analytics_list(buf + len, bufsz - len, &an->isps, "isp");
+
+    return (len < bufsz ? len : bufsz - 1);
+}
+
+size_t
+analytics_memory(void)
+{
+    return (an != NULL ? sizeof(*an) : 0);
+}
+
+void
+analytics_free(void)
+{
+    free(an);
+    an = NULL;
+}
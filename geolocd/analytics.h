@@ -0,0 +1,46 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GEOLOC_ANALYTICS_H_
+#define _GEOLOC_ANALYTICS_H_        1
+
+#include "addr.h"
+#include "geoloc.h"
+
+/* sliding window length, s, split in slots */
+#define ANALYTICS_WINDOW            3600
+#define ANALYTICS_SLOTS             12
+/* HyperLogLog registers per slot, 2^12, about 1.6% of error */
+#define ANALYTICS_HLL_BITS          12
+#define ANALYTICS_HLL_REGS          (1 << ANALYTICS_HLL_BITS)
+/* values counted per field, the least counted giving way beyond */
+#define ANALYTICS_COUNTERS          256
+/* bytes of a value kept, longer ones being truncated */
+#define ANALYTICS_VALUE_LEN         64
+/* report size, both fields listed whole */
+#define ANALYTICS_REPORT_MAX        65536
+
+int analytics_init(unsigned);
+void analytics_tick(uint64_t);
+void analytics_addr(const struct geoloc_addr *);
+void analytics_value(enum lookup_info_type, const char *);
+size_t analytics_report(char *, size_t);
+size_t analytics_memory(void);
+void analytics_free(void);
+
+#endif
@@ -0,0 +1,141 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "arena.h"
+
+/*
+ * Heap allocation made past the arena size
+ */
+struct arena_chunk {
+    struct arena_chunk      *next;
+    /* keeps the data aligned */
+    char                    pad[ARENA_ALIGN - sizeof(struct arena_chunk *)];
+};
+
+int
+arena_init(struct arena *a, size_t size)
+{
+    bzero(a, sizeof(*a));
+
+    if ((a->base = malloc(size)) == NULL) {
+        log_warn("arena_init");
+        return (-1);
+    }
+    a->size = size;
+
+    /* faulted in now rather than by the first requests */
+    memset(a->base, 0, size);
+
+    return (0);
+}
+
+/*
+ * Uninitialized memory, valid until the next reset
+ */
+void *
+arena_alloc(struct arena *a, size_t len)
+{
+    struct arena_chunk  *c;
+    void                *p;
+
+    len = (len + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (len <= a->size - a->used) {
+        p = a->base + a->used;
+        a->used += len;
+        if (a->used > a->peak)
+            a->peak = a->used;
+        return (p);
+    }
+
+    if (len > SIZE_MAX - sizeof(*c) ||
+        (c = malloc(sizeof(*c) + len)) == NULL) {
+        log_warn("arena_alloc");
+        return (NULL);
+    }
+    c->next = a->chunks;
+    a->chunks = c;
+    a->allocs++;
+
+    return (c + 1);
+}
+
+void *
+arena_calloc(struct arena *a, size_t n, size_t len)
+{
+    void    *p;
+
+    if (len != 0 && n > SIZE_MAX / len) {
+        errno = ENOMEM;
+        log_warn("arena_calloc");
+        return (NULL);
+    }
+
+    if ((p = arena_alloc(a, n * len)) != NULL)
+        bzero(p, n * len);
+
+    return (p);
+}
+
+char *
+arena_strndup(struct arena *a, const char *s, size_t len)
+{
+    char    *p;
+
+    if ((p = arena_alloc(a, len + 1)) != NULL) {
+        memcpy(p, s, len);
+        p[len] = '\0';
+    }
+
+    return (p);
+}
+
+/*
+ * Everything allocated goes at once, returning how many heap
+ * allocations were made since the previous reset
+ */
+uint64_t
+arena_reset(struct arena *a)
+{
+    struct arena_chunk  *c;
+    uint64_t            allocs = a->allocs;
+
+    while ((c = a->chunks) != NULL) {
+        a->chunks = c->next;
+        free(c);
+    }
+    a->used = 0;
+    a->allocs = 0;
+
+    return (allocs);
+}
+
+void
+arena_free(struct arena *a)
+{
+    arena_reset(a);
+    free(a->base);
+    bzero(a, sizeof(*a));
+}
@@ -0,0 +1,52 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GEOLOC_ARENA_H_
+#define _GEOLOC_ARENA_H_            1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* the requests of a serve round fit in it but for huge replies */
+#define ARENA_SIZE                  (1024 * 1024)
+#define ARENA_ALIGN                 16
+
+struct arena_chunk;
+
+/*
+ * Bump allocator reset as a whole, nothing being freed on its own.
+ * Past its size, allocations go to the heap until the next reset,
+ * and are counted.
+ */
+struct arena {
+    char                    *base;
+    size_t                  size;
+    size_t                  used;
+    size_t                  peak;
+    struct arena_chunk      *chunks;
+    uint64_t                allocs;
+};
+
+int arena_init(struct arena *, size_t);
+void *arena_alloc(struct arena *, size_t);
+void *arena_calloc(struct arena *, size_t, size_t);
+char *arena_strndup(struct arena *, const char *, size_t);
+uint64_t arena_reset(struct arena *);
+void arena_free(struct arena *);
+
+#endif
@@ -0,0 +1,301 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "build.h"
+#include "control.h"
+
+/*
+ * Indexes and tables are built on their own thread, with their own
+ * backend handler, the daemon answering through the backend until
+ * they are published. The end of the build is told through a pipe
+ * the main loop polls.
+ */
+static struct build {
+    pthread_t               thread;
+    int                     running;
+    int                     notify[2];
+    struct backend          backend;
+    void                    *handler;
+    enum cache_mode         cache;
+    int                     cpu;
+    uint32_t                fields;
+    uint32_t                fields6;
+    uint32_t                tables;
+    uint32_t                compact;
+    struct geoloc_index     *prev[GEOLOC_NFIELDS];
+    struct build_result     results[GEOLOC_NFIELDS];
+    struct index_progress   progress[GEOLOC_NFIELDS];
+    int                     state[GEOLOC_NFIELDS];
+    uint64_t                usec[GEOLOC_NFIELDS];
+    struct timeval          start;
+} build = { .notify = { -1, -1 } };
+
+static void *build_thread(void *);
+static void build_results_free(void);
+
+/*
+ * Starts building the configured fields, handler being a private
+ * backend handler or NULL for the thread to open its own. The
+ * previous indexes are only read until the build is collected.
+ */
+int
+build_start(struct backend *b, void *handler, struct geolocd_conf *xconf,
+            struct geoloc_index **prev)
+{
+    int     li;
+
+    if (build.running) {
+        if (handler != NULL)
+            b->gl_bsc(handler);
+        return (-1);
+    }
+
+    bzero(build.results, sizeof(build.results));
+    bzero(build.progress, sizeof(build.progress));
+    bzero(build.state, sizeof(build.state));
+    bzero(build.usec, sizeof(build.usec));
+
+    build.backend = *b;
+    build.handler = handler;
+    build.cache = xconf->cache;
+    build.cpu = xconf->build_cpu;
+    build.tables = xconf->tables;
+    if (build.tables != 0 && b->gl_brc == NULL) {
+        log_warnx("%s backend has no ranges, tables not built", b->name);
+        build.tables = 0;
+    }
+    build.fields = xconf->indexes | build.tables;
+    build.fields6 = xconf->indexes6 | (xconf->tables6 & build.tables);
+    build.compact = xconf->tables_compact & build.tables;
+
+    if (build.fields == 0) {
+        if (handler != NULL)
+            b->gl_bsc(handler);
+        return (0);
+    }
+
+    for (li = 0; li < GEOLOC_NFIELDS; li++) {
+        build.prev[li] = prev[li];
+        if (build.fields & (1U << li))
+            build.state[li] = BUILD_PENDING;
+    }
+
+    if (pipe(build.notify) == -1) {
+        log_warn("build_start: pipe");
+        goto fail;
+    }
+    session_socket_blockmode(build.notify[0], BM_NONBLOCK);
+
+    gettimeofday(&build.start, NULL);
+
+    if ((errno = pthread_create(&build.thread, NULL, build_thread,
+        &build)) != 0) {
+        log_warn("build_start: pthread_create");
+        close(build.notify[0]);
+        close(build.notify[1]);
+        goto fail;
+    }
+    build.running = 1;
+
+    return (0);
+
+fail:
+    build.notify[0] = build.notify[1] = -1;
+    if (handler != NULL)
+        b->gl_bsc(handler);
+    return (-1);
+}
+
+int
+build_running(void)
+{
+    return (build.running);
+}
+
+/*
+ * Readable once the build is over, -1 when none runs
+ */
+int
+build_fd(void)
+{
+    return (build.running ? build.notify[0] : -1);
+}
+
+/*
+ * Joins the finished build, its results handed over
+ */
+int
+build_collect(struct build_result *results)
+{
+    char    c;
+
+    if (!build.running)
+        return (-1);
+
+    while (read(build.notify[0], &c, 1) == -1 && errno == EINTR)
+        ;
+    pthread_join(build.thread, NULL);
+
+    close(build.notify[0]);
+    close(build.notify[1]);
+    build.notify[0] = build.notify[1] = -1;
+    build.running = 0;
+
+    memcpy(results, build.results, sizeof(build.results));
+    bzero(build.results, sizeof(build.results));
+    bzero(build.prev, sizeof(build.prev));
+
+    return (0);
+}
+
+/*
+ * Stops a running build, at shutdown
+ */
+void
+build_cancel(void)
+{
+    int     li;
+
+    if (!build.running)
+        return;
+
+    for (li = 0; li < GEOLOC_NFIELDS; li++)
+        __atomic_store_n(&build.progress[li].stop, 1, __ATOMIC_RELAXED);
+
+    pthread_join(build.thread, NULL);
+    close(build.notify[0]);
+    close(build.notify[1]);
+    build.notify[0] = build.notify[1] = -1;
+    build.running = 0;
+
+    build_results_free();
+}
+
+/*
+ * One line per field of the last build, with its progress
+ * while running and its time once done
+ */
+size_t
+build_status(char *buf, size_t len)
+{
+    static const char   *states[] = {
+        [BUILD_NONE]    = "none",
+        [BUILD_PENDING] = "pending",
+        [BUILD_RUNNING] = "building",
+        [BUILD_DONE]    = "done",
+        [BUILD_FAILED]  = "failed"
+    };
+    struct index_progress   *pr;
+    size_t                  off;
+    uint64_t                usec;
+    int                     li, state;
+
+    off = snprintf(buf, len, "build %s\n",
+        (build.running ? "running" : "idle"));
+
+    for (li = 0; li < GEOLOC_NFIELDS && off < len; li++) {
+        state = __atomic_load_n(&build.state[li], __ATOMIC_ACQUIRE);
+        if (state == BUILD_NONE)
+            continue;
+        pr = &build.progress[li];
+        usec = (state == BUILD_DONE ? build.usec[li] : 0);
+        off += snprintf(buf + off, len - off,
+            "%s %s %u.%u%% %llu ranges %llu.%06llu s\n", geoloc_field_name(li),
+            states[state],
+            __atomic_load_n(&pr->permille, __ATOMIC_RELAXED) / 10,
+            __atomic_load_n(&pr->permille, __ATOMIC_RELAXED) % 10,
+            (unsigned long long)__atomic_load_n(&pr->ranges,
+            __ATOMIC_RELAXED), (unsigned long long)(usec / 1000000),
+            (unsigned long long)(usec % 1000000));
+    }
+
+    return (off < len ? off : len - 1);
+}
+
+static void *
+build_thread(void *arg)
+{
+    struct build        *bd = arg;
+    struct backend      b = bd->backend;
+    struct build_result *r;
+    struct timeval      start, end;
+    int                 li;
+
+    residency_worker(bd->cpu);
+
+    if ((b.handler = bd->handler) == NULL &&
+        (b.handler = b.gl_bic(b.datafile, bd->cache)) == NULL)
+        log_warnx("build: cannot open %s", b.datafile);
+
+    for (li = 0; li < GEOLOC_NFIELDS; li++) {
+        if ((bd->fields & (1U << li)) == 0)
+            continue;
+        if (b.handler == NULL) {
+            __atomic_store_n(&bd->state[li], BUILD_FAILED, __ATOMIC_RELEASE);
+            continue;
+        }
+        __atomic_store_n(&bd->state[li], BUILD_RUNNING, __ATOMIC_RELEASE);
+
+        r = &bd->results[li];
+        gettimeofday(&start, NULL);
+        r->idx = index_build(&b, li, (bd->fields6 & (1U << li)) != 0,
+            bd->prev[li], &bd->progress[li]);
+        if (r->idx != NULL && (bd->tables & (1U << li)))
+            r->table = table_build(r->idx);
+        if (r->table != NULL && (bd->compact & (1U << li)) &&
+            table_compact(r->table) == -1)
+            log_warnx("%s table not compacted", geoloc_field_name(li));
+        gettimeofday(&end, NULL);
+        timersub(&end, &start, &end);
+        r->usec = bd->usec[li] = (uint64_t)end.tv_sec * 1000000 + end.tv_usec;
+
+        __atomic_store_n(&bd->state[li],
+            (r->idx != NULL ? BUILD_DONE : BUILD_FAILED), __ATOMIC_RELEASE);
+    }
+
+    if (b.handler != NULL)
+        b.gl_bsc(b.handler);
+
+    while (write(bd->notify[1], "", 1) == -1 && errno == EINTR)
+        ;
+
+    return (NULL);
+}
+
+static void
+build_results_free(void)
+{
+    int     li;
+
+    for (li = 0; li < GEOLOC_NFIELDS; li++) {
+        index_free(build.results[li].idx);
+        table_free(build.results[li].table);
+    }
+    bzero(build.results, sizeof(build.results));
+    bzero(build.prev, sizeof(build.prev));
+}
@@ -0,0 +1,52 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GEOLOC_BUILD_H_
+#define _GEOLOC_BUILD_H_            1
+
+#include "geoloc.h"
+#include "index.h"
+#include "table.h"
+
+enum build_state {
+    BUILD_NONE,
+    BUILD_PENDING,
+    BUILD_RUNNING,
+    BUILD_DONE,
+    BUILD_FAILED
+};
+
+/*
+ * Outcome of a background build for one field, the index
+ * still to be finished against the previous one
+ */
+struct build_result {
+    struct geoloc_index     *idx;
+    struct geoloc_table     *table;
+    uint64_t                usec;
+};
+
+int build_start(struct backend *, void *, struct geolocd_conf *,
+    struct geoloc_index **);
+int build_running(void);
+int build_fd(void);
+int build_collect(struct build_result *);
+void build_cancel(void);
+size_t build_status(char *, size_t);
+
+#endif
@@ -0,0 +1,224 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "capture.h"
+
+#define CAPTURE_BUFSZ       (64 * 1024)
+
+static FILE         *capfp = NULL;
+static uint64_t     caplast = 0;
+
+static void capture_put32(unsigned char *, uint32_t);
+static uint32_t capture_get32(const unsigned char *);
+
+/*
+ * Opens the capture file for appending, written through a
+ * stdio buffer flushed when idle. An existing file has to be
+ * a capture of the same version.
+ */
+int
+capture_start(const char *path)
+{
+    unsigned char   hdr[CAPTURE_HEADER_LEN];
+    FILE            *fp;
+
+    if ((fp = fopen(path, "a+")) == NULL) {
+        log_warn("capture_start: %s", path);
+        return (-1);
+    }
+    setvbuf(fp, NULL, _IOFBF, CAPTURE_BUFSZ);
+
+    if (fseeko(fp, 0, SEEK_END) == -1) {
+        log_warn("capture_start: %s", path);
+        goto fail;
+    }
+    if (ftello(fp) == 0) {
+        memcpy(hdr, CAPTURE_MAGIC, 8);
+        capture_put32(hdr + 8, CAPTURE_VERSION);
+        if (fwrite(hdr, sizeof(hdr), 1, fp) != 1) {
+            log_warn("capture_start: %s", path);
+            goto fail;
+        }
+    } else {
+        rewind(fp);
+        if (capture_header(fp) == -1) {
+            log_warnx("capture_start: %s is not a capture file", path);
+            goto fail;
+        }
+        /* switching from reading to appending */
+        if (fseeko(fp, 0, SEEK_END) == -1) {
+            log_warn("capture_start: %s", path);
+            goto fail;
+        }
+    }
+
+    capfp = fp;
+    caplast = 0;
+
+    return (0);
+
+fail:
+    fclose(fp);
+    return (-1);
+}
+
+/*
+ * Records a lookup request as it arrives, admitted or rejected.
+ * Control requests are not replayed thus not recorded. A write
+ * error stops the capture, the requests are served all the same.
+ */
+void
+capture_request(uint64_t now, uint32_t conn, enum conn_class class,
+    const struct msg_ctl_req *req, const char *payload, size_t len)
+{
+    unsigned char   rec[CAPTURE_RECORD_LEN];
+    uint64_t        delta;
+
+    if (capfp == NULL)
+        return;
+
+    switch (req->type) {
+    case MSG_CTL_BACKEND_INFO:
+    case MSG_CTL_PROPERTY:
+    case MSG_CTL_PROPERTY_BATCH:
+    case MSG_CTL_PROPERTY_ALL:
+    case MSG_CTL_ENUMERATE:
+    case MSG_CTL_REVERSE:
+    case MSG_CTL_NEAREST:
+    case MSG_CTL_RADIUS:
+        break;
+    default:
+        return;
+    }
+
+    /* the first record and idle periods too long for a delta count as none */
+    delta = (caplast == 0 || now < caplast ? 0 : now - caplast);
+    if (delta > UINT32_MAX)
+        delta = 0;
+    caplast = now;
+
+    capture_put32(rec, (uint32_t)delta);
+    capture_put32(rec + 4, conn);
+    rec[8] = (unsigned char)req->type;
+    rec[9] = (unsigned char)req->field;
+    rec[10] = (unsigned char)class;
+    rec[11] = 0;
+    capture_put32(rec + 12, (uint32_t)len);
+
+    if (fwrite(rec, sizeof(rec), 1, capfp) != 1 ||
+        (len > 0 && fwrite(payload, len, 1, capfp) != 1)) {
+        log_warn("capture_request: capture stopped");
+        capture_stop();
+    }
+}
+
+void
+capture_flush(void)
+{
+    if (capfp != NULL && fflush(capfp) == EOF) {
+        log_warn("capture_flush: capture stopped");
+        capture_stop();
+    }
+}
+
+void
+capture_stop(void)
+{
+    if (capfp == NULL)
+        return;
+
+    fclose(capfp);
+    capfp = NULL;
+}
+
+int
+capture_header(FILE *fp)
+{
+    unsigned char   hdr[CAPTURE_HEADER_LEN];
+
+    if (fread(hdr, sizeof(hdr), 1, fp) != 1 ||
+        memcmp(hdr, CAPTURE_MAGIC, 8) != 0 ||
+        capture_get32(hdr + 8) != CAPTURE_VERSION)
+        return (-1);
+
+    return (0);
+}
+
+/*
+ * Reads the next record and its payload, NUL terminated in buf.
+ * Returns 1 with a record, 0 at the end of the capture, a record
+ * cut by a daemon stopping abruptly ending it too, and -1 on error.
+ */
+int
+capture_read(FILE *fp, struct capture_record *rec, char *buf, size_t bufsz)
+{
+    unsigned char   hdr[CAPTURE_RECORD_LEN];
+    size_t          n;
+
+    if ((n = fread(hdr, 1, sizeof(hdr), fp)) != sizeof(hdr)) {
+        if (ferror(fp))
+            return (-1);
+        if (n > 0)
+            log_warnx("capture_read: truncated record ignored");
+        return (0);
+    }
+
+    rec->usec += capture_get32(hdr);
+    rec->conn = capture_get32(hdr + 4);
+    rec->type = hdr[8];
+    rec->field = hdr[9];
+    rec->class = (hdr[10] == CLASS_BULK ? CLASS_BULK : CLASS_INTERACTIVE);
+    rec->len = capture_get32(hdr + 12);
+
+    if (rec->len >= bufsz) {
+        log_warnx("capture_read: record of %u bytes", rec->len);
+        errno = EINVAL;
+        return (-1);
+    }
+    if (rec->len > 0 && fread(buf, rec->len, 1, fp) != 1) {
+        if (ferror(fp))
+            return (-1);
+        log_warnx("capture_read: truncated record ignored");
+        return (0);
+    }
+    buf[rec->len] = '\0';
+
+    return (1);
+}
+
+static void
+capture_put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t
+capture_get32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+        (uint32_t)p[2] << 8 | p[3]);
+}
@@ -0,0 +1,60 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GEOLOC_CAPTURE_H_
+#define _GEOLOC_CAPTURE_H_          1
+
+#include <stdio.h>
+
+#include "geoloc.h"
+
+#define CAPTURE_MAGIC               "GEOLOCAP"
+#define CAPTURE_VERSION             1
+/* magic and version */
+#define CAPTURE_HEADER_LEN          12
+/* delta, connection, type, field, class, flags and length */
+#define CAPTURE_RECORD_LEN          16
+#define CAPTURE_PAYLOAD_MAX         (sizeof(struct msg_ctl_batch) + \
+    GEOLOC_BATCH_MAX * GEOLOC_ADDR_MAX)
+
+/*
+ * One captured request. Records are stored big endian with the
+ * microseconds elapsed since the previous one, usec being the
+ * running sum since the first record once read.
+ */
+struct capture_record {
+    uint64_t                usec;
+    uint32_t                conn;
+    enum msg_type           type;
+    enum msg_field          field;
+    enum conn_class         class;
+    uint32_t                len;
+};
+
+/* geolocd side */
+int capture_start(const char *);
+void capture_request(uint64_t, uint32_t, enum conn_class,
+    const struct msg_ctl_req *, const char *, size_t);
+void capture_flush(void);
+void capture_stop(void);
+
+/* replay side */
+int capture_header(FILE *);
+int capture_read(FILE *, struct capture_record *, char *, size_t);
+
+#endif
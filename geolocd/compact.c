@@ -0,0 +1,586 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "compact.h"
+
+#define COMPACT_BUCKETS_MIN 256
+
+/*
+ * Runs of one address space while adding, the next one
+ * starting where the last added range ends unless a range
+ * follows right away
+ */
+struct compact_space {
+    uint64_t                *keys;
+    uint32_t                *vids;
+    uint32_t                n;
+    uint32_t                sz;
+    uint64_t                next;
+    int                     gap;
+};
+
+struct compact_build {
+    struct compact_space    inet;
+    struct compact_space    inet6;
+    /* value ids + 1 by hash of the value */
+    uint32_t                *buckets;
+    uint32_t                nbuckets;
+    uint32_t                dictsz;
+    size_t                  dictlensz;
+};
+
+static int compact_key(const struct geoloc_addr *, const struct geoloc_addr *,
+    uint64_t *, uint64_t *, struct compact_space **, struct compact_build *);
+static int compact_value(struct compact *, const char *, uint32_t *);
+static int compact_rehash(struct compact *, uint32_t);
+static uint32_t compact_hash(const char *);
+static int compact_run(struct compact_space *, uint64_t, uint32_t);
+static int compact_pack(struct compact_keys *, struct compact_space *,
+    unsigned);
+static uint32_t compact_rank(const struct compact_keys *, uint64_t);
+static unsigned compact_width(uint64_t);
+static void bits_put(uint64_t *, size_t, unsigned, uint64_t);
+static uint64_t bits_get(const uint64_t *, size_t, unsigned);
+static void compact_keys_free(struct compact_keys *);
+static void compact_build_free(struct compact_build *);
+
+struct compact *
+compact_new(void)
+{
+    struct compact  *c;
+    uint32_t        id;
+
+    if ((c = calloc(1, sizeof(*c))) == NULL ||
+        (c->build = calloc(1, sizeof(*c->build))) == NULL) {
+        log_warn("compact_new");
+        free(c);
+        return (NULL);
+    }
+
+    /* every space starts with a run of the empty value */
+    if (compact_rehash(c, COMPACT_BUCKETS_MIN) == -1 ||
+        compact_value(c, "", &id) == -1 ||
+        compact_run(&c->build->inet, 0, 0) == -1 ||
+        compact_run(&c->build->inet6, 0, 0) == -1) {
+        log_warn("compact_new");
+        compact_free(c);
+        return (NULL);
+    }
+
+    return (c);
+}
+
+/*
+ * Adds a range, after the previous ones. IPv6 ranges have to
+ * cover whole /64s, their keys being the upper halves.
+ */
+int
+compact_add(struct compact *c, const struct geoloc_addr *first,
+            const struct geoloc_addr *last, const char *value)
+{
+    struct compact_space    *sp;
+    uint64_t                f, l;
+    uint32_t                id;
+
+    if (compact_key(first, last, &f, &l, &sp, c->build) == -1)
+        return (-1);
+
+    if (sp->gap && f < sp->next) {
+        log_warnx("compact_add: overlapping ranges");
+        return (-1);
+    }
+    if (compact_value(c, value, &id) == -1 ||
+        (sp->gap && f > sp->next && compact_run(sp, sp->next, 0) == -1) ||
+        compact_run(sp, f, id) == -1) {
+        log_warn("compact_add");
+        return (-1);
+    }
+
+    sp->gap = (l != UINT64_MAX);
+    sp->next = l + 1;
+
+    return (0);
+}
+
+/*
+ * Packs the runs added, the build state being released
+ */
+int
+compact_finish(struct compact *c)
+{
+    struct compact_build    *b = c->build;
+
+    if ((b->inet.gap && compact_run(&b->inet, b->inet.next, 0) == -1) ||
+        (b->inet6.gap && compact_run(&b->inet6, b->inet6.next, 0) == -1)) {
+        log_warn("compact_finish");
+        return (-1);
+    }
+
+    c->idwidth = compact_width(c->nvalues - 1);
+    if (compact_pack(&c->inet, &b->inet, c->idwidth) == -1 ||
+        compact_pack(&c->inet6, &b->inet6, c->idwidth) == -1) {
+        log_warn("compact_finish");
+        return (-1);
+    }
+
+    compact_build_free(b);
+    c->build = NULL;
+
+    return (0);
+}
+
+/*
+ * Value of the address, as table_lookup gives it
+ * for the addresses the table covers
+ */
+const char *
+compact_lookup(const struct compact *c, const struct geoloc_addr *addr)
+{
+    const struct compact_keys   *k;
+    uint64_t                    key = 0;
+    uint32_t                    rank;
+    int                         i;
+
+    if (addr_isv4(addr)) {
+        k = &c->inet;
+        for (i = 12; i < 16; i++)
+            key = key << 8 | addr->a[i];
+    } else {
+        k = &c->inet6;
+        for (i = 0; i < 8; i++)
+            key = key << 8 | addr->a[i];
+    }
+
+    rank = compact_rank(k, key);
+
+    return (c->dict + c->dictoffs[bits_get(k->ids,
+        (size_t)rank * c->idwidth, c->idwidth)]);
+}
+
+/*
+ * Gives back the ranges with a value, as merged
+ */
+int
+compact_walk(const struct compact *c, walk_callback cb, void *arg)
+{
+    const struct compact_keys   *k;
+    struct geoloc_addr          first, last;
+    uint64_t                    key = 0, next;
+    size_t                      pos = 0;
+    uint32_t                    i, id, b;
+    int                         inet6, j;
+
+    for (inet6 = 0; inet6 < 2; inet6++) {
+        k = (inet6 ? &c->inet6 : &c->inet);
+        for (i = 0; i < k->nkeys; i++) {
+            b = i / COMPACT_BLOCK;
+            if (i % COMPACT_BLOCK == 0) {
+                key = k->heads[b];
+                pos = k->offs[b];
+            }
+            /* the run ends before the next one starts, 0 for the last */
+            next = 0;
+            if (i + 1 < k->nkeys) {
+                next = ((i + 1) % COMPACT_BLOCK == 0 ? k->heads[b + 1] :
+                    key + bits_get(k->bits, pos, k->widths[b]));
+            }
+
+            id = bits_get(k->ids, (size_t)i * c->idwidth, c->idwidth);
+            if (id != 0) {
+                bzero(&first, sizeof(first));
+                if (inet6) {
+                    for (j = 0; j < 8; j++) {
+                        first.a[j] = key >> (56 - 8 * j);
+                        last.a[j] = (next - 1) >> (56 - 8 * j);
+                        last.a[j + 8] = 0xff;
+                    }
+                } else {
+                    last = first;
+                    first.a[10] = first.a[11] = 0xff;
+                    last.a[10] = last.a[11] = 0xff;
+                    for (j = 0; j < 4; j++) {
+                        first.a[12 + j] = key >> (24 - 8 * j);
+                        last.a[12 + j] = (next == 0 ? 0xff :
+                            (next - 1) >> (24 - 8 * j));
+                    }
+                }
+                if (cb(arg, &first, &last, c->dict + c->dictoffs[id]) == -1)
+                    return (-1);
+            }
+
+            if (next != 0 && (i + 1) % COMPACT_BLOCK != 0)
+                pos += k->widths[b];
+            key = next;
+        }
+    }
+
+    return (0);
+}
+
+void
+compact_usage(const struct compact *c, struct compact_usage *u)
+{
+    const struct compact_keys   *k;
+    int                         inet6;
+
+    bzero(u, sizeof(*u));
+    u->nvalues = c->nvalues;
+    u->dict = c->dictlen + (size_t)c->nvalues * sizeof(*c->dictoffs);
+
+    for (inet6 = 0; inet6 < 2; inet6++) {
+        k = (inet6 ? &c->inet6 : &c->inet);
+        u->nruns += k->nkeys;
+        u->keys += (size_t)k->nblocks * (sizeof(*k->heads) +
+            sizeof(*k->offs) + sizeof(*k->widths)) +
+            (k->nbits / 64 + 1) * sizeof(*k->bits);
+        u->ids += ((size_t)k->nkeys * c->idwidth / 64 + 1) *
+            sizeof(*k->ids);
+    }
+}
+
+void
+compact_free(struct compact *c)
+{
+    if (c == NULL)
+        return;
+
+    compact_build_free(c->build);
+    compact_keys_free(&c->inet);
+    compact_keys_free(&c->inet6);
+    free(c->dict);
+    free(c->dictoffs);
+    free(c);
+}
+
+/*
+ * Keys of the range bounds, with the space they belong to
+ */
+static int
+compact_key(const struct geoloc_addr *first, const struct geoloc_addr *last,
+            uint64_t *f, uint64_t *l, struct compact_space **sp,
+            struct compact_build *b)
+{
+    uint64_t    lf = 0, ll = 0;
+    int         i;
+
+    *f = *l = 0;
+    if (addr_isv4(first)) {
+        if (!addr_isv4(last)) {
+            log_warnx("compact_add: range across address families");
+            return (-1);
+        }
+        for (i = 12; i < 16; i++) {
+            *f = *f << 8 | first->a[i];
+            *l = *l << 8 | last->a[i];
+        }
+        /* the IPv4 space ends at its last address */
+        if (*l == UINT32_MAX)
+            *l = UINT64_MAX;
+        *sp = &b->inet;
+        return (0);
+    }
+
+    for (i = 0; i < 8; i++) {
+        *f = *f << 8 | first->a[i];
+        *l = *l << 8 | last->a[i];
+        lf = lf << 8 | first->a[i + 8];
+        ll = ll << 8 | last->a[i + 8];
+    }
+    if (lf != 0 || ll != UINT64_MAX) {
+        log_warnx("compact_add: IPv6 range not made of /64s");
+        return (-1);
+    }
+    *sp = &b->inet6;
+
+    return (0);
+}
+
+/*
+ * Id of the value, added to the dictionary if new
+ */
+static int
+compact_value(struct compact *c, const char *value, uint32_t *id)
+{
+    struct compact_build    *b = c->build;
+    uint32_t                h, i, *offs, sz;
+    size_t                  len = strlen(value) + 1, lensz;
+    char                    *dict;
+
+    h = compact_hash(value) & (b->nbuckets - 1);
+    while ((i = b->buckets[h]) != 0) {
+        if (strcmp(c->dict + c->dictoffs[i - 1], value) == 0) {
+            *id = i - 1;
+            return (0);
+        }
+        h = (h + 1) & (b->nbuckets - 1);
+    }
+
+    if (c->nvalues == b->dictsz) {
+        sz = (b->dictsz == 0 ? 64 : b->dictsz * 2);
+        if ((offs = reallocarray(c->dictoffs, sz, sizeof(*offs))) == NULL)
+            return (-1);
+        c->dictoffs = offs;
+        b->dictsz = sz;
+    }
+    if (c->dictlen + len > b->dictlensz) {
+        for (lensz = (b->dictlensz == 0 ? 4096 : b->dictlensz);
+            c->dictlen + len > lensz; lensz *= 2)
+            ;
+        if ((dict = realloc(c->dict, lensz)) == NULL)
+            return (-1);
+        c->dict = dict;
+        b->dictlensz = lensz;
+    }
+
+    memcpy(c->dict + c->dictlen, value, len);
+    c->dictoffs[c->nvalues] = c->dictlen;
+    c->dictlen += len;
+    *id = c->nvalues++;
+    b->buckets[h] = c->nvalues;
+
+    /* keeps the table at most half full */
+    if (c->nvalues * 2 > b->nbuckets &&
+        compact_rehash(c, b->nbuckets * 2) == -1)
+        return (-1);
+
+    return (0);
+}
+
+static int
+compact_rehash(struct compact *c, uint32_t nbuckets)
+{
+    struct compact_build    *b = c->build;
+    uint32_t                *buckets, i, h;
+
+    if ((buckets = calloc(nbuckets, sizeof(*buckets))) == NULL)
+        return (-1);
+
+    for (i = 0; i < c->nvalues; i++) {
+        h = compact_hash(c->dict + c->dictoffs[i]) & (nbuckets - 1);
+        while (buckets[h] != 0)
+            h = (h + 1) & (nbuckets - 1);
+        buckets[h] = i + 1;
+    }
+
+    free(b->buckets);
+    b->buckets = buckets;
+    b->nbuckets = nbuckets;
+
+    return (0);
+}
+
+/* FNV-1a */
+static uint32_t
+compact_hash(const char *s)
+{
+    uint32_t    h = 2166136261U;
+
+    while (*s != '\0') {
+        h ^= (uint8_t)*s++;
+        h *= 16777619U;
+    }
+
+    return (h);
+}
+
+/*
+ * Starts a run, unless the previous one has the same value,
+ * replacing an empty one starting at the same key
+ */
+static int
+compact_run(struct compact_space *sp, uint64_t key, uint32_t id)
+{
+    uint64_t    *keys;
+    uint32_t    *vids, sz;
+
+    if (sp->n > 0 && sp->keys[sp->n - 1] == key) {
+        sp->n--;
+        if (sp->n > 0 && sp->vids[sp->n - 1] == id)
+            return (0);
+    }
+    if (sp->n > 0 && sp->vids[sp->n - 1] == id)
+        return (0);
+
+    if (sp->n == sp->sz) {
+        sz = (sp->sz == 0 ? 1024 : sp->sz * 2);
+        if ((keys = reallocarray(sp->keys, sz, sizeof(*keys))) == NULL)
+            return (-1);
+        sp->keys = keys;
+        if ((vids = reallocarray(sp->vids, sz, sizeof(*vids))) == NULL)
+            return (-1);
+        sp->vids = vids;
+        sp->sz = sz;
+    }
+    sp->keys[sp->n] = key;
+    sp->vids[sp->n] = id;
+    sp->n++;
+
+    return (0);
+}
+
+static int
+compact_pack(struct compact_keys *k, struct compact_space *sp, unsigned idw)
+{
+    size_t      pos = 0;
+    uint32_t    i, j, b, end;
+    unsigned    w, dw;
+
+    k->nkeys = sp->n;
+    k->nblocks = (sp->n + COMPACT_BLOCK - 1) / COMPACT_BLOCK;
+
+    /* the block widths first, for the packed size */
+    if ((k->heads = calloc(k->nblocks, sizeof(*k->heads))) == NULL ||
+        (k->offs = calloc(k->nblocks, sizeof(*k->offs))) == NULL ||
+        (k->widths = calloc(k->nblocks, sizeof(*k->widths))) == NULL)
+        return (-1);
+    for (b = 0; b < k->nblocks; b++) {
+        i = b * COMPACT_BLOCK;
+        end = (i + COMPACT_BLOCK < sp->n ? i + COMPACT_BLOCK : sp->n);
+        k->heads[b] = sp->keys[i];
+        k->offs[b] = pos;
+        for (j = i + 1, w = 0; j < end; j++)
+            if ((dw = compact_width(sp->keys[j] - sp->keys[j - 1])) > w)
+                w = dw;
+        k->widths[b] = w;
+        pos += (size_t)w * (end - i - 1);
+    }
+    k->nbits = pos;
+
+    /* a word more, values being read two words at a time */
+    if ((k->bits = calloc(k->nbits / 64 + 2, sizeof(*k->bits))) == NULL ||
+        (k->ids = calloc((size_t)sp->n * idw / 64 + 2,
+        sizeof(*k->ids))) == NULL)
+        return (-1);
+
+    for (b = 0; b < k->nblocks; b++) {
+        i = b * COMPACT_BLOCK;
+        end = (i + COMPACT_BLOCK < sp->n ? i + COMPACT_BLOCK : sp->n);
+        for (j = i + 1, pos = k->offs[b]; j < end; j++, pos += k->widths[b])
+            bits_put(k->bits, pos, k->widths[b],
+                sp->keys[j] - sp->keys[j - 1]);
+    }
+    for (i = 0; i < sp->n; i++)
+        bits_put(k->ids, (size_t)i * idw, idw, sp->vids[i]);
+
+    return (0);
+}
+
+/*
+ * Rank of the last run starting at or before the key: the block
+ * by binary search of the heads, then the run by summing its deltas
+ */
+static uint32_t
+compact_rank(const struct compact_keys *k, uint64_t key)
+{
+    uint64_t    cur;
+    size_t      pos;
+    uint32_t    lo = 0, hi = k->nblocks, mid, rank, end;
+    unsigned    w;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (k->heads[mid] <= key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    /* the first run starts at 0 */
+    lo--;
+
+    rank = lo * COMPACT_BLOCK;
+    end = (rank + COMPACT_BLOCK < k->nkeys ? rank + COMPACT_BLOCK : k->nkeys);
+    cur = k->heads[lo];
+    pos = k->offs[lo];
+    w = k->widths[lo];
+    while (rank + 1 < end) {
+        cur += bits_get(k->bits, pos, w);
+        if (cur > key)
+            break;
+        pos += w;
+        rank++;
+    }
+
+    return (rank);
+}
+
+/*
+ * Bits needed for the value, 0 for 0
+ */
+static unsigned
+compact_width(uint64_t v)
+{
+    return (v == 0 ? 0 : 64 - __builtin_clzll(v));
+}
+
+static void
+bits_put(uint64_t *bits, size_t pos, unsigned w, uint64_t v)
+{
+    size_t      word = pos / 64;
+    unsigned    sh = pos % 64;
+
+    if (w == 0)
+        return;
+    bits[word] |= v << sh;
+    if (sh + w > 64)
+        bits[word + 1] |= v >> (64 - sh);
+}
+
+static uint64_t
+bits_get(const uint64_t *bits, size_t pos, unsigned w)
+{
+    size_t      word = pos / 64;
+    unsigned    sh = pos % 64;
+    uint64_t    v;
+
+    if (w == 0)
+        return (0);
+    v = bits[word] >> sh;
+    if (sh + w > 64)
+        v |= bits[word + 1] << (64 - sh);
+
+    return (w == 64 ? v : v & ((1ULL << w) - 1));
+}
+
+static void
+compact_keys_free(struct compact_keys *k)
+{
+    free(k->heads);
+    free(k->offs);
+    free(k->widths);
+    free(k->bits);
+    free(k->ids);
+}
+
+static void
+compact_build_free(struct compact_build *b)
+{
+    if (b == NULL)
+        return;
+
+    free(b->inet.keys);
+    free(b->inet.vids);
+    free(b->inet6.keys);
+    free(b->inet6.vids);
+    free(b->buckets);
+    free(b);
+}
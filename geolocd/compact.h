@@ -0,0 +1,83 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GEOLOC_COMPACT_H_
+#define _GEOLOC_COMPACT_H_          1
+
+#include "geoloc.h"
+
+/* run starts per delta block */
+#define COMPACT_BLOCK               32
+
+/*
+ * Run starts of one address space as 64 bits keys, the IPv4
+ * address or the upper half of the IPv6 one. Every COMPACT_BLOCK
+ * keys, a block starts with its first key whole, searched first,
+ * the others being the differences with their predecessor packed
+ * at the width of the block largest one. The rank of the run found
+ * gives its value id, packed as well.
+ */
+struct compact_keys {
+    uint64_t                *heads;
+    uint64_t                *offs;
+    uint8_t                 *widths;
+    uint64_t                *bits;
+    uint64_t                *ids;
+    uint32_t                nkeys;
+    uint32_t                nblocks;
+    size_t                  nbits;
+};
+
+/*
+ * Read only form of a table: adjacent ranges of a same value merged,
+ * gaps being runs of the empty value, and each value stored once in
+ * a dictionary, id 0 being the empty one
+ */
+struct compact {
+    struct compact_keys     inet;
+    struct compact_keys     inet6;
+    unsigned                idwidth;
+    char                    *dict;
+    uint32_t                *dictoffs;
+    uint32_t                nvalues;
+    size_t                  dictlen;
+    /* while adding the ranges */
+    struct compact_build    *build;
+};
+
+/*
+ * Sizes of the parts, in bytes
+ */
+struct compact_usage {
+    uint32_t                nruns;
+    uint32_t                nvalues;
+    size_t                  keys;
+    size_t                  ids;
+    size_t                  dict;
+};
+
+struct compact *compact_new(void);
+int compact_add(struct compact *, const struct geoloc_addr *,
+    const struct geoloc_addr *, const char *);
+int compact_finish(struct compact *);
+const char *compact_lookup(const struct compact *, const struct geoloc_addr *);
+int compact_walk(const struct compact *, walk_callback, void *);
+void compact_usage(const struct compact *, struct compact_usage *);
+void compact_free(struct compact *);
+
+#endif
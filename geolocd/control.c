@@ -21,11 +21,15 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #ifdef  HAVE_NO_BSDFUNCS
 #include <bsd/string.h>
 #endif
 #include <errno.h>
 #include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -35,7 +39,7 @@
 #include "control.h"
 
 int
-control_init(void)
+control_init(const char *path)
 {
     struct sockaddr_un  sun;
     int                 fd;
@@ -48,28 +52,33 @@ control_init(void)
 
     bzero(&sun, sizeof(sun));
     sun.sun_family = AF_UNIX;
-    strlcpy(sun.sun_path, GEOLOCD_SOCKET, sizeof(sun.sun_path));
+    if (strlcpy(sun.sun_path, path, sizeof(sun.sun_path)) >=
+        sizeof(sun.sun_path)) {
+        log_warnx("control_init: %s: path too long", path);
+        close(fd);
+        return (-1);
+    }
 
-    if (unlink(GEOLOCD_SOCKET) == -1)
+    if (unlink(path) == -1)
         if (errno != ENOENT) {
-            log_warn("control_init: unlink %s", GEOLOCD_SOCKET);
+            log_warn("control_init: unlink %s", path);
             close(fd);
             return (-1);
         }
 
     old_umask = umask(S_IXUSR|S_IXGRP|S_IWOTH|S_IROTH|S_IXOTH);
     if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
-        log_warn("control_init: bind: %s", GEOLOCD_SOCKET);
+        log_warn("control_init: bind: %s", path);
         close(fd);
         umask(old_umask);
         return (-1);
     }
     umask(old_umask);
 
-    if (chmod(GEOLOCD_SOCKET, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP) == -1) {
+    if (chmod(path, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP) == -1) {
         log_warn("control_init: chmod");
         close(fd);
-        (void)unlink(GEOLOCD_SOCKET);
+        (void)unlink(path);
         return (-1);
     }
 
@@ -78,6 +87,76 @@ control_init(void)
     return (fd);
 }
 
+/*
+ * TCP socket speaking the same protocol, bound
+ * to the first address of host that accepts it
+ */
+int
+control_tcp_init(const char *host, unsigned port)
+{
+    struct addrinfo hints, *res, *ai;
+    char            sport[8];
+    int             fd = -1, on = 1, error;
+
+    bzero(&hints, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    snprintf(sport, sizeof(sport), "%u", port);
+
+    if ((error = getaddrinfo(host, sport, &hints, &res)) != 0) {
+        log_warnx("control_tcp_init: %s: %s", host, gai_strerror(error));
+        return (-1);
+    }
+
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        if ((fd = socket(ai->ai_family, ai->ai_socktype,
+            ai->ai_protocol)) == -1)
+            continue;
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on,
+            sizeof(on)) == 0 &&
+            bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if (fd == -1) {
+        log_warn("control_tcp_init: bind: %s port %u", host, port);
+        return (-1);
+    }
+
+    session_socket_blockmode(fd, BM_NONBLOCK);
+
+    return (fd);
+}
+
+/*
+ * Has the kernel busy poll the device queue on reads of the TCP
+ * connections, which inherit it from the listener. Raising it
+ * takes the privileges, hence set on the listener at startup.
+ */
+int
+control_busypoll(int fd)
+{
+#ifdef SO_BUSY_POLL
+    int     usec = CONTROL_BUSY_POLL;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec,
+        sizeof(usec)) == -1) {
+        log_warn("control_busypoll");
+        return (-1);
+    }
+
+    return (0);
+#else
+    (void)fd;
+
+    return (-1);
+#endif
+}
+
 int
 control_listen(int fd)
 {
@@ -91,6 +170,177 @@ control_listen(int fd)
 
 
 
+/*
+ * Upgrade, new process side: asks the running daemon listening on
+ * path for its listening sockets, the local one then the TCP one if
+ * any. The connection is returned, kept to tell it once ready.
+ */
+int
+control_inherit(const char *path, int *ctl, int *tcp)
+{
+    struct sockaddr_un  sun;
+    struct msg_ctl_req  req;
+    struct msg_ctl_res  res;
+    struct msghdr       msg;
+    struct cmsghdr      *cmsg;
+    struct iovec        iov;
+    union {
+        struct cmsghdr  hdr;
+        char            buf[CMSG_SPACE(2 * sizeof(int))];
+    }                   cmsgbuf;
+    int                 fd, fds[2];
+    ssize_t             n;
+
+    *ctl = *tcp = -1;
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+        log_warn("control_inherit: socket");
+        return (-1);
+    }
+
+    bzero(&sun, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1) {
+        log_warn("control_inherit: connect: %s", path);
+        close(fd);
+        return (-1);
+    }
+
+    bzero(&req, sizeof(req));
+    req.type = MSG_CTL_UPGRADE;
+    if (send(fd, &req, sizeof(req), 0) != sizeof(req)) {
+        log_warn("control_inherit: send");
+        close(fd);
+        return (-1);
+    }
+
+    bzero(&msg, sizeof(msg));
+    iov.iov_base = &res;
+    iov.iov_len = sizeof(res);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgbuf.buf;
+    msg.msg_controllen = sizeof(cmsgbuf.buf);
+
+    while ((n = recvmsg(fd, &msg, MSG_WAITALL)) == -1 && errno == EINTR)
+        ;
+    if (n != sizeof(res) || res.status != MSG_STATUS_OK ||
+        res.count == 0 || res.count > 2 ||
+        (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+        cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(res.count * sizeof(int))) {
+        log_warnx("control_inherit: %s refused to hand its sockets over",
+            path);
+        close(fd);
+        return (-1);
+    }
+
+    memcpy(fds, CMSG_DATA(cmsg), res.count * sizeof(int));
+    *ctl = fds[0];
+    session_socket_blockmode(*ctl, BM_NONBLOCK);
+    if (res.count == 2) {
+        *tcp = fds[1];
+        session_socket_blockmode(*tcp, BM_NONBLOCK);
+    }
+
+    return (fd);
+}
+
+/*
+ * Upgrade, running daemon side: sends the listening sockets
+ * along with the reply header, count telling how many
+ */
+int
+control_handoff(int fd, int ctl, int tcp)
+{
+    struct msg_ctl_res  res;
+    struct msghdr       msg;
+    struct cmsghdr      *cmsg;
+    struct iovec        iov;
+    union {
+        struct cmsghdr  hdr;
+        char            buf[CMSG_SPACE(2 * sizeof(int))];
+    }                   cmsgbuf;
+    int                 fds[2];
+
+    bzero(&res, sizeof(res));
+    res.status = MSG_STATUS_OK;
+    fds[res.count++] = ctl;
+    if (tcp != -1)
+        fds[res.count++] = tcp;
+
+    bzero(&msg, sizeof(msg));
+    bzero(&cmsgbuf, sizeof(cmsgbuf));
+    iov.iov_base = &res;
+    iov.iov_len = sizeof(res);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cmsgbuf.buf;
+    msg.msg_controllen = CMSG_SPACE(res.count * sizeof(int));
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(res.count * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, res.count * sizeof(int));
+
+    if (sendmsg(fd, &msg, 0) != sizeof(res)) {
+        log_warn("control_handoff: sendmsg");
+        return (-1);
+    }
+
+    return (0);
+}
+
+/*
+ * Upgrade, new process side: tells the daemon it took the
+ * sockets from that requests can be served, then waits for
+ * its acknowledgement, any other reply, such as an overloaded
+ * rejection, failing the upgrade. The connection is closed on
+ * failure only, to be kept open for as long as the new process
+ * serves.
+ */
+int
+control_ready(int fd)
+{
+    struct msg_ctl_req  req;
+    char                ack[sizeof(GEOLOC_DRAINING_INFO)];
+    size_t              off = 0;
+    char                c;
+    ssize_t             n;
+
+    bzero(&req, sizeof(req));
+    req.type = MSG_CTL_READY;
+    if (send(fd, &req, sizeof(req), 0) != sizeof(req)) {
+        log_warn("control_ready: send");
+        close(fd);
+        return (-1);
+    }
+
+    /* longer replies are read through, then fail the comparison */
+    for (;;) {
+        if ((n = recv(fd, &c, 1, 0)) != 1) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            close(fd);
+            return (-1);
+        }
+        if (off < sizeof(ack))
+            ack[off++] = c;
+        if (c == '\0')
+            break;
+    }
+
+    if (ack[off - 1] != '\0' || strcmp(ack, GEOLOC_DRAINING_INFO) != 0) {
+        log_warnx("control_ready: upgrade not acknowledged");
+        close(fd);
+        return (-1);
+    }
+
+    return (0);
+}
+
 void
 control_shutdown(int fd)
 {
@@ -98,21 +348,30 @@ control_shutdown(int fd)
 }
 
 void
-control_cleanup(void)
+control_cleanup(const char *path)
 {
-    unlink(GEOLOCD_SOCKET);
+    unlink(path);
 }
 
+/*
+ * TCP connections get Nagle off, replies
+ * being written whole
+ */
 int
 control_accept(int fd)
 {
-    int                 connfd;
-    socklen_t           len;
-    struct sockaddr_un  sun;
+    int                     connfd, on = 1;
+    socklen_t               len;
+    struct sockaddr_storage ss;
 
-    len = sizeof(sun);
-    if ((connfd = accept(fd, (struct sockaddr *)&sun, &len)) != -1)
+    len = sizeof(ss);
+    if ((connfd = accept(fd, (struct sockaddr *)&ss, &len)) != -1) {
         session_socket_blockmode(connfd, BM_NONBLOCK);
+        if ((ss.ss_family == AF_INET || ss.ss_family == AF_INET6) &&
+            setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &on,
+            sizeof(on)) == -1)
+            log_warn("control_accept: TCP_NODELAY");
+    }
 
     return (connfd);
 }
@@ -22,19 +22,27 @@
 
 #include "geoloc.h"
 
-#define CONTROL_BACKLOG             5
+#define CONTROL_BACKLOG             128
+#define CONTROL_POLL_TIMEOUT        60
+/* microseconds the kernel polls the device for on TCP reads */
+#define CONTROL_BUSY_POLL           50
 
 enum blockmodes {
     BM_NORMAL,
     BM_NONBLOCK
 };
 
-int control_init(void);
+int control_init(const char *);
+int control_tcp_init(const char *, unsigned);
 int control_listen(int);
+int control_busypoll(int);
 int control_accept(int);
 int control_close(int);
+int control_inherit(const char *, int *, int *);
+int control_handoff(int, int, int);
+int control_ready(int);
 void control_shutdown(int);
-void control_cleanup(void);
+void control_cleanup(const char *);
 void session_socket_blockmode(int, enum blockmodes);
 
 #endif
@@ -0,0 +1,238 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "delta.h"
+
+static int delta_add(struct delta *, const struct geoloc_addr *,
+    const struct geoloc_addr *, const char *);
+static int delta_range_cmp(const void *, const void *);
+static void delta_next(const struct delta *, size_t *,
+    const struct geoloc_addr *, const char **, struct geoloc_addr *);
+static void delta_print(FILE *, const struct geoloc_addr *,
+    const struct geoloc_addr *, const char *);
+
+/*
+ * Reads the ranges, sorted then checked for overlaps.
+ * With header set, the first line has to be DELTA_HEADER.
+ */
+struct delta *
+delta_read(FILE *fp, int header)
+{
+    struct delta        *d;
+    struct geoloc_addr  first, last;
+    char                *line = NULL, *p, *f, *l;
+    size_t              linesz = 0, i, lineno = 0;
+    ssize_t             len;
+
+    if ((d = calloc(1, sizeof(*d))) == NULL) {
+        log_warn("delta_read");
+        return (NULL);
+    }
+
+    while ((len = getline(&line, &linesz, fp)) != -1) {
+        lineno++;
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+
+        if (header && lineno == 1) {
+            if (strcmp(line, DELTA_HEADER) != 0) {
+                log_warnx("delta_read: not a delta");
+                goto fail;
+            }
+            continue;
+        }
+
+        p = line + strspn(line, " \t");
+        if (*p == '\0' || *p == '#')
+            continue;
+
+        f = strsep(&p, " \t");
+        if (p != NULL)
+            p += strspn(p, " \t");
+        l = (p != NULL ? strsep(&p, " \t") : NULL);
+        if (p != NULL)
+            p += strspn(p, " \t");
+
+        if (l == NULL || addr_parse(f, &first) == -1 ||
+            addr_parse(l, &last) == -1 || addr_cmp(&first, &last) > 0 ||
+            addr_isv4(&first) != addr_isv4(&last)) {
+            log_warnx("delta_read: line %zu: invalid range", lineno);
+            goto fail;
+        }
+
+        if (delta_add(d, &first, &last, (p != NULL ? p : "")) == -1)
+            goto fail;
+    }
+
+    if (header && lineno == 0) {
+        log_warnx("delta_read: empty delta");
+        goto fail;
+    }
+
+    if (d->nranges > 1)
+        qsort(d->ranges, d->nranges, sizeof(*d->ranges), delta_range_cmp);
+
+    for (i = 1; i < d->nranges; i++)
+        if (addr_cmp(&d->ranges[i].first, &d->ranges[i - 1].last) <= 0) {
+            log_warnx("delta_read: overlapping ranges");
+            goto fail;
+        }
+
+    free(line);
+
+    return (d);
+
+fail:
+    free(line);
+    delta_free(d);
+    return (NULL);
+}
+
+/*
+ * Writes the delta turning the old ranges into the new ones: the
+ * runs where the values differ, with their new (maybe empty) value
+ */
+int
+delta_diff(const struct delta *old, const struct delta *new, FILE *out)
+{
+    struct geoloc_addr  cur, oend, nend, end, mfirst, mlast;
+    const char          *ov, *nv, *mv = NULL;
+    size_t              op = 0, np = 0;
+
+    fprintf(out, "%s\n", DELTA_HEADER);
+
+    bzero(&cur, sizeof(cur));
+    for (;;) {
+        delta_next(old, &op, &cur, &ov, &oend);
+        delta_next(new, &np, &cur, &nv, &nend);
+        end = (addr_cmp(&oend, &nend) < 0 ? oend : nend);
+
+        if (strcmp(ov, nv) != 0) {
+            if (mv != NULL && strcmp(mv, nv) == 0) {
+                mlast = end;
+            } else {
+                if (mv != NULL)
+                    delta_print(out, &mfirst, &mlast, mv);
+                mfirst = cur;
+                mlast = end;
+                mv = nv;
+            }
+        } else if (mv != NULL) {
+            delta_print(out, &mfirst, &mlast, mv);
+            mv = NULL;
+        }
+
+        cur = end;
+        if (addr_incr(&cur))
+            break;
+    }
+
+    if (mv != NULL)
+        delta_print(out, &mfirst, &mlast, mv);
+
+    return (ferror(out) ? -1 : 0);
+}
+
+void
+delta_free(struct delta *d)
+{
+    size_t  i;
+
+    if (d == NULL)
+        return;
+
+    for (i = 0; i < d->nranges; i++)
+        free(d->ranges[i].value);
+    free(d->ranges);
+    free(d);
+}
+
+static int
+delta_add(struct delta *d, const struct geoloc_addr *first,
+          const struct geoloc_addr *last, const char *value)
+{
+    struct delta_range  *ranges;
+    size_t              sz;
+
+    if (d->nranges == d->rangesz) {
+        sz = (d->rangesz == 0 ? 256 : d->rangesz * 2);
+        if ((ranges = reallocarray(d->ranges, sz, sizeof(*ranges))) == NULL) {
+            log_warn("delta_add");
+            return (-1);
+        }
+        d->ranges = ranges;
+        d->rangesz = sz;
+    }
+
+    if ((d->ranges[d->nranges].value = strdup(value)) == NULL) {
+        log_warn("delta_add");
+        return (-1);
+    }
+    d->ranges[d->nranges].first = *first;
+    d->ranges[d->nranges].last = *last;
+    d->nranges++;
+
+    return (0);
+}
+
+static int
+delta_range_cmp(const void *a, const void *b)
+{
+    return (addr_cmp(&((const struct delta_range *)a)->first,
+        &((const struct delta_range *)b)->first));
+}
+
+/*
+ * Value at cur, with the last address having it,
+ * p being the first range not before cur
+ */
+static void
+delta_next(const struct delta *d, size_t *p, const struct geoloc_addr *cur,
+           const char **value, struct geoloc_addr *end)
+{
+    while (*p < d->nranges && addr_cmp(&d->ranges[*p].last, cur) < 0)
+        (*p)++;
+
+    if (*p == d->nranges) {
+        *value = "";
+        memset(end->a, 0xff, sizeof(end->a));
+    } else if (addr_cmp(&d->ranges[*p].first, cur) <= 0) {
+        *value = d->ranges[*p].value;
+        *end = d->ranges[*p].last;
+    } else {
+        *value = "";
+        *end = d->ranges[*p].first;
+        addr_decr(end);
+    }
+}
+
+static void
+delta_print(FILE *out, const struct geoloc_addr *first,
+            const struct geoloc_addr *last, const char *value)
+{
+    char    f[GEOLOC_ADDR_MAX], l[GEOLOC_ADDR_MAX];
+
+    addr_format(first, f, sizeof(f));
+    addr_format(last, l, sizeof(l));
+    fprintf(out, "%s %s%s%s\n", f, l, (*value != '\0' ? " " : ""), value);
+}
@@ -0,0 +1,53 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GEOLOC_DELTA_H_
+#define _GEOLOC_DELTA_H_            1
+
+#include <stdio.h>
+
+#include "geoloc.h"
+
+#define DELTA_HEADER                "geoloc delta 1"
+
+/*
+ * Address range with its value, an empty value
+ * clearing the range in a delta
+ */
+struct delta_range {
+    struct geoloc_addr      first;
+    struct geoloc_addr      last;
+    char                    *value;
+};
+
+/*
+ * Sorted, non overlapping ranges read from a text file, one
+ * "first last value" line per range. Range databases and deltas
+ * share this format, deltas starting with DELTA_HEADER.
+ */
+struct delta {
+    struct delta_range      *ranges;
+    size_t                  nranges;
+    size_t                  rangesz;
+};
+
+struct delta *delta_read(FILE *, int);
+int delta_diff(const struct delta *, const struct delta *, FILE *);
+void delta_free(struct delta *);
+
+#endif
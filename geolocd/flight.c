@@ -0,0 +1,169 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "flight.h"
+
+/* open addressing, kept at most half full */
+#define FLIGHT_BUCKETS      (FLIGHT_MAX * 2)
+
+/*
+ * A backend lookup of the round, its data released at the end
+ */
+struct flight {
+    struct geoloc_addr      addr;
+    uint8_t                 li;
+    uint8_t                 used;
+    uint8_t                 pending;
+    const char              *info;
+    void                    *ref;
+};
+
+static struct flight        flights[FLIGHT_BUCKETS];
+/* buckets taken during the round, to be cleared */
+static uint16_t             taken[FLIGHT_MAX];
+static size_t               ntaken = 0;
+static struct backend       *fbackend = NULL;
+static void                 *fhandler = NULL;
+
+static size_t flight_find(const struct geoloc_addr *, enum lookup_info_type);
+
+/*
+ * Starts a round: identical lookups of the requests served
+ * together are made once, the ones coming later in the round
+ * being given the value of the first one
+ */
+void
+flight_begin(struct backend *b)
+{
+    fbackend = b;
+    fhandler = b->handler;
+    ntaken = 0;
+}
+
+static size_t
+flight_find(const struct geoloc_addr *addr, enum lookup_info_type li)
+{
+    uint32_t    h = 2166136261U;
+    size_t      i;
+
+    for (i = 0; i < sizeof(addr->a); i++)
+        h = (h ^ addr->a[i]) * 16777619U;
+    h = (h ^ li) * 16777619U;
+
+    for (i = h & (FLIGHT_BUCKETS - 1); flights[i].used;
+        i = (i + 1) & (FLIGHT_BUCKETS - 1))
+        if (flights[i].li == li &&
+            memcmp(flights[i].addr.a, addr->a, sizeof(addr->a)) == 0)
+            break;
+
+    return (i);
+}
+
+/*
+ * Looks the address up among the ones of the round, the first
+ * caller becoming its lead when there is room left
+ */
+enum flight_state
+flight_join(const struct geoloc_addr *addr, enum lookup_info_type li,
+    const char **info)
+{
+    struct flight   *f;
+    size_t          i;
+
+    if (fbackend == NULL)
+        return (FLIGHT_NONE);
+
+    i = flight_find(addr, li);
+    f = &flights[i];
+
+    if (f->used) {
+        if (f->pending)
+            return (FLIGHT_PENDING);
+        *info = f->info;
+        return (FLIGHT_DONE);
+    }
+
+    if (ntaken == FLIGHT_MAX)
+        return (FLIGHT_NONE);
+
+    f->addr = *addr;
+    f->li = li;
+    f->used = 1;
+    f->pending = 1;
+    f->info = NULL;
+    f->ref = NULL;
+    taken[ntaken++] = i;
+
+    return (FLIGHT_LEAD);
+}
+
+/*
+ * Value of a lead lookup. The round keeps the backend data
+ * when the address was joined, returning 0; the caller has
+ * to release it otherwise.
+ */
+int
+flight_land(const struct geoloc_addr *addr, enum lookup_info_type li,
+    const char *info, void *ref)
+{
+    struct flight   *f;
+
+    if (fbackend == NULL)
+        return (-1);
+
+    f = &flights[flight_find(addr, li)];
+    if (!f->used || !f->pending)
+        return (-1);
+
+    f->info = info;
+    f->ref = ref;
+    f->pending = 0;
+
+    return (0);
+}
+
+/*
+ * The replies of the round are sent or copied to the
+ * sessions buffers, the backend data can go
+ */
+void
+flight_end(void)
+{
+    struct flight   *f;
+    size_t          i;
+
+    if (fbackend == NULL)
+        return;
+
+    for (i = 0; i < ntaken; i++) {
+        f = &flights[taken[i]];
+        if (f->ref != NULL)
+            fbackend->gl_blcc(fhandler, f->ref);
+        bzero(f, sizeof(*f));
+    }
+
+    ntaken = 0;
+    fbackend = NULL;
+    fhandler = NULL;
+}
@@ -0,0 +1,44 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GEOLOC_FLIGHT_H_
+#define _GEOLOC_FLIGHT_H_           1
+
+#include "addr.h"
+#include "geoloc.h"
+
+/* distinct backend lookups shared per serve round */
+#define FLIGHT_MAX                  4096
+
+enum flight_state {
+    /* not shared, the caller keeps the backend data */
+    FLIGHT_NONE,
+    /* the caller looks the address up for the round, then lands it */
+    FLIGHT_LEAD,
+    /* looked up earlier in the round, the value is given */
+    FLIGHT_DONE,
+    /* being looked up by another one of the same batch */
+    FLIGHT_PENDING
+};
+
+void flight_begin(struct backend *);
+enum flight_state flight_join(const struct geoloc_addr *, enum lookup_info_type, const char **);
+int flight_land(const struct geoloc_addr *, enum lookup_info_type, const char *, void *);
+void flight_end(void);
+
+#endif
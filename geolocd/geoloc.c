@@ -20,6 +20,7 @@
 #include <sys/wait.h>
 #include <sys/socket.h>
 #include <sys/queue.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <sys/sysctl.h>
 
@@ -27,6 +28,7 @@
 #include <arpa/inet.h>
 
 #ifdef HAVE_NO_BSDFUNCS
+#include <bsd/string.h>
 #include <bsd/unistd.h>
 #endif
 
@@ -43,6 +45,19 @@
 
 #include "log.h"
 #include "control.h"
+#include "reply.h"
+#include "session.h"
+#include "build.h"
+#include "arena.h"
+#include "capture.h"
+#include "delta.h"
+#include "flight.h"
+#include "hotset.h"
+#include "analytics.h"
+#include "index.h"
+#include "table.h"
+#include "spatial.h"
+#include "trace.h"
 #include "geoloc.h"
 #include "modules.h"
 
@@ -51,18 +66,117 @@ void sighandler(int);
 
 volatile sig_atomic_t   die = 0;
 int                     ctl_fd;
+int                     tcp_fd = -1;
+/* the local socket path is ours to unlink at shutdown */
+static int              sockowner = 0;
+/* handed the sockets over to an upgraded process, serving what is left */
+static int              draining = 0;
+static uint64_t         drainstart;
 struct geolocd_conf     *conf = NULL;
 static struct backend   *backend = NULL;
-int geoloc_msg_dispatch(int);
+struct geoloc_stats     stats;
+static struct geoloc_index *indexes[GEOLOC_NFIELDS];
+static struct geoloc_table *tables[GEOLOC_NFIELDS];
+static int              rebuild = 0;
+static struct spatial_tree *pops;
+static struct spatial_tree *places;
+/* bumped with every places tree, radius streams ending on a change */
+static unsigned         places_gen = 0;
+/* request path memory, reset after every serve round */
+static struct arena     serve_arena;
+/* backend handler loaded by a reload prepare, awaiting its commit */
+static void             *staged = NULL;
+
+struct enumerate_job;
+
+void geoloc_index_build(void *);
+void geoloc_index_publish(void);
+void geoloc_index_free(void);
+void geoloc_pops_build(void);
+void geoloc_places_build(void);
+void geoloc_warmup(void);
+int geoloc_coords(const char *, double *, double *);
+void geoloc_trace_begin(const struct session_request *);
+void geoloc_trace_lookup(enum lookup_info_type, uint64_t, uint32_t);
+const char *geoloc_table_lookup(const struct geoloc_addr *, enum lookup_info_type);
+void *geoloc_lookup(const char *, enum lookup_info_type, const char **);
+static void *geoloc_backend_lookup(const struct geoloc_addr *, const char *, enum lookup_info_type, const char **);
+void geoloc_lookup_batch(const char **, size_t, enum lookup_info_type, const char **, void **);
+void geoloc_lookup_fields(const char *, const enum lookup_info_type *, size_t, const char **, void **);
+void geoloc_msg_serve(void);
+int geoloc_msg_dispatch(struct session_request *);
 int geoloc_msg_backend(int, struct msg_ctl_req);
 int geoloc_msg_property(int, struct msg_ctl_req, const char *);
+int geoloc_msg_property_batch(int, struct msg_ctl_req, const char *, size_t);
+int geoloc_msg_property_all(int, const char *);
+int geoloc_msg_field(enum msg_field, enum lookup_info_type *);
+int geoloc_msg_stats(int);
+int geoloc_msg_enumerate(struct session *, struct msg_ctl_req, const char *);
+int geoloc_stream_resume(struct session *);
+int geoloc_msg_reverse(struct session *, struct msg_ctl_req, const char *);
+int geoloc_msg_reload(int, enum msg_field);
+void geoloc_reload_swap(void *);
+int geoloc_msg_build(int);
+int geoloc_msg_delta(int, struct msg_ctl_req, const char *);
+int geoloc_msg_nearest(int, const char *);
+int geoloc_msg_radius(struct session *, const char *);
+int geoloc_msg_slowlog(int);
+int geoloc_msg_memory(int);
+int geoloc_msg_upgrade(struct session *);
+int geoloc_msg_ready(struct session *);
+int geoloc_msg_analytics(int);
+static size_t geoloc_msg_table(char *, size_t, enum lookup_info_type);
+static size_t geoloc_msg_numa(char *, size_t);
+static int geoloc_enumerate_cb(void *, const struct geoloc_addr *, const struct geoloc_addr *, const char *);
+static int geoloc_radius_cb(void *, const struct spatial_point *, double);
+static int geoloc_reverse_step(struct enumerate_job *);
+static int geoloc_radius_step(struct enumerate_job *);
+
+#define ENUMERATE_CHUNK     16384
+/* backend lookups of an enumeration per round, others served between */
+#define ENUMERATE_STEPS     4096
+/* ranges of a reverse lookup per round */
+#define REVERSE_SPANS       1024
+/* and ranges of a radius one, its points looked at being ENUMERATE_STEPS */
+#define RADIUS_SPANS        1024
+/* requests served between two polls */
+#define SERVE_MAX           64
+/* seconds left to the connections to finish once upgraded */
+#define UPGRADE_DRAIN       10
+
+struct enumerate_stream {
+    int                 fd;
+    size_t              len;
+    uint32_t            count;
+    char                buf[ENUMERATE_CHUNK];
+};
+
+/*
+ * Enumeration, reverse lookup or radius search streamed over several
+ * rounds, kept on its session. A reverse one goes on from the address
+ * it stopped at, the index possibly published again between two rounds.
+ * A radius one goes on with the ranges of the place it stopped at, then
+ * with the search.
+ */
+struct enumerate_job {
+    enum msg_type               type;
+    struct walk_cursor          wc;
+    enum lookup_info_type       li;
+    struct geoloc_addr          next;
+    char                        value[GEOLOC_VALUE_MAX];
+    struct spatial_cursor       sc;
+    const struct spatial_point  *place;
+    uint32_t                    span;
+    unsigned                    gen;
+    struct enumerate_stream     es;
+};
 
 void
 usage(void)
 {
     extern char *__progname;
 
-    fprintf(stderr, "usage: %s [-dv][-f file]\n",
+    fprintf(stderr, "usage: %s [-duv][-f file]\n",
         __progname);
     exit(1);
 }
@@ -86,20 +200,23 @@ main(int argc, char *argv[])
 {
 	int				    ch;
     int                 ndfs;
+    size_t              npfd, pfdsz = 0;
 	int				    debug = 0;
 	int				    verbose = 0;
-	const char		    *conffile;
-    struct pollfd       pfd[1];
+    int                 upgrade = 0, upgrade_fd = -1;
+	const char		    *conffile, *sockpath;
+    struct pollfd       *pfd = NULL;
     struct passwd       *pw = NULL;
-    void                *handler = NULL;
+    void                *handler = NULL, *bhandler = NULL;
     struct backend      *bcurrent = NULL;
+    uint64_t            hotsaved = 0, busy = 0;
 
 	conffile = CONF_FILE;
 
 	log_init(1);
 	log_verbose(1);
 
-	while ((ch = getopt(argc, argv, "df:v")) != -1) {
+	while ((ch = getopt(argc, argv, "df:uv")) != -1) {
 		switch (ch) {
 		case 'd':
 			debug = 1;
@@ -107,6 +224,9 @@ main(int argc, char *argv[])
 		case 'f':
 			conffile = optarg;
 			break;
+		case 'u':
+			upgrade = 1;
+			break;
 		case 'v':
 			verbose = 1;
 			break;
@@ -131,10 +251,25 @@ main(int argc, char *argv[])
     if (!debug)
         daemon(1, 0);
 
-    if ((ctl_fd = control_init()) == -1)
-        fatalx("control socket init failed");
-    if (control_listen(ctl_fd) == -1)
-        fatalx("control socket listen failed");
+    sockpath = (conf->socket != NULL ? conf->socket : GEOLOCD_SOCKET);
+
+    if (upgrade) {
+        /* serving is left to the running daemon until we are ready */
+        if ((upgrade_fd = control_inherit(sockpath, &ctl_fd,
+            &tcp_fd)) == -1)
+            fatalx("sockets takeover failed");
+    } else {
+        if ((ctl_fd = control_init(sockpath)) == -1)
+            fatalx("control socket init failed");
+        if (control_listen(ctl_fd) == -1)
+            fatalx("control socket listen failed");
+        sockowner = 1;
+    }
+    /* an inherited TCP listener is kept as it is */
+    if (conf->listen != NULL && tcp_fd == -1 &&
+        ((tcp_fd = control_tcp_init(conf->listen, conf->port)) == -1 ||
+        control_listen(tcp_fd) == -1))
+        fatalx("tcp socket init failed");
 
     log_info("geolocd starting");
 
@@ -143,7 +278,14 @@ main(int argc, char *argv[])
     signal(SIGTERM, sighandler);
     signal(SIGINT, sighandler);
 
-    init_modules();
+    /* before any data is loaded and any thread started */
+    addr_parse_init();
+    if (conf->numa_node != -1)
+        residency_numa(conf->numa_node);
+    if (conf->cpu != -1)
+        residency_pin(conf->cpu);
+
+    init_modules(conf);
 
     TAILQ_FOREACH(bcurrent, &backends, entry) {
         if (strcasecmp(conf->backend, bcurrent->name) == 0) {
@@ -157,12 +299,28 @@ main(int argc, char *argv[])
         goto shutdown;
     }
 
-    handler = backend->gl_bic(conf->datafile);
+    handler = backend->gl_bic(conf->datafile, conf->cache);
     if (handler == NULL) {
         log_warn("backend handler alloc failure");
         goto shutdown;
     }
 
+    residency_apply(backend, handler, conf);
+    if (conf->lowlatency) {
+        residency_lowlatency();
+        if (tcp_fd != -1)
+            control_busypoll(tcp_fd);
+    }
+
+    /* the build handler, opened while the datafile is reachable */
+    if ((conf->indexes | conf->tables) != 0 &&
+        (bhandler = backend->gl_bic(conf->datafile, conf->cache)) == NULL)
+        log_warnx("no build handler, opened again from the chroot");
+
+    /* the capture file is created with the privileges */
+    if (conf->capture != NULL && capture_start(conf->capture) == 0)
+        log_info("capturing requests to %s", conf->capture);
+
     if ((pw = getpwnam(GEOLOCD_USER)) == NULL) {
         log_warn("unknown user %s", GEOLOCD_USER);
         goto shutdown;
@@ -190,31 +348,156 @@ main(int argc, char *argv[])
 
     log_info("'%s' backend with '%s' data's file", backend->name, backend->datafile);
 
-    bzero(pfd, sizeof(pfd));
+    /* before the build competes for the disk */
+    if (conf->hotset != NULL && hotset_init() == 0) {
+        geoloc_warmup();
+        hotsaved = session_clock();
+    }
+
+    /* served through the backend until the build is published */
+    geoloc_index_build(bhandler);
+    bhandler = NULL;
+
+    session_init(conf);
+    trace_init(conf->slowlog);
+    arena_init(&serve_arena, ARENA_SIZE);
+    if (conf->lowlatency)
+        session_prealloc();
+    geoloc_pops_build();
+
+    /* after the warm-up, counting the served requests only */
+    if (conf->analytics)
+        analytics_init(conf->analytics_window);
+
+    /*
+     * Kept open while serving, the previous daemon taking its sockets
+     * back if we go away before it is done draining
+     */
+    if (upgrade_fd != -1) {
+        if (control_ready(upgrade_fd) == -1) {
+            log_warnx("upgrade not acknowledged, sockets left to the "
+                "previous daemon");
+            upgrade_fd = -1;
+            goto shutdown;
+        }
+        sockowner = 1;
+        log_info("sockets taken over, serving");
+    }
 
     while (die == 0) {
-        pfd[0].fd = control_accept(ctl_fd);
+        npfd = session_pollset(&pfd, &pfdsz, 3);
+        if (pfdsz == 0) {
+            log_warnx("poll set allocation failed");
+            break;
+        }
+        /* draining, the listeners are left to the upgraded process */
+        pfd[0].fd = (draining ? -1 : ctl_fd);
         pfd[0].events = POLLIN;
-    
-        ndfs = poll(pfd, 1, 60);
+        pfd[0].revents = 0;
+        pfd[1].fd = build_fd();
+        pfd[1].events = POLLIN;
+        pfd[1].revents = 0;
+        pfd[2].fd = (draining ? -1 : tcp_fd);
+        pfd[2].events = POLLIN;
+        pfd[2].revents = 0;
 
-        if (ndfs && pfd[0].revents & POLLIN) {
-            if (geoloc_msg_dispatch(pfd[0].fd) == -1)
+        /* busy polling, the loop never sleeps in low latency mode */
+        ndfs = poll(pfd, npfd, (session_pending() || conf->lowlatency) ?
+            0 : CONTROL_POLL_TIMEOUT);
+
+        if (ndfs == -1) {
+            if (errno != EINTR) {
+                log_warn("poll");
                 die = 1;
-            close(pfd[0].fd);
+            }
+            continue;
+        }
+
+        if (ndfs > 0 || session_pending())
+            busy = session_clock();
+        else if (conf->lowlatency)
+            stats.idle_polls++;
+
+        /*
+         * idle, the captured requests reach the file, once idle as
+         * long as a poll timeout when busy polling, not to write
+         * between two requests
+         */
+        if (ndfs == 0 && !session_pending() && (!conf->lowlatency ||
+            session_clock() - busy >= CONTROL_POLL_TIMEOUT * 1000ULL))
+            capture_flush();
+
+        if (pfd[0].revents & (POLLERR|POLLHUP|POLLNVAL)) {
+            log_warnx("control socket error");
+            die = 1;
+        }
+
+        if (pfd[0].revents & POLLIN)
+            session_accept(ctl_fd, 0);
+
+        if (pfd[1].revents & POLLIN)
+            geoloc_index_publish();
+
+        if (pfd[2].revents & POLLIN)
+            session_accept(tcp_fd, 1);
+
+        session_events(pfd + 3, npfd - 3);
+        analytics_tick(session_clock());
+        geoloc_msg_serve();
+        session_admit();
+        session_reap();
+
+        /* the upgraded process went away, its sockets are ours again */
+        if (draining && session_upgrading() == 0) {
+            log_warnx("upgraded process gone, serving again%s",
+                (conf->capture != NULL ? ", capture stopped" : ""));
+            draining = 0;
+            sockowner = 1;
+            session_resume();
         }
 
-        if (ndfs == -1 && pfd[0].revents & (POLLERR|POLLHUP|POLLNVAL)) {
-            log_warn("socket error");
+        if (draining && (session_count() == session_upgrading() ||
+            session_clock() - drainstart >= UPGRADE_DRAIN * 1000000ULL)) {
+            log_info("upgrade done, %u connections left",
+                session_count() - session_upgrading());
             die = 1;
         }
+
+        if (hotset_dirty() && session_clock() - hotsaved >=
+            (uint64_t)conf->hotset_interval * 1000000) {
+            hotset_save(conf->hotset);
+            hotsaved = session_clock();
+        }
     }
 
+    session_closeall();
+    free(pfd);
+
+    if (hotset_dirty())
+        hotset_save(conf->hotset);
+
 shutdown:
+    hotset_free();
+    analytics_free();
+    arena_free(&serve_arena);
+    capture_stop();
+    build_cancel();
+    geoloc_index_free();
+    spatial_free(pops);
+    if (bhandler != NULL)
+        backend->gl_bsc(bhandler);
+    if (staged != NULL)
+        backend->gl_bsc(staged);
     if (backend != NULL)
         backend->gl_bsc(backend->handler);
-    control_shutdown(ctl_fd);
-    control_cleanup();
+    if (ctl_fd != -1)
+        control_shutdown(ctl_fd);
+    if (tcp_fd != -1)
+        control_shutdown(tcp_fd);
+    if (sockowner)
+        control_cleanup(sockpath);
+    if (upgrade_fd != -1)
+        close(upgrade_fd);
 
     dispose_modules();
 
@@ -223,31 +506,630 @@ shutdown:
     return (0);
 }
 
+const char *
+geoloc_field_name(enum lookup_info_type li)
+{
+    static const char *names[GEOLOC_NFIELDS] = {
+        [GEOLOC_COUNTRY]    = "ccode",
+        [GEOLOC_ISP]        = "isp",
+        [GEOLOC_MNC]        = "mnc",
+        [GEOLOC_MCC]        = "mcc",
+        [GEOLOC_CITY]       = "city",
+        [GEOLOC_COORDS]     = "coords"
+    };
+
+    return ((unsigned)li < GEOLOC_NFIELDS ? names[li] : "unknown");
+}
+
+/*
+ * Starts the background build of the configured indexes and tables,
+ * handler being its own backend handler if already opened. Asked
+ * while a build runs, it is done again once this one is published.
+ */
+void
+geoloc_index_build(void *handler)
+{
+    if (build_running()) {
+        if (handler != NULL)
+            backend->gl_bsc(handler);
+        rebuild = 1;
+        return;
+    }
+
+    if (build_start(backend, handler, conf, indexes) == -1)
+        log_warnx("index build not started");
+}
+
+/*
+ * Switches the lookups to the built indexes and tables, a previous
+ * index giving its unchanged parts to the new one
+ */
+void
+geoloc_index_publish(void)
+{
+    struct build_result results[GEOLOC_NFIELDS];
+    struct geoloc_index *idx;
+    struct geoloc_table *t;
+    int                 li;
+
+    if (build_collect(results) == -1)
+        return;
+
+    for (li = 0; li < GEOLOC_NFIELDS; li++) {
+        if ((idx = results[li].idx) == NULL) {
+            if ((conf->indexes | conf->tables) & (1U << li))
+                log_warnx("%s index build failed", geoloc_field_name(li));
+            continue;
+        }
+        index_finish(idx);
+
+        log_info("%s index: %u values, %llu ranges, %u unchanged, "
+            "%llu.%06llu s", geoloc_field_name(li), idx->nvalues,
+            (unsigned long long)idx->nspans, idx->reused,
+            (unsigned long long)(results[li].usec / 1000000),
+            (unsigned long long)(results[li].usec % 1000000));
+
+        if ((t = results[li].table) != NULL) {
+            log_info("%s table: %u ranges, %zu kB%s", geoloc_field_name(li),
+                t->nranges, table_footprint(t) / 1024,
+                (t->compact != NULL ? ", compact" : ""));
+            t = __atomic_exchange_n(&tables[li], t, __ATOMIC_ACQ_REL);
+            table_free(t);
+        }
+
+        if ((conf->indexes & (1U << li)) == 0) {
+            index_free(idx);
+            continue;
+        }
+        idx = __atomic_exchange_n(&indexes[li], idx, __ATOMIC_ACQ_REL);
+        index_free(idx);
+        if (li == GEOLOC_COORDS)
+            geoloc_places_build();
+    }
+
+    if (rebuild) {
+        rebuild = 0;
+        geoloc_index_build(NULL);
+    }
+}
+
+void
+geoloc_index_free(void)
+{
+    int     li;
+
+    for (li = 0; li < GEOLOC_NFIELDS; li++) {
+        index_free(indexes[li]);
+        indexes[li] = NULL;
+        table_free(tables[li]);
+        tables[li] = NULL;
+    }
+    spatial_free(places);
+    places = NULL;
+    places_gen++;
+}
+
+/*
+ * Points of presence of the config, for the nearest queries
+ */
+void
+geoloc_pops_build(void)
+{
+    struct spatial_point    *points;
+    unsigned                i;
+
+    if (conf->npops == 0)
+        return;
+
+    if ((points = calloc(conf->npops, sizeof(*points))) == NULL) {
+        log_warn("geoloc_pops_build");
+        return;
+    }
+
+    for (i = 0; i < conf->npops; i++) {
+        spatial_point_set(&points[i], conf->pops[i].lat, conf->pops[i].lon);
+        points[i].name = conf->pops[i].name;
+    }
+
+    if ((pops = spatial_build(points, conf->npops)) == NULL)
+        free(points);
+}
+
+/*
+ * Locations of the coordinates index values, for the radius
+ * queries, built again with each version of the index
+ */
+void
+geoloc_places_build(void)
+{
+    struct geoloc_index     *idx = indexes[GEOLOC_COORDS];
+    struct spatial_point    *points = NULL;
+    struct spatial_tree     *t = NULL;
+    double                  lat, lon;
+    uint32_t                i, n = 0;
+
+    if (idx != NULL &&
+        (points = calloc(idx->nvalues + 1, sizeof(*points))) == NULL)
+        log_warn("geoloc_places_build");
+
+    if (points != NULL) {
+        for (i = 0; i < idx->nvalues; i++) {
+            if (spatial_parse(idx->values[i].name, &lat, &lon) == -1)
+                continue;
+            spatial_point_set(&points[n], lat, lon);
+            points[n].name = idx->values[i].name;
+            points[n].data = &idx->values[i];
+            n++;
+        }
+        if ((t = spatial_build(points, n)) == NULL)
+            free(points);
+        else
+            log_info("coords index: %u places", n);
+    }
+
+    spatial_free(places);
+    places = t;
+    places_gen++;
+}
+
+/*
+ * Looks up the hottest prefixes of the previous runs before serving,
+ * hottest first and within the time budget, so that the backend data
+ * pages and caches they need are in by the first requests
+ */
+void
+geoloc_warmup(void)
+{
+    struct hotset_entry     *hs;
+    size_t                  n, i;
+    uint64_t                start, end;
+    enum lookup_info_type   li;
+    const char              *info;
+    void                    *ref;
+    char                    key[GEOLOC_ADDR_MAX];
+
+    if (hotset_load(conf->hotset, &hs, &n) == -1 || n == 0)
+        return;
+
+    start = session_clock();
+    end = start + (uint64_t)conf->hotset_budget * 1000;
+
+    for (i = 0; i < n && session_clock() < end; i++) {
+        addr_format(&hs[i].addr, key, sizeof(key));
+        for (li = 0; li < GEOLOC_NFIELDS; li++) {
+            if ((hs[i].fields & (1U << li)) == 0)
+                continue;
+            info = NULL;
+            if (backend->gl_bac != NULL)
+                ref = backend->gl_bac(backend->handler, &hs[i].addr, li, &info);
+            else
+                ref = backend->gl_blic(backend->handler, key, li, &info);
+            if (ref != NULL)
+                backend->gl_blcc(backend->handler, ref);
+            stats.warmup_lookups++;
+        }
+        stats.warmup_prefixes++;
+    }
+
+    stats.warmup_usec = session_clock() - start;
+    log_info("hotset warm-up: %llu of %zu prefixes, %llu lookups in %llu ms",
+        (unsigned long long)stats.warmup_prefixes, n,
+        (unsigned long long)stats.warmup_lookups,
+        (unsigned long long)stats.warmup_usec / 1000);
+
+    free(hs);
+}
+
+/*
+ * Value from the field table once published,
+ * NULL when the address is not covered
+ */
+const char *
+geoloc_table_lookup(const struct geoloc_addr *addr, enum lookup_info_type li)
+{
+    struct geoloc_table *t;
+    const char          *info;
+
+    if ((t = __atomic_load_n(&tables[li], __ATOMIC_ACQUIRE)) == NULL ||
+        (info = table_lookup(t, addr)) == NULL)
+        return (NULL);
+
+    stats.table_lookups++;
+
+    return (info);
+}
+
+/*
+ * Reserved addresses are answered right away, then the field
+ * table if any, anything else goes to the backend, once per
+ * address and field for the requests served together
+ */
+void *
+geoloc_lookup(const char *key, enum lookup_info_type li, const char **info)
+{
+    struct geoloc_addr  addr;
+    enum reserved_class cl;
+    enum flight_state   fs = FLIGHT_NONE;
+    uint64_t            start;
+    void                *ref;
+    int                 parsed;
+
+    if ((parsed = (addr_parse(key, &addr) == 0))) {
+        if ((cl = addr_reserved(&addr)) != RESERVED_NONE) {
+            stats.reserved[cl]++;
+            *info = GEOLOC_RESERVED_INFO;
+            return (NULL);
+        }
+        hotset_hit(&addr, li);
+        analytics_addr(&addr);
+        if ((*info = geoloc_table_lookup(&addr, li)) != NULL)
+            return (NULL);
+        if ((fs = flight_join(&addr, li, info)) == FLIGHT_DONE) {
+            stats.coalesced++;
+            return (NULL);
+        }
+    }
+
+    stats.lookups++;
+    start = session_clock();
+    TRACE_PROBE1(lookup__start, li);
+    ref = geoloc_backend_lookup((parsed ? &addr : NULL), key, li, info);
+    geoloc_trace_lookup(li, start, 1);
+
+    if (fs == FLIGHT_LEAD && flight_land(&addr, li, *info, ref) == 0)
+        return (NULL);
+
+    return (ref);
+}
+
+/*
+ * One backend lookup, of the parsed address when there is one. A
+ * value copied by the backend goes to the serve arena, nothing to
+ * release; the reference to release is returned otherwise.
+ */
+static void *
+geoloc_backend_lookup(const struct geoloc_addr *addr, const char *key,
+                      enum lookup_info_type li, const char **info)
+{
+    char    value[GEOLOC_VALUE_MAX];
+    int     len;
+
+    if (addr != NULL && backend->gl_bvc != NULL &&
+        (len = backend->gl_bvc(backend->handler, addr, li, value,
+        sizeof(value))) >= 0) {
+        *info = (len > 0 ? arena_strndup(&serve_arena, value, len) : NULL);
+        return (NULL);
+    }
+
+    if (addr != NULL && backend->gl_bac != NULL)
+        return (backend->gl_bac(backend->handler, addr, li, info));
+
+    return (backend->gl_blic(backend->handler, key, li, info));
+}
+
+/*
+ * Backend time of the request being served
+ */
+void
+geoloc_trace_lookup(enum lookup_info_type li, uint64_t start, uint32_t n)
+{
+    uint64_t    usec = session_clock() - start;
+
+    TRACE_PROBE3(lookup__done, li, n, usec);
+    trace_lookup(usec, n);
+    stats.lookup_usec += usec;
+}
+
+/*
+ * One field for n addresses: the parsed ones are looked up in the
+ * field table all at once, the remaining ones going through the
+ * backend batch callback when there is one. An address already
+ * looked up in the round, or repeated in the batch, is not
+ * looked up again.
+ */
+void
+geoloc_lookup_batch(const char **keys, size_t n, enum lookup_info_type li,
+                    const char **infos, void **refs)
+{
+    struct geoloc_table *t;
+    struct geoloc_addr  *addrs;
+    enum reserved_class cl;
+    const char          **binfos = NULL;
+    void                **brefs = NULL;
+    size_t              *pos, i, m = 0, k, w = 0;
+    uint64_t            start;
+    int                 *parsed;
+
+    bzero(infos, n * sizeof(*infos));
+    bzero(refs, n * sizeof(*refs));
+
+    /* the upper halves keep the addresses waiting on another of the batch */
+    if ((addrs = arena_alloc(&serve_arena, n * 2 * sizeof(*addrs))) == NULL ||
+        (pos = arena_alloc(&serve_arena, n * 2 * sizeof(*pos))) == NULL ||
+        (binfos = arena_alloc(&serve_arena, n * sizeof(*binfos))) == NULL ||
+        (parsed = arena_alloc(&serve_arena, n * sizeof(*parsed))) == NULL ||
+        (backend->gl_bbc != NULL &&
+        (brefs = arena_calloc(&serve_arena, n, sizeof(*brefs))) == NULL)) {
+        log_warn("geoloc_lookup_batch");
+        for (i = 0; i < n; i++)
+            refs[i] = geoloc_lookup(keys[i], li, &infos[i]);
+        return;
+    }
+
+    /* parsed at once in the upper half, then kept in the lower one */
+    addr_parse_batch(keys, n, addrs + n, parsed);
+
+    for (i = 0; i < n; i++) {
+        if (parsed[i] == -1) {
+            refs[i] = geoloc_lookup(keys[i], li, &infos[i]);
+            continue;
+        }
+        addrs[m] = addrs[n + i];
+        if ((cl = addr_reserved(&addrs[m])) != RESERVED_NONE) {
+            stats.reserved[cl]++;
+            infos[i] = GEOLOC_RESERVED_INFO;
+            continue;
+        }
+        hotset_hit(&addrs[m], li);
+        analytics_addr(&addrs[m]);
+        pos[m++] = i;
+    }
+
+    if (m > 0 && (t = __atomic_load_n(&tables[li], __ATOMIC_ACQUIRE)) != NULL) {
+        table_lookup_batch(t, addrs, m, binfos);
+        for (i = 0, k = 0; i < m; i++) {
+            if (binfos[i] != NULL) {
+                infos[pos[i]] = binfos[i];
+                stats.table_lookups++;
+                continue;
+            }
+            addrs[k] = addrs[i];
+            pos[k++] = pos[i];
+        }
+        m = k;
+    }
+
+    for (i = 0, k = 0; i < m; i++) {
+        switch (flight_join(&addrs[i], li, &infos[pos[i]])) {
+        case FLIGHT_DONE:
+            stats.coalesced++;
+            break;
+        case FLIGHT_PENDING:
+            stats.coalesced++;
+            addrs[n + w] = addrs[i];
+            pos[n + w++] = pos[i];
+            break;
+        default:
+            addrs[k] = addrs[i];
+            pos[k++] = pos[i];
+            break;
+        }
+    }
+    m = k;
+
+    if (m == 0)
+        return;
+
+    stats.lookups += m;
+    start = session_clock();
+    TRACE_PROBE1(lookup__start, li);
+
+    if (backend->gl_bbc != NULL &&
+        backend->gl_bbc(backend->handler, addrs, m, li, binfos, brefs) == 0) {
+        for (i = 0; i < m; i++) {
+            infos[pos[i]] = binfos[i];
+            refs[pos[i]] = brefs[i];
+        }
+    } else {
+        for (i = 0; i < m; i++)
+            refs[pos[i]] = geoloc_backend_lookup(&addrs[i], keys[pos[i]], li,
+                &infos[pos[i]]);
+    }
+    geoloc_trace_lookup(li, start, m);
+
+    for (i = 0; i < m; i++)
+        if (flight_land(&addrs[i], li, infos[pos[i]], refs[pos[i]]) == 0)
+            refs[pos[i]] = NULL;
+    for (i = 0; i < w; i++)
+        flight_join(&addrs[n + i], li, &infos[pos[n + i]]);
+}
+
+/*
+ * Location of an address, from its coordinates field
+ */
 int
-geoloc_msg_dispatch(int fd)
+geoloc_coords(const char *key, double *lat, double *lon)
 {
-    struct msg_ctl_req  req;
-    int                 n = -1;
-    char property_key[125];
-    property_key[0] = '\0';
-    bzero(&req, sizeof(struct msg_ctl_req));
+    const char  *info = NULL;
+    void        *ptr;
+    int         ret;
 
-    if ((n = recv(fd, &req, sizeof(req), 0)) == -1) {
-        log_warn("geoloc_msg_dispatch socket error");
-        return (-1);
+    ptr = geoloc_lookup(key, GEOLOC_COORDS, &info);
+    ret = (info != NULL ? spatial_parse(info, lat, lon) : -1);
+
+    if (ptr != NULL)
+        backend->gl_blcc(backend->handler, ptr);
+
+    return (ret);
+}
+
+/*
+ * Several fields for one address, at once through the
+ * backend fields callback when there is one
+ */
+void
+geoloc_lookup_fields(const char *key, const enum lookup_info_type *lis,
+                     size_t n, const char **infos, void **refs)
+{
+    struct geoloc_addr  addr;
+    size_t              i;
+    uint64_t            start;
+    int                 ret;
+
+    bzero(infos, n * sizeof(*infos));
+    bzero(refs, n * sizeof(*refs));
+
+    for (i = 0; i < n; i++)
+        if (tables[lis[i]] != NULL)
+            break;
+
+    if (i == n && backend->gl_bfc != NULL && addr_parse(key, &addr) == 0 &&
+        addr_reserved(&addr) == RESERVED_NONE) {
+        analytics_addr(&addr);
+        start = session_clock();
+        TRACE_PROBE1(lookup__start, lis[0]);
+        ret = backend->gl_bfc(backend->handler, &addr, lis, n, infos, refs);
+        geoloc_trace_lookup(lis[0], start, n);
+        if (ret == 0) {
+            stats.lookups += n;
+            return;
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        refs[i] = geoloc_lookup(key, lis[i], &infos[i]);
+}
+
+/*
+ * Serves the queued requests, the ones past their
+ * deadline are answered as overloaded instead
+ */
+void
+geoloc_msg_serve(void)
+{
+    struct session_request  *r;
+    struct session          *s;
+    int                     n;
+
+    flight_begin(backend);
+
+    /* the enumerations in progress walk on, a share each round */
+    for (s = NULL; (s = session_streaming(s)) != NULL; )
+        if (geoloc_stream_resume(s) == -1)
+            s->dead = 1;
+
+    for (n = 0; n < SERVE_MAX && (r = session_next()) != NULL; n++) {
+        if (r->s->dead) {
+            session_request_free(r);
+            continue;
+        }
+
+        if (session_clock() > r->deadline) {
+            stats.expired++;
+            session_reject(r->s->fd, &r->req);
+        } else {
+            stats.served[r->class]++;
+            geoloc_trace_begin(r);
+            if (geoloc_msg_dispatch(r) == -1)
+                r->s->dead = 1;
+            TRACE_PROBE2(request__done, r->req.type, r->s->fd);
+            trace_end(session_clock());
+        }
+
+        session_request_free(r);
+    }
+
+    flight_end();
+    stats.allocs += arena_reset(&serve_arena);
+}
+
+/*
+ * Stages of the request for the slow requests log
+ */
+void
+geoloc_trace_begin(const struct session_request *r)
+{
+    struct trace_request    t;
+    struct msg_ctl_batch    batch;
+
+    bzero(&t, sizeof(t));
+    t.received = r->received;
+    t.type = r->req.type;
+    t.field = r->req.field;
+    t.class = r->class;
+    t.remote = r->s->remote;
+    t.age = r->received - r->s->accepted;
+
+    if (r->req.type == MSG_CTL_PROPERTY_BATCH) {
+        memcpy(&batch, r->payload, sizeof(batch));
+        snprintf(t.key, sizeof(t.key), "batch of %u", batch.count);
+    } else if (r->len > 0) {
+        strlcpy(t.key, r->payload, sizeof(t.key));
+    }
+
+    TRACE_PROBE3(request__start, r->req.type, r->req.field, r->s->fd);
+    trace_begin(&t, session_clock());
+}
+
+/*
+ * The payload, when any, has been checked by the session framing:
+ * string ones are NUL terminated, batch ones are complete
+ */
+int
+geoloc_msg_dispatch(struct session_request *r)
+{
+    int     fd = r->s->fd;
+
+    stats.requests++;
+
+    /* daemon control is kept to the local socket */
+    if (r->s->remote) {
+        switch (r->req.type) {
+        case MSG_CTL_RELOAD:
+        case MSG_CTL_BUILD:
+        case MSG_CTL_DELTA:
+        case MSG_CTL_SLOWLOG:
+        case MSG_CTL_SHUTDOWN:
+        case MSG_CTL_UPGRADE:
+        case MSG_CTL_READY:
+            log_warnx("control request %d refused to a remote client",
+                r->req.type);
+            return (-1);
+        default:
+            break;
+        }
     }
 
-    switch (req.type) {
+    switch (r->req.type) {
     case MSG_CTL_BACKEND_INFO:
-        return (geoloc_msg_backend(fd, req));
+        return (geoloc_msg_backend(fd, r->req));
     case MSG_CTL_PROPERTY:
-        recv(fd, property_key, sizeof(property_key), 0); 
-        return (geoloc_msg_property(fd, req, property_key));
+        return (geoloc_msg_property(fd, r->req, r->payload));
+    case MSG_CTL_PROPERTY_BATCH:
+        return (geoloc_msg_property_batch(fd, r->req, r->payload, r->len));
+    case MSG_CTL_PROPERTY_ALL:
+        return (geoloc_msg_property_all(fd, r->payload));
+    case MSG_CTL_ENUMERATE:
+        return (geoloc_msg_enumerate(r->s, r->req, r->payload));
+    case MSG_CTL_REVERSE:
+        return (geoloc_msg_reverse(r->s, r->req, r->payload));
+    case MSG_CTL_RELOAD:
+        return (geoloc_msg_reload(fd, r->req.field));
+    case MSG_CTL_STATS:
+        return (geoloc_msg_stats(fd));
+    case MSG_CTL_BUILD:
+        return (geoloc_msg_build(fd));
+    case MSG_CTL_DELTA:
+        return (geoloc_msg_delta(fd, r->req, r->payload));
+    case MSG_CTL_NEAREST:
+        return (geoloc_msg_nearest(fd, r->payload));
+    case MSG_CTL_RADIUS:
+        return (geoloc_msg_radius(r->s, r->payload));
+    case MSG_CTL_SLOWLOG:
+        return (geoloc_msg_slowlog(fd));
+    case MSG_CTL_MEMORY:
+        return (geoloc_msg_memory(fd));
+    case MSG_CTL_ANALYTICS:
+        return (geoloc_msg_analytics(fd));
+    case MSG_CTL_UPGRADE:
+        return (geoloc_msg_upgrade(r->s));
+    case MSG_CTL_READY:
+        return (geoloc_msg_ready(r->s));
     case MSG_CTL_SHUTDOWN:
         die = 1;
         return (0);
     default:
-        return (0);
+        return (-1);
     }
 
     return (0);
@@ -273,45 +1155,925 @@ geoloc_msg_backend(int fd, struct msg_ctl_req req)
         break;
     }
 
-    send(fd, info, strlen(info) + 1, 0);
+    reply_string(fd, info);
 
     return (0);
 }
 
 int
-geoloc_msg_property(int fd, struct msg_ctl_req req, const char *property_key)
+geoloc_msg_field(enum msg_field field, enum lookup_info_type *li)
 {
-    const char              *info = NULL;
-    void                    *ptr = NULL;
-    enum lookup_info_type   li;
-
-    switch (req.field) {
+    switch (field) {
     case MSG_PROPERTY_CCODE:
-        li = GEOLOC_COUNTRY;
+        *li = GEOLOC_COUNTRY;
         break;
     case MSG_PROPERTY_ISP:
-        li = GEOLOC_ISP;
+        *li = GEOLOC_ISP;
         break;
     case MSG_PROPERTY_MNC:
-        li = GEOLOC_MNC;
+        *li = GEOLOC_MNC;
         break;
     case MSG_PROPERTY_MCC:
-        li = GEOLOC_MCC;
+        *li = GEOLOC_MCC;
+        break;
+    case MSG_PROPERTY_CITY:
+        *li = GEOLOC_CITY;
+        break;
+    case MSG_PROPERTY_COORDS:
+        *li = GEOLOC_COORDS;
         break;
     default:
-        info = "invalid request";
-        send(fd, info, strlen(info) + 1, 0);
         return (-1);
     }
 
-    ptr = backend->gl_blic(backend->handler, property_key, li, &info);
-    
-    if (info == NULL)
-        info = "";
-    send(fd, info, strlen(info) + 1, 0);
+    return (0);
+}
 
-    if (ptr != NULL)
-        backend->gl_blcc(backend->handler, ptr);
+int
+geoloc_msg_property(int fd, struct msg_ctl_req req, const char *property_key)
+{
+    const char              *info = NULL;
+    void                    *ptr = NULL;
+    enum lookup_info_type   li;
+
+    if (geoloc_msg_field(req.field, &li) == -1) {
+        info = "invalid request";
+        reply_string(fd, info);
+        return (-1);
+    }
+
+    ptr = geoloc_lookup(property_key, li, &info);
+    analytics_value(li, info);
+
+    if (info == NULL)
+        info = "";
+    reply_string(fd, info);
+
+    if (ptr != NULL)
+        backend->gl_blcc(backend->handler, ptr);
+
+    return (0);
+}
+
+/*
+ * One field for a batch of addresses, the results are sent
+ * at once in a single vectored reply
+ */
+int
+geoloc_msg_property_batch(int fd, struct msg_ctl_req req, const char *payload,
+                          size_t len)
+{
+    struct msg_ctl_batch    batch;
+    struct reply            reply;
+    enum lookup_info_type   li;
+    const char              *key, *end;
+    const char              *keys[GEOLOC_BATCH_MAX], *infos[GEOLOC_BATCH_MAX];
+    void                    *refs[GEOLOC_BATCH_MAX];
+    uint32_t                i, n;
+
+    memcpy(&batch, payload, sizeof(batch));
+    key = payload + sizeof(batch);
+    end = payload + len;
+
+    /* the last key has to be terminated within the payload */
+    if (end[-1] != '\0' || geoloc_msg_field(req.field, &li) == -1) {
+        reply_status(fd, MSG_STATUS_INVALID);
+        return (0);
+    }
+
+    if (reply_init(&reply, &serve_arena, backend, batch.count) == -1) {
+        reply_status(fd, MSG_STATUS_INVALID);
+        return (0);
+    }
+
+    for (n = 0; n < batch.count && key < end; n++) {
+        keys[n] = key;
+        key += strlen(key) + 1;
+    }
+
+    geoloc_lookup_batch(keys, n, li, infos, refs);
+    for (i = 0; i < n; i++) {
+        analytics_value(li, infos[i]);
+        reply_add(&reply, infos[i], refs[i]);
+    }
+
+    if (n < batch.count)
+        reply.hdr.status = MSG_STATUS_INVALID;
+
+    reply_flush(&reply, fd);
+    reply_free(&reply);
+
+    return (0);
+}
+
+/*
+ * All the lookup properties for one address,
+ * in the msg_field order
+ */
+int
+geoloc_msg_property_all(int fd, const char *property_key)
+{
+    static const enum lookup_info_type lis[] = {
+        GEOLOC_COUNTRY,
+        GEOLOC_ISP,
+        GEOLOC_MNC,
+        GEOLOC_MCC,
+        GEOLOC_CITY,
+        GEOLOC_COORDS
+    };
+    struct reply    reply;
+    const char      *infos[nitems(lis)];
+    void            *refs[nitems(lis)];
+    size_t          i;
+
+    if (reply_init(&reply, &serve_arena, backend, nitems(lis)) == -1) {
+        reply_status(fd, MSG_STATUS_INVALID);
+        return (0);
+    }
+
+    geoloc_lookup_fields(property_key, lis, nitems(lis), infos, refs);
+    for (i = 0; i < nitems(lis); i++) {
+        analytics_value(lis[i], infos[i]);
+        reply_add(&reply, infos[i], refs[i]);
+    }
+
+    reply_flush(&reply, fd);
+    reply_free(&reply);
+
+    return (0);
+}
+
+int
+geoloc_msg_stats(int fd)
+{
+    char                info[1024];
+    size_t              len;
+    int                 i;
+
+    len = snprintf(info, sizeof(info),
+        "requests %llu\nlookups %llu\ntable lookups %llu\nenumerations %llu\n"
+        "reverses %llu\nreloads %llu\ndeltas %llu\nspatial %llu\n",
+        (unsigned long long)stats.requests,
+        (unsigned long long)stats.lookups,
+        (unsigned long long)stats.table_lookups,
+        (unsigned long long)stats.enumerations,
+        (unsigned long long)stats.reverses,
+        (unsigned long long)stats.reloads,
+        (unsigned long long)stats.deltas,
+        (unsigned long long)stats.spatial);
+
+    for (i = RESERVED_NONE + 1; i < RESERVED_MAX && len < sizeof(info); i++)
+        len += snprintf(info + len, sizeof(info) - len, "reserved %s %llu\n",
+            addr_reserved_name(i), (unsigned long long)stats.reserved[i]);
+
+    if (len < sizeof(info))
+        len += snprintf(info + len, sizeof(info) - len,
+            "admitted %llu\noverloaded %llu\nexpired %llu\nrefused %llu\n"
+            "served interactive %llu\nserved bulk %llu\ncoalesced %llu\n"
+            "allocations %llu\nlookup usec %llu\n"
+            "warmup prefixes %llu\nwarmup lookups %llu\nwarmup usec %llu\n",
+            (unsigned long long)stats.admitted,
+            (unsigned long long)stats.overloaded,
+            (unsigned long long)stats.expired,
+            (unsigned long long)stats.refused,
+            (unsigned long long)stats.served[CLASS_INTERACTIVE],
+            (unsigned long long)stats.served[CLASS_BULK],
+            (unsigned long long)stats.coalesced,
+            (unsigned long long)stats.allocs,
+            (unsigned long long)stats.lookup_usec,
+            (unsigned long long)stats.warmup_prefixes,
+            (unsigned long long)stats.warmup_lookups,
+            (unsigned long long)stats.warmup_usec);
+
+    /* geolocctl sums the instances bound to a node up by it */
+    if (conf->numa_node != -1 && len < sizeof(info))
+        len += snprintf(info + len, sizeof(info) - len, "numa node %d\n",
+            conf->numa_node);
+
+    if (conf->cpu != -1 && len < sizeof(info))
+        len += snprintf(info + len, sizeof(info) - len, "cpu %d\n",
+            conf->cpu);
+
+    if (conf->lowlatency && len < sizeof(info))
+        len += snprintf(info + len, sizeof(info) - len, "idle polls %llu\n",
+            (unsigned long long)stats.idle_polls);
+
+    reply_string(fd, info);
+
+    return (0);
+}
+
+/*
+ * Streams the merged ranges of a prefix as CIDR blocks, in frames
+ * of (prefix, value) string pairs, ended by an empty frame. The walk
+ * goes on over the next rounds, other requests being served between.
+ */
+int
+geoloc_msg_enumerate(struct session *s, struct msg_ctl_req req,
+                     const char *prefix)
+{
+    struct enumerate_job    *job;
+    struct geoloc_addr      first, last;
+    enum lookup_info_type   li;
+    int                     plen;
+
+    if (geoloc_msg_field(req.field, &li) == -1 ||
+        addr_parse_prefix(prefix, &first, &plen) == -1) {
+        reply_status(s->fd, MSG_STATUS_INVALID);
+        return (0);
+    }
+    addr_prefix_last(&first, plen, &last);
+
+    if ((job = malloc(sizeof(*job))) == NULL) {
+        log_warn("geoloc_msg_enumerate");
+        reply_status(s->fd, MSG_STATUS_INVALID);
+        return (0);
+    }
+    stats.allocs++;
+
+    if (walk_init(&job->wc, backend, &first, &last, li) == -1) {
+        free(job);
+        reply_status(s->fd, MSG_STATUS_INVALID);
+        return (0);
+    }
+    job->type = MSG_CTL_ENUMERATE;
+    job->es.fd = s->fd;
+    job->es.len = 0;
+    job->es.count = 0;
+
+    stats.enumerations++;
+    session_stream_set(s, job);
+
+    return (geoloc_stream_resume(s));
+}
+
+/*
+ * Goes on with the stream for a round, ending it with its last
+ * frame and the status once done
+ */
+int
+geoloc_stream_resume(struct session *s)
+{
+    struct enumerate_job    *job = s->stream;
+    enum msg_status         status = MSG_STATUS_OK;
+    int                     ret;
+
+    if (job->type == MSG_CTL_REVERSE)
+        ret = geoloc_reverse_step(job);
+    else if (job->type == MSG_CTL_RADIUS)
+        ret = geoloc_radius_step(job);
+    else
+        ret = walk_step(backend, &job->wc, ENUMERATE_STEPS,
+            geoloc_enumerate_cb, &job->es);
+    if (ret == 1)
+        return (0);
+
+    if (ret == -1)
+        status = MSG_STATUS_INVALID;
+    else if (job->es.count > 0)
+        reply_chunk(s->fd, job->es.buf, job->es.len, job->es.count);
+
+    reply_status(s->fd, status);
+    session_stream_end(s);
+
+    return (0);
+}
+
+/*
+ * Streams every range of a value from the field index,
+ * in the same frames as the enumeration, over as many
+ * rounds as it takes
+ */
+int
+geoloc_msg_reverse(struct session *s, struct msg_ctl_req req,
+                   const char *value)
+{
+    struct enumerate_job    *job;
+    enum lookup_info_type   li;
+
+    if (geoloc_msg_field(req.field, &li) == -1 || indexes[li] == NULL) {
+        reply_status(s->fd, MSG_STATUS_INVALID);
+        return (0);
+    }
+
+    stats.reverses++;
+
+    if (index_value_find(indexes[li], value) == NULL) {
+        reply_status(s->fd, MSG_STATUS_OK);
+        return (0);
+    }
+
+    if ((job = malloc(sizeof(*job))) == NULL) {
+        log_warn("geoloc_msg_reverse");
+        reply_status(s->fd, MSG_STATUS_INVALID);
+        return (0);
+    }
+    stats.allocs++;
+
+    job->type = MSG_CTL_REVERSE;
+    job->li = li;
+    bzero(&job->next, sizeof(job->next));
+    strlcpy(job->value, value, sizeof(job->value));
+    job->es.fd = s->fd;
+    job->es.len = 0;
+    job->es.count = 0;
+
+    session_stream_set(s, job);
+
+    return (geoloc_stream_resume(s));
+}
+
+/*
+ * Up to REVERSE_SPANS ranges of the value from the next address on,
+ * 1 telling there are more, the value being looked up again as the
+ * index may have been published since the previous round
+ */
+static int
+geoloc_reverse_step(struct enumerate_job *job)
+{
+    struct index_value      *v;
+    struct geoloc_addr      first;
+    uint32_t                lo, hi, mid, n;
+
+    if (indexes[job->li] == NULL ||
+        (v = index_value_find(indexes[job->li], job->value)) == NULL)
+        return (0);
+
+    /* the first range not over yet, ranges being sorted */
+    for (lo = 0, hi = v->nspans; lo < hi; ) {
+        mid = lo + (hi - lo) / 2;
+        if (addr_cmp(&v->spans[mid].last, &job->next) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    for (n = 0; lo < v->nspans && n < REVERSE_SPANS; lo++, n++) {
+        first = v->spans[lo].first;
+        if (addr_cmp(&first, &job->next) < 0)
+            first = job->next;
+        if (geoloc_enumerate_cb(&job->es, &first, &v->spans[lo].last,
+            v->name) == -1)
+            return (-1);
+        job->next = v->spans[lo].last;
+        if (lo + 1 < v->nspans)
+            addr_incr(&job->next);
+    }
+
+    return (lo < v->nspans ? 1 : 0);
+}
+
+/*
+ * Points of presence nearest to the location of the address,
+ * "address [k]", as "name km" strings closest first
+ */
+int
+geoloc_msg_nearest(int fd, const char *payload)
+{
+    const struct spatial_point  *points[SPATIAL_K_MAX];
+    struct reply                reply;
+    double                      km[SPATIAL_K_MAX], lat, lon;
+    char                        key[GEOLOC_VALUE_MAX], *arg, *end;
+    char                        lines[SPATIAL_K_MAX][GEOLOC_VALUE_MAX];
+    unsigned long               k = 1;
+    size_t                      i, n;
+
+    strlcpy(key, payload, sizeof(key));
+    if ((arg = strchr(key, ' ')) != NULL) {
+        *arg++ = '\0';
+        k = strtoul(arg, &end, 10);
+        if (*arg == '\0' || *end != '\0' || k == 0 || k > SPATIAL_K_MAX)
+            k = 0;
+    }
+
+    if (pops == NULL || k == 0 || geoloc_coords(key, &lat, &lon) == -1) {
+        reply_status(fd, MSG_STATUS_INVALID);
+        return (0);
+    }
+
+    stats.spatial++;
+    n = spatial_nearest(pops, lat, lon, k, points, km);
+
+    if (reply_init(&reply, &serve_arena, backend, n) == -1) {
+        reply_status(fd, MSG_STATUS_INVALID);
+        return (0);
+    }
+
+    for (i = 0; i < n; i++) {
+        snprintf(lines[i], sizeof(lines[i]), "%s %.1f", points[i]->name,
+            km[i]);
+        reply_add(&reply, lines[i], NULL);
+    }
+
+    reply_flush(&reply, fd);
+    reply_free(&reply);
 
     return (0);
 }
+
+/*
+ * Every range located within the radius in km around the address,
+ * "address km", from the coordinates index, in enumeration frames
+ * of ranges and their coordinates with the distance, over as many
+ * rounds as it takes
+ */
+int
+geoloc_msg_radius(struct session *s, const char *payload)
+{
+    struct enumerate_job    *job;
+    double                  km = -1, lat, lon;
+    char                    key[GEOLOC_VALUE_MAX], *arg, *end;
+
+    strlcpy(key, payload, sizeof(key));
+    if ((arg = strchr(key, ' ')) != NULL) {
+        *arg++ = '\0';
+        km = strtod(arg, &end);
+        if (end == arg || *end != '\0')
+            km = -1;
+    }
+
+    if (places == NULL || !(km > 0) ||
+        geoloc_coords(key, &lat, &lon) == -1) {
+        reply_status(s->fd, MSG_STATUS_INVALID);
+        return (0);
+    }
+
+    if ((job = malloc(sizeof(*job))) == NULL) {
+        log_warn("geoloc_msg_radius");
+        reply_status(s->fd, MSG_STATUS_INVALID);
+        return (0);
+    }
+    stats.allocs++;
+    stats.spatial++;
+
+    job->type = MSG_CTL_RADIUS;
+    spatial_radius_init(&job->sc, places, lat, lon, km);
+    job->place = NULL;
+    job->gen = places_gen;
+    job->es.fd = s->fd;
+    job->es.len = 0;
+    job->es.count = 0;
+
+    session_stream_set(s, job);
+
+    return (geoloc_stream_resume(s));
+}
+
+/*
+ * Up to RADIUS_SPANS ranges of the places within the radius, looking
+ * at up to ENUMERATE_STEPS points, 1 telling there are more. The
+ * places going away with a new version of the coordinates index, the
+ * search fails if one was published since it started.
+ */
+static int
+geoloc_radius_step(struct enumerate_job *job)
+{
+    const struct index_value    *v;
+    size_t                      visits = job->sc.visits;
+    uint32_t                    n = 0;
+    int                         ret = 1;
+
+    if (job->gen != places_gen)
+        return (-1);
+
+    for (;;) {
+        if (job->place != NULL) {
+            v = job->place->data;
+            for (; job->span < v->nspans && n < RADIUS_SPANS;
+                job->span++, n++)
+                if (geoloc_enumerate_cb(&job->es,
+                    &v->spans[job->span].first, &v->spans[job->span].last,
+                    job->value) == -1)
+                    return (-1);
+            if (job->span < v->nspans)
+                return (1);
+            job->place = NULL;
+        }
+
+        if (ret == 0)
+            return (0);
+        if (n == RADIUS_SPANS ||
+            job->sc.visits - visits >= ENUMERATE_STEPS)
+            return (1);
+
+        ret = spatial_radius_step(places, &job->sc,
+            ENUMERATE_STEPS - (job->sc.visits - visits),
+            geoloc_radius_cb, job);
+        if (ret == -1)
+            return (-1);
+    }
+}
+
+/*
+ * Stages of the last requests over the slow threshold
+ */
+int
+geoloc_msg_slowlog(int fd)
+{
+    char    *info;
+    size_t  len = 256 * (TRACE_SLOWLOG_MAX + 1);
+
+    if ((info = arena_alloc(&serve_arena, len)) == NULL) {
+        reply_string(fd, "");
+        return (0);
+    }
+
+    trace_slowlog(info, len);
+    reply_string(fd, info);
+
+    return (0);
+}
+
+/*
+ * Reopens the datafile, the running handler is kept on failure.
+ * The datafile has to be reachable from the chroot. A coordinated
+ * reload prepares the new handler on every instance first, swapping
+ * it in only once all of them have it.
+ */
+int
+geoloc_msg_reload(int fd, enum msg_field phase)
+{
+    const char  *info = "reloaded";
+    void        *handler;
+
+    switch (phase) {
+    case MSG_RELOAD_PREPARE:
+        /* loaded aside, the instance serving its current data meanwhile */
+        if (staged != NULL)
+            backend->gl_bsc(staged);
+        if ((staged = backend->gl_bic(backend->datafile,
+            conf->cache)) == NULL) {
+            log_warnx("reload prepare of %s failed", backend->datafile);
+            info = "prepare failed";
+        } else {
+            info = "prepared";
+        }
+        break;
+    case MSG_RELOAD_COMMIT:
+        if (staged == NULL) {
+            log_warnx("reload commit without a prepared one");
+            info = "reload failed";
+            break;
+        }
+        handler = staged;
+        staged = NULL;
+        geoloc_reload_swap(handler);
+        break;
+    case MSG_RELOAD_ABORT:
+        if (staged != NULL) {
+            backend->gl_bsc(staged);
+            staged = NULL;
+        }
+        info = "aborted";
+        break;
+    default:
+        if ((handler = backend->gl_bic(backend->datafile,
+            conf->cache)) == NULL) {
+            log_warnx("reload of %s failed", backend->datafile);
+            info = "reload failed";
+        } else {
+            geoloc_reload_swap(handler);
+        }
+        break;
+    }
+
+    reply_string(fd, info);
+
+    return (0);
+}
+
+/*
+ * Serves with the freshly loaded backend handler from now on
+ */
+void
+geoloc_reload_swap(void *handler)
+{
+    void    *old;
+
+    /* the lookups of the round go with the old handler */
+    flight_end();
+    old = backend->handler;
+    backend->handler = handler;
+    backend->gl_bsc(old);
+    flight_begin(backend);
+    stats.reloads++;
+    log_info("'%s' data's file reloaded", backend->datafile);
+    geoloc_index_build(NULL);
+}
+
+/*
+ * Unique addresses and counts per country and per ISP, of the
+ * property requests served
+ */
+int
+geoloc_msg_analytics(int fd)
+{
+    char    *info;
+
+    if ((info = arena_alloc(&serve_arena, ANALYTICS_REPORT_MAX)) == NULL) {
+        reply_string(fd, "no analytics");
+        return (0);
+    }
+
+    analytics_report(info, ANALYTICS_REPORT_MAX);
+    reply_string(fd, info);
+
+    return (0);
+}
+
+/*
+ * A new geolocd process takes the listening sockets over, both
+ * accepting on them while it loads its backend, this one alone
+ * polling them until it is ready
+ */
+int
+geoloc_msg_upgrade(struct session *s)
+{
+    /* the sockets go along with the reply header, nothing before */
+    if (draining || s->olen > 0) {
+        reply_status(s->fd, MSG_STATUS_INVALID);
+        return (0);
+    }
+
+    if (control_handoff(s->fd, ctl_fd, tcp_fd) == -1)
+        return (-1);
+
+    s->upgrade = 1;
+    log_info("listening sockets handed over for an upgrade");
+
+    return (0);
+}
+
+/*
+ * The upgraded process serves from now on, this one stops
+ * accepting and finishes with its connections. The listeners
+ * are kept, serving again should the upgraded process go away
+ * while draining.
+ */
+int
+geoloc_msg_ready(struct session *s)
+{
+    if (!s->upgrade || draining)
+        return (-1);
+
+    log_info("upgraded process ready, draining %u connections",
+        session_count() - 1);
+
+    /* the socket path now belongs to the upgraded process */
+    sockowner = 0;
+    capture_stop();
+    session_quiesce();
+    draining = 1;
+    drainstart = session_clock();
+
+    reply_string(s->fd, GEOLOC_DRAINING_INFO);
+
+    return (0);
+}
+
+/*
+ * Progress and times of the background build,
+ * then the published tables
+ */
+int
+geoloc_msg_build(int fd)
+{
+    char    info[1024];
+    size_t  len;
+    int     li;
+
+    len = build_status(info, sizeof(info));
+
+    for (li = 0; li < GEOLOC_NFIELDS && len < sizeof(info); li++)
+        len += geoloc_msg_table(info + len, sizeof(info) - len, li);
+
+    reply_string(fd, info);
+
+    return (0);
+}
+
+/*
+ * Memory of the backend data, of the indexes and of the tables,
+ * the compact ones by part, and the peak resident size
+ */
+int
+geoloc_msg_memory(int fd)
+{
+    struct rusage   ru;
+    char            info[2048];
+    size_t          len = 0, datasz;
+    void            *data;
+    int             li;
+
+    if (backend->gl_bmc != NULL &&
+        backend->gl_bmc(backend->handler, &data, &datasz) == 0)
+        len += snprintf(info + len, sizeof(info) - len,
+            "backend data %zu kB\n", datasz / 1024);
+
+    for (li = 0; li < GEOLOC_NFIELDS && len < sizeof(info); li++) {
+        if (indexes[li] != NULL)
+            len += snprintf(info + len, sizeof(info) - len,
+                "%s index %u values %llu ranges %zu kB\n",
+                geoloc_field_name(li), indexes[li]->nvalues,
+                (unsigned long long)indexes[li]->nspans,
+                index_footprint(indexes[li]) / 1024);
+        if (len < sizeof(info))
+            len += geoloc_msg_table(info + len, sizeof(info) - len, li);
+    }
+
+    if (len < sizeof(info))
+        len += snprintf(info + len, sizeof(info) - len,
+            "serve arena %zu kB, peak %zu kB\n", serve_arena.size / 1024,
+            serve_arena.peak / 1024);
+    if (len < sizeof(info) && conf->numa_node != -1)
+        len += geoloc_msg_numa(info + len, sizeof(info) - len);
+    if (len < sizeof(info) && analytics_memory() > 0)
+        len += snprintf(info + len, sizeof(info) - len,
+            "analytics %zu kB\n", analytics_memory() / 1024);
+    if (len < sizeof(info) && getrusage(RUSAGE_SELF, &ru) == 0)
+        len += snprintf(info + len, sizeof(info) - len,
+            "resident peak %ld kB\n", ru.ru_maxrss);
+    if (len == 0)
+        strlcpy(info, "no memory information\n", sizeof(info));
+
+    reply_string(fd, info);
+
+    return (0);
+}
+
+/*
+ * Size line of the published field table, if any
+ */
+static size_t
+geoloc_msg_table(char *buf, size_t len, enum lookup_info_type li)
+{
+    struct geoloc_table     *t = tables[li];
+    struct compact_usage    u;
+    int                     n;
+
+    if (t == NULL)
+        return (0);
+
+    if (t->compact == NULL)
+        n = snprintf(buf, len, "%s table %u ranges %zu kB\n",
+            geoloc_field_name(li), t->nranges, table_footprint(t) / 1024);
+    else {
+        compact_usage(t->compact, &u);
+        n = snprintf(buf, len, "%s table compact %u runs %u values %zu kB "
+            "(keys %zu kB, value ids %zu kB, dictionary %zu kB)\n",
+            geoloc_field_name(li), u.nruns, u.nvalues,
+            table_footprint(t) / 1024, u.keys / 1024, u.ids / 1024,
+            u.dict / 1024);
+    }
+
+    return (n < 0 ? 0 : (size_t)n < len ? (size_t)n : len);
+}
+
+/*
+ * Nodes the backend data, the first table and the serve arena
+ * reside on, where the kernel tells
+ */
+static size_t
+geoloc_msg_numa(char *buf, size_t len)
+{
+    struct geoloc_table *t = NULL;
+    void                *addr = NULL;
+    size_t              dlen = 0;
+    int                 li, n;
+
+    if (backend->gl_bmc == NULL ||
+        backend->gl_bmc(backend->handler, &addr, &dlen) == -1)
+        addr = NULL;
+    for (li = 0; li < GEOLOC_NFIELDS && t == NULL; li++)
+        t = tables[li];
+
+    n = snprintf(buf, len, "numa node %d, backend data on %d, tables on %d, "
+        "serve arena on %d\n", conf->numa_node, residency_node(addr),
+        residency_node(t == NULL ? NULL : t->compact != NULL ?
+        (const void *)t->compact : (const void *)t->pfirsts),
+        residency_node(serve_arena.base));
+
+    return (n < 0 ? 0 : (size_t)n < len ? (size_t)n : len);
+}
+
+/*
+ * Applies a delta file to the field table, the new version sharing
+ * the pages the delta does not touch. The file has to be reachable
+ * from the chroot.
+ */
+int
+geoloc_msg_delta(int fd, struct msg_ctl_req req, const char *path)
+{
+    struct geoloc_table     *t;
+    struct delta            *d;
+    struct timeval          start, end;
+    enum lookup_info_type   li;
+    char                    info[256];
+    uint32_t                copied;
+    FILE                    *fp;
+
+    if (geoloc_msg_field(req.field, &li) == -1 || tables[li] == NULL) {
+        reply_string(fd, "no table for this field");
+        return (0);
+    }
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        log_warn("delta %s", path);
+        reply_string(fd, "cannot open the delta");
+        return (0);
+    }
+    d = delta_read(fp, 1);
+    fclose(fp);
+    if (d == NULL) {
+        reply_string(fd, "invalid delta");
+        return (0);
+    }
+
+    gettimeofday(&start, NULL);
+    t = table_apply(tables[li], d, &copied);
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &end);
+
+    if (t == NULL) {
+        reply_string(fd, "delta failed");
+        delta_free(d);
+        return (0);
+    }
+
+    if (t->compact != NULL)
+        snprintf(info, sizeof(info), "delta applied: %zu ranges, %u ranges "
+            "compacted again, %lld.%06ld s", d->nranges, t->nranges,
+            (long long)end.tv_sec, (long)end.tv_usec);
+    else
+        snprintf(info, sizeof(info), "delta applied: %zu ranges, %u pages "
+            "rebuilt, %u ranges in %u pages, %lld.%06ld s", d->nranges,
+            copied, t->nranges, t->npages, (long long)end.tv_sec,
+            (long)end.tv_usec);
+    log_info("%s %s", geoloc_field_name(li), info);
+
+    t = __atomic_exchange_n(&tables[li], t, __ATOMIC_ACQ_REL);
+    table_free(t);
+    stats.deltas++;
+    delta_free(d);
+
+    reply_string(fd, info);
+
+    return (0);
+}
+
+static int
+geoloc_enumerate_cb(void *arg, const struct geoloc_addr *first,
+                    const struct geoloc_addr *last, const char *value)
+{
+    struct enumerate_stream *es = arg;
+    struct geoloc_addr      cur, plast;
+    char                    prefix[GEOLOC_PREFIX_MAX];
+    size_t                  klen, vlen;
+    int                     bits;
+
+    vlen = strlen(value) + 1;
+    cur = *first;
+
+    for (;;) {
+        bits = addr_range_prefix(&cur, last);
+        addr_format_prefix(&cur, bits, prefix, sizeof(prefix));
+        klen = strlen(prefix) + 1;
+
+        if (es->len + klen + vlen > sizeof(es->buf)) {
+            if (reply_chunk(es->fd, es->buf, es->len, es->count) == -1)
+                return (-1);
+            es->len = 0;
+            es->count = 0;
+        }
+
+        memcpy(es->buf + es->len, prefix, klen);
+        memcpy(es->buf + es->len + klen, value, vlen);
+        es->len += klen + vlen;
+        es->count += 2;
+
+        addr_prefix_last(&cur, bits, &plast);
+        if (addr_cmp(&plast, last) >= 0)
+            break;
+        cur = plast;
+        addr_incr(&cur);
+    }
+
+    return (0);
+}
+
+/*
+ * A place within the radius, its ranges going out next with the
+ * coordinates followed by the distance in km as value, as for nearest
+ */
+static int
+geoloc_radius_cb(void *arg, const struct spatial_point *p, double km)
+{
+    struct enumerate_job        *job = arg;
+    const struct index_value    *v = p->data;
+
+    snprintf(job->value, sizeof(job->value), "%s %.1f", v->name, km);
+    job->place = p;
+    job->span = 0;
+
+    return (1);
+}
@@ -25,19 +25,47 @@
 #include <netinet/in.h>
 
 #include <stdarg.h>
+#include <stdint.h>
 #include <string.h>
 
+#include "addr.h"
+
 #define GEOLOCD_SOCKET      "/var/run/geolocd.sock"
+#define GEOLOCD_PORT        7600
 #define CONF_FILE           "/etc/geolocd.conf"
 #define GEOLOCD_USER        "_geolocd"
 
+#define GEOLOC_ADDR_MAX     128
+#define GEOLOC_BATCH_MAX    512
+#define GEOLOC_VALUE_MAX    256
+#define GEOLOC_PLUGINS_MAX  8
+
+#ifndef nitems
+#define nitems(_a)          (sizeof((_a)) / sizeof((_a)[0]))
+#endif
+
 enum msg_type {
     MSG_CTL_NONE               = 0,
     MSG_CTL_RELOAD             = 1,
     MSG_CTL_SHUTDOWN           = 2,
     MSG_CTL_BACKEND_INFO       = 3,
     MSG_CTL_PROPERTY           = 4,
-    MSG_CTL_PROPERTY_KEY       = 5
+    MSG_CTL_PROPERTY_KEY       = 5,
+    MSG_CTL_PROPERTY_BATCH     = 6,
+    MSG_CTL_PROPERTY_ALL       = 7,
+    MSG_CTL_STATS              = 8,
+    MSG_CTL_ENUMERATE          = 9,
+    MSG_CTL_REVERSE            = 10,
+    MSG_CTL_CLASS              = 11,
+    MSG_CTL_BUILD              = 12,
+    MSG_CTL_DELTA              = 13,
+    MSG_CTL_NEAREST            = 14,
+    MSG_CTL_RADIUS             = 15,
+    MSG_CTL_SLOWLOG            = 16,
+    MSG_CTL_MEMORY             = 17,
+    MSG_CTL_UPGRADE            = 18,
+    MSG_CTL_READY              = 19,
+    MSG_CTL_ANALYTICS          = 20
 };
 
 enum msg_field {
@@ -50,14 +78,53 @@ enum msg_field {
     MSG_PROPERTY_CCODE         = 4,
     MSG_PROPERTY_ISP           = 5,
     MSG_PROPERTY_MNC           = 6,
-    MSG_PROPERTY_MCC           = 7
+    MSG_PROPERTY_MCC           = 7,
+    /* Connection classes */
+    MSG_CLASS_INTERACTIVE      = 8,
+    MSG_CLASS_BULK             = 9,
+    /* Lookup properties, continued */
+    MSG_PROPERTY_CITY          = 10,
+    MSG_PROPERTY_COORDS        = 11,
+    /* Reload phases, a coordinated reload of several instances */
+    MSG_RELOAD_PREPARE         = 12,
+    MSG_RELOAD_COMMIT          = 13,
+    MSG_RELOAD_ABORT           = 14
 };
 
 enum lookup_info_type {
     GEOLOC_COUNTRY,
     GEOLOC_ISP,
     GEOLOC_MNC,
-    GEOLOC_MCC
+    GEOLOC_MCC,
+    GEOLOC_CITY,
+    /* "latitude longitude" in decimal degrees */
+    GEOLOC_COORDS
+};
+
+#define GEOLOC_NFIELDS      (GEOLOC_COORDS + 1)
+
+enum msg_status {
+    MSG_STATUS_OK              = 0,
+    MSG_STATUS_INVALID         = 1,
+    MSG_STATUS_OVERLOADED      = 2
+};
+
+#define GEOLOC_OVERLOADED_INFO  "overloaded"
+/* acknowledgement of an upgraded process ready to serve */
+#define GEOLOC_DRAINING_INFO    "draining"
+
+enum conn_class {
+    CLASS_INTERACTIVE,
+    CLASS_BULK,
+    CLASS_MAX
+};
+
+enum cache_mode {
+    CACHE_DEFAULT,
+    CACHE_STANDARD,
+    CACHE_MEMORY,
+    CACHE_MMAP,
+    CACHE_SHARED
 };
 
 struct msg_ctl_req {
@@ -65,10 +132,35 @@ struct msg_ctl_req {
     enum msg_field      field;
 };
 
-typedef void *(*backend_init_callback)(const char *);
+/*
+ * Follows a MSG_CTL_PROPERTY_BATCH request,
+ * len bytes of count NUL terminated addresses come next.
+ */
+struct msg_ctl_batch {
+    uint32_t            count;
+    uint32_t            len;
+};
+
+/*
+ * Header of the vectored replies (batch and all fields requests),
+ * len bytes of count NUL terminated strings come next.
+ */
+struct msg_ctl_res {
+    uint32_t            status;
+    uint32_t            count;
+    uint32_t            len;
+};
+
+typedef void *(*backend_init_callback)(const char *, enum cache_mode);
 typedef void *(*backend_lookup_init_callback)(void *, const char *, enum lookup_info_type, const char **);
 typedef void (*backend_lookup_cleanup_callback)(void *, void *);
 typedef void (*backend_shutdown_callback)(void *);
+typedef int (*backend_memory_callback)(void *, void **, size_t *);
+typedef void *(*backend_range_callback)(void *, const struct geoloc_addr *, enum lookup_info_type, const char **, struct geoloc_addr *);
+typedef void *(*backend_addr_callback)(void *, const struct geoloc_addr *, enum lookup_info_type, const char **);
+typedef int (*backend_batch_callback)(void *, const struct geoloc_addr *, size_t, enum lookup_info_type, const char **, void **);
+typedef int (*backend_fields_callback)(void *, const struct geoloc_addr *, const enum lookup_info_type *, size_t, const char **, void **);
+typedef int (*backend_value_callback)(void *, const struct geoloc_addr *, enum lookup_info_type, char *, size_t);
 
 static TAILQ_HEAD(backends, backend) backends = TAILQ_HEAD_INITIALIZER(backends);
 
@@ -82,19 +174,151 @@ struct backend {
     backend_lookup_init_callback    gl_blic;
     backend_lookup_cleanup_callback gl_blcc;
     backend_shutdown_callback       gl_bsc;
+    /* optional, the in memory data region */
+    backend_memory_callback         gl_bmc;
+    /* optional, lookup giving the last address sharing the data */
+    backend_range_callback          gl_brc;
+    /* optional, lookups from parsed addresses */
+    backend_addr_callback           gl_bac;
+    backend_batch_callback          gl_bbc;
+    backend_fields_callback         gl_bfc;
+    /* optional, the value copied to a caller buffer, nothing to clean up */
+    backend_value_callback          gl_bvc;
 
     unsigned                        ipv6capable:1;
+    /* lookups may run concurrently on one handler */
+    unsigned                        threadsafe:1;
+    /* dlopen handle of a plugin backend */
+    void                            *dl;
+};
+
+struct geoloc_stats {
+    uint64_t                  requests;
+    uint64_t                  lookups;
+    uint64_t                  reserved[RESERVED_MAX];
+    uint64_t                  enumerations;
+    uint64_t                  reverses;
+    uint64_t                  reloads;
+    uint64_t                  table_lookups;
+    uint64_t                  deltas;
+    uint64_t                  spatial;
+    uint64_t                  admitted;
+    uint64_t                  overloaded;
+    uint64_t                  expired;
+    uint64_t                  refused;
+    uint64_t                  served[CLASS_MAX];
+    /* lookups given the value of an identical one of the round */
+    uint64_t                  coalesced;
+    /* heap allocations made by the request path */
+    uint64_t                  allocs;
+    /* startup warm-up from the hot set snapshot */
+    uint64_t                  warmup_prefixes;
+    uint64_t                  warmup_lookups;
+    uint64_t                  warmup_usec;
+    /* backend and table lookups time */
+    uint64_t                  lookup_usec;
+    /* polls finding nothing, busy polling */
+    uint64_t                  idle_polls;
+};
+
+/*
+ * Point of presence, nearest ones being asked for by address
+ */
+struct geoloc_pop {
+    char                      *name;
+    double                    lat;
+    double                    lon;
 };
 
 struct geolocd_conf {
     char                      *backend;
     char                      *datafile;
+    enum cache_mode           cache;
+    unsigned                  prefault:1;
+    unsigned                  mlock:1;
+    unsigned                  hugepages:1;
+    /* busy polling, with locked and pre-faulted memory */
+    unsigned                  lowlatency:1;
+    /* NUMA node the daemon runs on, -1 for none */
+    int                       numa_node;
+    /* CPUs of the serving and the build threads, -1 for none */
+    int                       cpu;
+    int                       build_cpu;
+    /* lookup_info_type bit masks */
+    uint32_t                  indexes;
+    uint32_t                  indexes6;
+    uint32_t                  tables;
+    uint32_t                  tables6;
+    uint32_t                  tables_compact;
+    /* admission control, deadlines in ms */
+    unsigned                  conn_max;
+    unsigned                  queue_conn;
+    unsigned                  queue_global;
+    unsigned                  deadline[CLASS_MAX];
+    /* backend plugins paths */
+    char                      *plugins[GEOLOC_PLUGINS_MAX];
+    unsigned                  nplugins;
+    /* control socket, GEOLOCD_SOCKET when not set */
+    char                      *socket;
+    /* optional TCP listener */
+    char                      *listen;
+    unsigned                  port;
+    struct geoloc_pop         *pops;
+    unsigned                  npops;
+    /* slow requests threshold, ms */
+    unsigned                  slowlog;
+    /* requests capture file */
+    char                      *capture;
+    /* hot set snapshot, in the chroot, interval in s, budget in ms */
+    char                      *hotset;
+    unsigned                  hotset_interval;
+    unsigned                  hotset_budget;
+    /* request analytics, window in s */
+    int                       analytics;
+    unsigned                  analytics_window;
 };
 
+extern struct geoloc_stats  stats;
+
 void usage(void);
+const char *geoloc_field_name(enum lookup_info_type);
 struct geolocd_conf *parse_config(const char *);
 void clear_config(struct geolocd_conf *);
 
+/* residency.c */
+void residency_apply(struct backend *, void *, struct geolocd_conf *);
+int residency_numa(int);
+int residency_node(const void *);
+int residency_pin(int);
+int residency_worker(int);
+int residency_lowlatency(void);
+
+/* plugin.c */
+struct backend *plugin_load(const char *);
+void plugin_unload(struct backend *);
+
+/* walk.c */
+typedef int (*walk_callback)(void *, const struct geoloc_addr *, const struct geoloc_addr *, const char *);
+
+/*
+ * Walk in progress, resumed where it stopped, the run being merged
+ * kept along
+ */
+struct walk_cursor {
+    struct geoloc_addr        cur;
+    struct geoloc_addr        last;
+    struct geoloc_addr        mfirst;
+    struct geoloc_addr        mlast;
+    enum lookup_info_type     li;
+    int                       merged;
+    int                       done;
+    char                      value[GEOLOC_VALUE_MAX];
+};
+
+int walk_range(struct backend *, const struct geoloc_addr *, const struct geoloc_addr *, enum lookup_info_type, walk_callback, void *);
+int walk_init(struct walk_cursor *, struct backend *, const struct geoloc_addr *, const struct geoloc_addr *, enum lookup_info_type);
+int walk_step(struct backend *, struct walk_cursor *, size_t, walk_callback, void *);
+
 /* log.c */
 void log_init(int);
 void log_warn(const char *, ...);
@@ -0,0 +1,332 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "hotset.h"
+
+/* open addressing, kept at most half full */
+#define HOTSET_BUCKETS      (HOTSET_MAX * 2)
+
+static struct hotset_entry  *hot = NULL;
+static size_t               nhot = 0;
+static int                  dirty = 0;
+
+static size_t hotset_prefix(const struct geoloc_addr *);
+static size_t hotset_find(const struct geoloc_addr *);
+static void hotset_insert(const struct hotset_entry *);
+static void hotset_decay(void);
+static int hotset_cmp(const void *, const void *);
+static void hotset_put32(unsigned char *, uint32_t);
+static uint32_t hotset_get32(const unsigned char *);
+
+int
+hotset_init(void)
+{
+    if ((hot = calloc(HOTSET_BUCKETS, sizeof(*hot))) == NULL) {
+        log_warn("hotset_init");
+        return (-1);
+    }
+    nhot = 0;
+    dirty = 0;
+
+    return (0);
+}
+
+/*
+ * Bytes of the address making its prefix, the mapped IPv4
+ * ones ending with their third byte
+ */
+static size_t
+hotset_prefix(const struct geoloc_addr *addr)
+{
+    return (addr_isv4(addr) ? 15 : 6);
+}
+
+/*
+ * Bucket of the prefix of the address, an empty one when
+ * it is not kept yet
+ */
+static size_t
+hotset_find(const struct geoloc_addr *addr)
+{
+    size_t      len = hotset_prefix(addr), i;
+    uint32_t    h = 2166136261U;
+
+    for (i = 0; i < len; i++)
+        h = (h ^ addr->a[i]) * 16777619U;
+
+    for (i = h & (HOTSET_BUCKETS - 1); hot[i].count != 0;
+        i = (i + 1) & (HOTSET_BUCKETS - 1))
+        if (memcmp(hot[i].addr.a, addr->a, len) == 0)
+            break;
+
+    return (i);
+}
+
+static void
+hotset_insert(const struct hotset_entry *e)
+{
+    size_t  i;
+
+    if (nhot >= HOTSET_MAX)
+        hotset_decay();
+
+    i = hotset_find(&e->addr);
+    if (hot[i].count == 0) {
+        hot[i] = *e;
+        nhot++;
+    } else {
+        hot[i].count += e->count;
+        hot[i].fields |= e->fields;
+    }
+}
+
+/*
+ * Counts are halved, the prefixes left at zero making room.
+ * The remaining ones are hashed again, removals breaking the
+ * probe sequences.
+ */
+static void
+hotset_decay(void)
+{
+    static struct hotset_entry  live[HOTSET_MAX];
+    size_t                      i, n;
+
+    do {
+        for (i = 0, n = 0; i < HOTSET_BUCKETS; i++) {
+            if (hot[i].count == 0)
+                continue;
+            if ((hot[i].count >>= 1) != 0)
+                live[n++] = hot[i];
+        }
+        bzero(hot, HOTSET_BUCKETS * sizeof(*hot));
+        for (nhot = 0; nhot < n; nhot++)
+            hot[hotset_find(&live[nhot].addr)] = live[nhot];
+    } while (nhot >= HOTSET_MAX);
+}
+
+/*
+ * Called for every looked up address, reserved ones aside
+ */
+void
+hotset_hit(const struct geoloc_addr *addr, enum lookup_info_type li)
+{
+    size_t  i;
+
+    if (hot == NULL)
+        return;
+
+    i = hotset_find(addr);
+    if (hot[i].count == 0) {
+        if (nhot >= HOTSET_MAX) {
+            hotset_decay();
+            i = hotset_find(addr);
+        }
+        nhot++;
+    }
+
+    hot[i].addr = *addr;
+    if (hot[i].count < UINT32_MAX)
+        hot[i].count++;
+    hot[i].fields |= 1U << li;
+    dirty = 1;
+}
+
+int
+hotset_dirty(void)
+{
+    return (hot != NULL && dirty);
+}
+
+static int
+hotset_cmp(const void *a, const void *b)
+{
+    const struct hotset_entry   *ea = a, *eb = b;
+
+    if (ea->count != eb->count)
+        return (ea->count > eb->count ? -1 : 1);
+
+    return (addr_cmp(&ea->addr, &eb->addr));
+}
+
+/*
+ * Writes the prefixes hottest first to a temporary file
+ * renamed over the snapshot, never leaving a partial one
+ */
+int
+hotset_save(const char *path)
+{
+    unsigned char       buf[HOTSET_RECORD_LEN];
+    char                tmp[1024];
+    struct hotset_entry *e;
+    FILE                *fp;
+    size_t              i, n;
+
+    if (hot == NULL)
+        return (0);
+
+    if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp)) {
+        log_warnx("hotset_save: %s: path too long", path);
+        return (-1);
+    }
+
+    if ((e = calloc(HOTSET_MAX, sizeof(*e))) == NULL) {
+        log_warn("hotset_save");
+        return (-1);
+    }
+    for (i = 0, n = 0; i < HOTSET_BUCKETS; i++)
+        if (hot[i].count != 0)
+            e[n++] = hot[i];
+    qsort(e, n, sizeof(*e), hotset_cmp);
+
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        log_warn("hotset_save: %s", tmp);
+        free(e);
+        return (-1);
+    }
+
+    memcpy(buf, HOTSET_MAGIC, 8);
+    hotset_put32(buf + 8, HOTSET_VERSION);
+    hotset_put32(buf + 12, (uint32_t)n);
+    if (fwrite(buf, HOTSET_HEADER_LEN, 1, fp) != 1)
+        goto fail;
+
+    for (i = 0; i < n; i++) {
+        memcpy(buf, e[i].addr.a, sizeof(e[i].addr.a));
+        hotset_put32(buf + 16, e[i].count);
+        hotset_put32(buf + 20, e[i].fields);
+        if (fwrite(buf, HOTSET_RECORD_LEN, 1, fp) != 1)
+            goto fail;
+    }
+
+    if (fclose(fp) == EOF) {
+        fp = NULL;
+        goto fail;
+    }
+    fp = NULL;
+
+    if (rename(tmp, path) == -1)
+        goto fail;
+
+    free(e);
+    dirty = 0;
+
+    return ((int)n);
+
+fail:
+    log_warn("hotset_save: %s", path);
+    if (fp != NULL)
+        fclose(fp);
+    unlink(tmp);
+    free(e);
+    return (-1);
+}
+
+/*
+ * Reads a snapshot, hottest prefixes first, which seeds the
+ * counts of this run too. A missing one is an empty set.
+ */
+int
+hotset_load(const char *path, struct hotset_entry **entries, size_t *n)
+{
+    unsigned char       buf[HOTSET_RECORD_LEN];
+    struct hotset_entry *e = NULL;
+    FILE                *fp;
+    uint32_t            count;
+    size_t              i;
+
+    *entries = NULL;
+    *n = 0;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        if (errno == ENOENT)
+            return (0);
+        log_warn("hotset_load: %s", path);
+        return (-1);
+    }
+
+    if (fread(buf, HOTSET_HEADER_LEN, 1, fp) != 1 ||
+        memcmp(buf, HOTSET_MAGIC, 8) != 0 ||
+        hotset_get32(buf + 8) != HOTSET_VERSION ||
+        (count = hotset_get32(buf + 12)) > HOTSET_MAX)
+        goto invalid;
+
+    if (count > 0 && (e = calloc(count, sizeof(*e))) == NULL) {
+        log_warn("hotset_load");
+        fclose(fp);
+        return (-1);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (fread(buf, HOTSET_RECORD_LEN, 1, fp) != 1)
+            goto invalid;
+        memcpy(e[i].addr.a, buf, sizeof(e[i].addr.a));
+        e[i].count = hotset_get32(buf + 16);
+        e[i].fields = hotset_get32(buf + 20) & ((1U << GEOLOC_NFIELDS) - 1);
+        if (e[i].count == 0)
+            goto invalid;
+        if (hot != NULL)
+            hotset_insert(&e[i]);
+    }
+    fclose(fp);
+
+    if (count > 0)
+        qsort(e, count, sizeof(*e), hotset_cmp);
+    *entries = e;
+    *n = count;
+
+    return (0);
+
+invalid:
+    log_warnx("hotset_load: %s is not a valid snapshot", path);
+    fclose(fp);
+    free(e);
+    return (-1);
+}
+
+void
+hotset_free(void)
+{
+    free(hot);
+    hot = NULL;
+    nhot = 0;
+}
+
+static void
+hotset_put32(unsigned char *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t
+hotset_get32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+        (uint32_t)p[2] << 8 | p[3]);
+}
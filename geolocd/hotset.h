@@ -0,0 +1,56 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GEOLOC_HOTSET_H_
+#define _GEOLOC_HOTSET_H_           1
+
+#include "addr.h"
+#include "geoloc.h"
+
+/* prefixes kept, the coldest ones decaying beyond */
+#define HOTSET_MAX                  4096
+/* seconds between two snapshots */
+#define HOTSET_INTERVAL             300
+/* warm-up time budget, ms */
+#define HOTSET_BUDGET               1000
+#define HOTSET_MAGIC                "GEOLOCHS"
+#define HOTSET_VERSION              1
+/* magic, version and count */
+#define HOTSET_HEADER_LEN           16
+/* address, count and fields */
+#define HOTSET_RECORD_LEN           24
+
+/*
+ * A looked up /24 (IPv4) or /48 (IPv6), with the last
+ * address seen in it and the fields asked for
+ */
+struct hotset_entry {
+    struct geoloc_addr      addr;
+    uint32_t                count;
+    /* lookup_info_type bit mask */
+    uint32_t                fields;
+};
+
+int hotset_init(void);
+void hotset_hit(const struct geoloc_addr *, enum lookup_info_type);
+int hotset_dirty(void);
+int hotset_save(const char *);
+int hotset_load(const char *, struct hotset_entry **, size_t *);
+void hotset_free(void);
+
+#endif
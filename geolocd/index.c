@@ -0,0 +1,338 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "index.h"
+
+#define INDEX_BUCKETS_MIN   256
+
+static uint32_t index_hash(const char *);
+static struct index_value *index_value_add(struct geoloc_index *, const char *);
+static int index_rehash(struct geoloc_index *, uint32_t);
+static int index_walk_cb(void *, const struct geoloc_addr *, const struct geoloc_addr *, const char *);
+static int index_spans_grow(struct index_value *, uint32_t);
+static void index_progress(struct geoloc_index *, const struct geoloc_addr *);
+
+/* ::ffff:0.0.0.0 - ::ffff:255.255.255.255 */
+static const struct geoloc_addr inet_first = { {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0, 0, 0, 0 } };
+static const struct geoloc_addr inet_last = { {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff } };
+/* 2000::/3 */
+static const struct geoloc_addr inet6_first = { {
+    0x20, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 } };
+static const struct geoloc_addr inet6_last = { {
+    0x3f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+    0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff } };
+
+/*
+ * Builds the index of the field. With a previous index, the value
+ * lists are compared while walking and only the ones which changed
+ * are allocated, the others being taken over from the previous index
+ * by index_finish. Until then, the previous index is only read.
+ */
+struct geoloc_index *
+index_build(struct backend *b, enum lookup_info_type field, int inet6,
+            struct geoloc_index *prev, struct index_progress *pr)
+{
+    struct geoloc_index *idx;
+
+    if ((idx = calloc(1, sizeof(*idx))) == NULL) {
+        log_warn("index_build");
+        return (NULL);
+    }
+    idx->field = field;
+    idx->inet6 = inet6;
+    idx->prev = prev;
+    idx->pr = pr;
+
+    if (index_rehash(idx, INDEX_BUCKETS_MIN) == -1)
+        goto fail;
+
+    if (walk_range(b, &inet_first, &inet_last, field, index_walk_cb, idx) == -1)
+        goto fail;
+
+    if (inet6 &&
+        walk_range(b, &inet6_first, &inet6_last, field, index_walk_cb, idx) == -1)
+        goto fail;
+
+    if (pr != NULL) {
+        __atomic_store_n(&pr->permille, 1000, __ATOMIC_RELAXED);
+        __atomic_store_n(&pr->ranges, idx->nspans, __ATOMIC_RELAXED);
+    }
+    idx->pr = NULL;
+
+    return (idx);
+
+fail:
+    log_warnx("index_build: walk failed");
+    index_free(idx);
+    return (NULL);
+}
+
+/*
+ * Values still matching their previous list take it over,
+ * unless they lost ranges in which case the head is copied
+ */
+void
+index_finish(struct geoloc_index *idx)
+{
+    struct index_value  *v, *pv;
+    uint32_t            i;
+
+    for (i = 0; i < idx->nvalues; i++) {
+        v = &idx->values[i];
+        if ((pv = v->prev) == NULL)
+            continue;
+        v->prev = NULL;
+
+        if (v->nspans == pv->nspans) {
+            v->spans = pv->spans;
+            v->spansz = pv->spansz;
+            pv->spans = NULL;
+            pv->nspans = pv->spansz = 0;
+            idx->reused++;
+        } else if (index_spans_grow(v, v->nspans) == 0) {
+            memcpy(v->spans, pv->spans, v->nspans * sizeof(*v->spans));
+        } else {
+            v->nspans = 0;
+        }
+    }
+    idx->prev = NULL;
+}
+
+/*
+ * The ranges of a value, still in the previous index
+ * while the build is not finished
+ */
+const struct index_span *
+index_value_spans(const struct index_value *v)
+{
+    return (v->prev != NULL ? v->prev->spans : v->spans);
+}
+
+struct index_value *
+index_value_find(struct geoloc_index *idx, const char *name)
+{
+    uint32_t    h, id;
+
+    h = index_hash(name) & (idx->nbuckets - 1);
+    while ((id = idx->buckets[h]) != 0) {
+        if (strcmp(idx->values[id - 1].name, name) == 0)
+            return (&idx->values[id - 1]);
+        h = (h + 1) & (idx->nbuckets - 1);
+    }
+
+    return (NULL);
+}
+
+/*
+ * Memory of the index, value names and ranges included
+ */
+size_t
+index_footprint(const struct geoloc_index *idx)
+{
+    size_t      len;
+    uint32_t    i;
+
+    len = sizeof(*idx) + (size_t)idx->valuesz * sizeof(*idx->values) +
+        (size_t)idx->nbuckets * sizeof(*idx->buckets);
+    for (i = 0; i < idx->nvalues; i++)
+        len += strlen(idx->values[i].name) + 1 +
+            (size_t)idx->values[i].spansz * sizeof(struct index_span);
+
+    return (len);
+}
+
+void
+index_free(struct geoloc_index *idx)
+{
+    uint32_t    i;
+
+    if (idx == NULL)
+        return;
+
+    for (i = 0; i < idx->nvalues; i++) {
+        free(idx->values[i].name);
+        free(idx->values[i].spans);
+    }
+    free(idx->values);
+    free(idx->buckets);
+    free(idx);
+}
+
+/* FNV-1a */
+static uint32_t
+index_hash(const char *s)
+{
+    uint32_t    h = 2166136261U;
+
+    while (*s != '\0') {
+        h ^= (uint8_t)*s++;
+        h *= 16777619U;
+    }
+
+    return (h);
+}
+
+static struct index_value *
+index_value_add(struct geoloc_index *idx, const char *name)
+{
+    struct index_value  *v, *values;
+    uint32_t            h, sz;
+
+    if ((v = index_value_find(idx, name)) != NULL)
+        return (v);
+
+    /* keeps the table at most half full */
+    if ((idx->nvalues + 1) * 2 > idx->nbuckets &&
+        index_rehash(idx, idx->nbuckets * 2) == -1)
+        return (NULL);
+
+    if (idx->nvalues == idx->valuesz) {
+        sz = (idx->valuesz == 0 ? 64 : idx->valuesz * 2);
+        if ((values = reallocarray(idx->values, sz, sizeof(*values))) == NULL)
+            return (NULL);
+        idx->values = values;
+        idx->valuesz = sz;
+    }
+
+    v = &idx->values[idx->nvalues];
+    bzero(v, sizeof(*v));
+    if ((v->name = strdup(name)) == NULL)
+        return (NULL);
+    if (idx->prev != NULL)
+        v->prev = index_value_find(idx->prev, name);
+    idx->nvalues++;
+
+    h = index_hash(name) & (idx->nbuckets - 1);
+    while (idx->buckets[h] != 0)
+        h = (h + 1) & (idx->nbuckets - 1);
+    idx->buckets[h] = idx->nvalues;
+
+    return (v);
+}
+
+static int
+index_rehash(struct geoloc_index *idx, uint32_t nbuckets)
+{
+    uint32_t    *buckets, i, h;
+
+    if ((buckets = calloc(nbuckets, sizeof(*buckets))) == NULL) {
+        log_warn("index_rehash");
+        return (-1);
+    }
+
+    for (i = 0; i < idx->nvalues; i++) {
+        h = index_hash(idx->values[i].name) & (nbuckets - 1);
+        while (buckets[h] != 0)
+            h = (h + 1) & (nbuckets - 1);
+        buckets[h] = i + 1;
+    }
+
+    free(idx->buckets);
+    idx->buckets = buckets;
+    idx->nbuckets = nbuckets;
+
+    return (0);
+}
+
+static int
+index_walk_cb(void *arg, const struct geoloc_addr *first,
+              const struct geoloc_addr *last, const char *value)
+{
+    struct geoloc_index *idx = arg;
+    struct index_value  *v, *pv;
+    struct index_span   *span;
+
+    if (idx->pr != NULL) {
+        if (__atomic_load_n(&idx->pr->stop, __ATOMIC_RELAXED))
+            return (-1);
+        index_progress(idx, last);
+    }
+
+    if ((v = index_value_add(idx, value)) == NULL) {
+        log_warn("index_walk_cb");
+        return (-1);
+    }
+
+    if ((pv = v->prev) != NULL) {
+        span = (v->nspans < pv->nspans ? &pv->spans[v->nspans] : NULL);
+        if (span != NULL &&
+            addr_cmp(&span->first, first) == 0 &&
+            addr_cmp(&span->last, last) == 0) {
+            v->nspans++;
+            idx->nspans++;
+            return (0);
+        }
+        /* diverging, the matching head is copied */
+        if (index_spans_grow(v, v->nspans + 1) == -1)
+            return (-1);
+        memcpy(v->spans, pv->spans, v->nspans * sizeof(*v->spans));
+        v->prev = NULL;
+    }
+
+    if (v->nspans == v->spansz &&
+        index_spans_grow(v, (v->spansz == 0 ? 4 : v->spansz * 2)) == -1)
+        return (-1);
+
+    v->spans[v->nspans].first = *first;
+    v->spans[v->nspans].last = *last;
+    v->nspans++;
+    idx->nspans++;
+
+    return (0);
+}
+
+static int
+index_spans_grow(struct index_value *v, uint32_t sz)
+{
+    struct index_span   *spans;
+
+    if ((spans = reallocarray(v->spans, sz, sizeof(*spans))) == NULL) {
+        log_warn("index_spans_grow");
+        return (-1);
+    }
+    v->spans = spans;
+    v->spansz = sz;
+
+    return (0);
+}
+
+/*
+ * Walk position in per mille, from the top bits of the IPv4
+ * address then of the IPv6 global unicast one
+ */
+static void
+index_progress(struct geoloc_index *idx, const struct geoloc_addr *last)
+{
+    uint32_t    pos, half = (idx->inet6 ? 500 : 1000);
+
+    if (addr_isv4(last))
+        pos = (((uint32_t)last->a[12] << 8 | last->a[13]) * half) >> 16;
+    else
+        pos = half + ((((uint32_t)(last->a[0] & 0x1f) << 8 | last->a[1]) *
+            (1000 - half)) >> 13);
+
+    __atomic_store_n(&idx->pr->permille, pos, __ATOMIC_RELAXED);
+    __atomic_store_n(&idx->pr->ranges, idx->nspans, __ATOMIC_RELAXED);
+}
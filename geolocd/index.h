@@ -0,0 +1,78 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GEOLOC_INDEX_H_
+#define _GEOLOC_INDEX_H_            1
+
+#include "geoloc.h"
+
+struct index_span {
+    struct geoloc_addr      first;
+    struct geoloc_addr      last;
+};
+
+/*
+ * A value of the field with its sorted,
+ * merged list of address ranges
+ */
+struct index_value {
+    char                    *name;
+    struct index_span       *spans;
+    uint32_t                nspans;
+    uint32_t                spansz;
+    /* while building, previous list still matching */
+    struct index_value      *prev;
+};
+
+/*
+ * Build progress, read and stopped from another thread
+ */
+struct index_progress {
+    uint64_t                ranges;
+    uint32_t                permille;
+    int                     stop;
+};
+
+/*
+ * Inverted index of one lookup field, built by walking the whole
+ * IPv4 space (and the IPv6 global unicast space if asked for)
+ */
+struct geoloc_index {
+    enum lookup_info_type   field;
+    unsigned                inet6:1;
+    struct index_value      *values;
+    uint32_t                nvalues;
+    uint32_t                valuesz;
+    uint32_t                *buckets;
+    uint32_t                nbuckets;
+    uint64_t                nspans;
+    uint32_t                reused;
+    struct geoloc_index     *prev;
+    /* while building, progress report */
+    struct index_progress   *pr;
+};
+
+struct geoloc_index *index_build(struct backend *, enum lookup_info_type, int,
+    struct geoloc_index *, struct index_progress *);
+void index_finish(struct geoloc_index *);
+struct index_value *index_value_find(struct geoloc_index *, const char *);
+const struct index_span *index_value_spans(const struct index_value *);
+size_t index_footprint(const struct geoloc_index *);
+void index_free(struct geoloc_index *);
+
+#endif
@@ -27,7 +27,10 @@
 #endif
 
 static inline void
-init_modules(void) {
+init_modules(struct geolocd_conf *xconf) {
+    struct backend *b;
+    unsigned i;
+
     log_info("modules loading");
     TAILQ_INIT(&backends);
 #ifdef GEOLOC_GEOIP
@@ -38,6 +41,9 @@ init_modules(void) {
     TAILQ_INSERT_TAIL(&backends, &ip2location_backend, entry);
     log_info("ip2location backend added");
 #endif
+    for (i = 0; i < xconf->nplugins; i++)
+        if ((b = plugin_load(xconf->plugins[i])) != NULL)
+            TAILQ_INSERT_TAIL(&backends, b, entry);
 }
 
 static inline void
@@ -47,6 +53,7 @@ dispose_modules(void)
 	while ((bcurrent = TAILQ_FIRST(&backends)) != NULL) {
 		TAILQ_REMOVE(&backends, bcurrent, entry);
 		log_info("%s backend unset", bcurrent->name);
+		plugin_unload(bcurrent);
 	}
 }
 
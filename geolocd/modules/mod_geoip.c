@@ -18,14 +18,38 @@
 
 #ifdef	GEOLOC_GEOIP
 #include <GeoIP.h>
+#ifdef  HAVE_NO_BSDFUNCS
+#include <bsd/string.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
 
 #include "mod_geoip.h"
 
 void *
-geoip_init_callback(const char *datafile)
+geoip_init_callback(const char *datafile, enum cache_mode cache)
 {
     GeoIP *gi = NULL;
-    gi = GeoIP_open(datafile, GEOIP_MEMORY_CACHE);
+    int flags;
+
+    switch (cache) {
+    case CACHE_STANDARD:
+        flags = GEOIP_STANDARD;
+        break;
+    case CACHE_SHARED:
+        log_info("geoip: no shared memory cache, mmap used instead");
+        /* FALLTHROUGH */
+    case CACHE_MMAP:
+        flags = GEOIP_MMAP_CACHE;
+        break;
+    case CACHE_DEFAULT:
+    case CACHE_MEMORY:
+    default:
+        flags = GEOIP_MEMORY_CACHE;
+        break;
+    }
+
+    gi = GeoIP_open(datafile, flags);
 
     return ((void *)gi); 
 }
@@ -35,16 +59,21 @@ geoip_lookup_init_callback(void *ptr, const char *addr,
                            enum lookup_info_type lit, const char **info)
 {
     GeoIP *gi = (GeoIP *)ptr;
+    char *org = NULL;
+
     if (gi != NULL && addr != NULL && info != NULL) {
         switch(lit) {
         case GEOLOC_COUNTRY:
             *info = GeoIP_country_code_by_addr(gi, addr); 
             break;
         case GEOLOC_ISP:
-            *info = GeoIP_org_by_addr(gi, addr);
+            /* allocated by GeoIP, freed by the cleanup callback */
+            *info = org = GeoIP_org_by_addr(gi, addr);
             break;
         case GEOLOC_MNC:
         case GEOLOC_MCC:
+        case GEOLOC_CITY:
+        case GEOLOC_COORDS:
             *info = "GeoIP does not handle this information";
             break;
         default:
@@ -53,8 +82,144 @@ geoip_lookup_init_callback(void *ptr, const char *addr,
         }
     }
 
-    /* GeoIP module has no cleanup callback */
-    return (NULL);
+    return (org);
+}
+
+void
+geoip_lookup_cleanup_callback(void *arg, void *ptr)
+{
+    free(ptr);
+}
+
+/*
+ * GeoIP keeps the netmask of the last record found,
+ * the range is the network of the address with this netmask
+ */
+void *
+geoip_range_callback(void *ptr, const struct geoloc_addr *addr,
+                     enum lookup_info_type lit, const char **info,
+                     struct geoloc_addr *last)
+{
+    GeoIP *gi = (GeoIP *)ptr;
+    char key[GEOLOC_ADDR_MAX], *org = NULL;
+    int v4, netmask;
+
+    if (gi == NULL)
+        return (NULL);
+
+    v4 = addr_isv4(addr);
+    addr_format(addr, key, sizeof(key));
+
+    switch(lit) {
+    case GEOLOC_COUNTRY:
+        *info = (v4 ? GeoIP_country_code_by_addr(gi, key) :
+            GeoIP_country_code_by_addr_v6(gi, key));
+        break;
+    case GEOLOC_ISP:
+        *info = org = (v4 ? GeoIP_org_by_addr(gi, key) :
+            GeoIP_org_by_addr_v6(gi, key));
+        break;
+    default:
+        *info = NULL;
+        addr_prefix_last(addr, 0, last);
+        return (NULL);
+    }
+
+    if ((netmask = GeoIP_last_netmask(gi)) <= 0)
+        netmask = (v4 ? 32 : 128);
+    addr_prefix_last(addr, netmask + (v4 ? 96 : 0), last);
+
+    return (org);
+}
+
+/*
+ * Lookup from a parsed address, through the GeoIP numeric API
+ */
+void *
+geoip_addr_callback(void *ptr, const struct geoloc_addr *addr,
+                    enum lookup_info_type lit, const char **info)
+{
+    GeoIP *gi = (GeoIP *)ptr;
+    geoipv6_t ipnum6;
+    unsigned long ipnum;
+    char *org = NULL;
+    int v4;
+
+    *info = NULL;
+    if (gi == NULL)
+        return (NULL);
+
+    if ((v4 = addr_isv4(addr)))
+        ipnum = ((unsigned long)addr->a[12] << 24) |
+            ((unsigned long)addr->a[13] << 16) |
+            ((unsigned long)addr->a[14] << 8) | addr->a[15];
+    else
+        memcpy(&ipnum6, addr->a, sizeof(ipnum6));
+
+    switch(lit) {
+    case GEOLOC_COUNTRY:
+        *info = (v4 ? GeoIP_country_code_by_ipnum(gi, ipnum) :
+            GeoIP_country_code_by_ipnum_v6(gi, ipnum6));
+        break;
+    case GEOLOC_ISP:
+        *info = org = (v4 ? GeoIP_org_by_ipnum(gi, ipnum) :
+            GeoIP_org_by_ipnum_v6(gi, ipnum6));
+        break;
+    case GEOLOC_MNC:
+    case GEOLOC_MCC:
+    case GEOLOC_CITY:
+    case GEOLOC_COORDS:
+        *info = "GeoIP does not handle this information";
+        break;
+    default:
+        log_warn("bad lookup info");
+    }
+
+    return (org);
+}
+
+/*
+ * Lookup copied to the caller buffer. Country codes are GeoIP
+ * static strings, organizations being allocated by GeoIP and
+ * released right away.
+ */
+int
+geoip_value_callback(void *ptr, const struct geoloc_addr *addr,
+                     enum lookup_info_type lit, char *buf, size_t len)
+{
+    const char *info = NULL;
+    char *org;
+    size_t n;
+
+    if (len == 0)
+        return (-1);
+
+    org = geoip_addr_callback(ptr, addr, lit, &info);
+    if (info == NULL) {
+        free(org);
+        return (0);
+    }
+
+    if ((n = strlcpy(buf, info, len)) >= len)
+        n = len - 1;
+    free(org);
+
+    return ((int)n);
+}
+
+int
+geoip_memory_callback(void *ptr, void **addr, size_t *len)
+{
+    GeoIP *gi = (GeoIP *)ptr;
+
+    /* GEOIP_STANDARD reads from the file */
+    if (gi == NULL || gi->cache == NULL)
+        return (-1);
+
+    *addr = gi->cache;
+    *len = (size_t)gi->size;
+
+    return (0);
 }
 
 void
@@ -71,7 +236,12 @@ struct backend geoip_backend = {
     .name       = "geoip",
     .gl_bic     = geoip_init_callback,
     .gl_blic    = geoip_lookup_init_callback,
+    .gl_blcc    = geoip_lookup_cleanup_callback,
     .gl_bsc     = geoip_shutdown_callback,
+    .gl_bmc     = geoip_memory_callback,
+    .gl_brc     = geoip_range_callback,
+    .gl_bac     = geoip_addr_callback,
+    .gl_bvc     = geoip_value_callback,
     .ipv6capable= 1
 };
 #endif
@@ -21,9 +21,14 @@
 
 #include <geoloc.h>
 
-void *geoip_init_callback(const char *);
+void *geoip_init_callback(const char *, enum cache_mode);
 void *geoip_lookup_init_callback(void *, const char *, enum lookup_info_type, const char **);
+void geoip_lookup_cleanup_callback(void *, void *);
+void *geoip_range_callback(void *, const struct geoloc_addr *, enum lookup_info_type, const char **, struct geoloc_addr *);
+void *geoip_addr_callback(void *, const struct geoloc_addr *, enum lookup_info_type, const char **);
+int geoip_value_callback(void *, const struct geoloc_addr *, enum lookup_info_type, char *, size_t);
 void geoip_shutdown_callback(void *);
+int geoip_memory_callback(void *, void **, size_t *);
 
 struct backend geoip_backend;
 
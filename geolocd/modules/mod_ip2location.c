@@ -18,21 +18,54 @@
 
 #ifdef	GEOLOC_IP2LOCATION
 #include <IP2Location.h>
+#ifdef  HAVE_NO_BSDFUNCS
+#include <bsd/string.h>
+#endif
 
 #include "mod_ip2location.h"
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+/*
+ * Lookup reference, the record with the
+ * coordinates formatted as a single value
+ */
+struct ip2location_ref {
+    IP2LocationRecord *rec;
+    char coords[32];
+};
+
 void *
-ip2location_init_callback(const char *datafile)
+ip2location_init_callback(const char *datafile, enum cache_mode cache)
 {
     IP2Location *il = NULL;
+    enum IP2Location_lookup_mode mode;
     char *datafile_ = strdup(datafile);
     if (datafile == NULL)
         return (NULL);
+
+    switch (cache) {
+    case CACHE_STANDARD:
+        mode = IP2LOCATION_FILE_IO;
+        break;
+    case CACHE_MMAP:
+        log_info("ip2location: no mmap cache, shared memory used instead");
+        /* FALLTHROUGH */
+    case CACHE_SHARED:
+        mode = IP2LOCATION_SHARED_MEMORY;
+        break;
+    case CACHE_DEFAULT:
+    case CACHE_MEMORY:
+    default:
+        mode = IP2LOCATION_CACHE_MEMORY;
+        break;
+    }
+
     il = IP2Location_open(datafile_);
     free(datafile_);
-    if (il != NULL) {
-        if (IP2Location_open_mem(il, IP2LOCATION_CACHE_MEMORY) != 0) {
+    if (il != NULL && mode != IP2LOCATION_FILE_IO) {
+        if (IP2Location_open_mem(il, mode) != 0) {
             IP2Location_close(il);
             return (NULL);
         }
@@ -47,12 +80,17 @@ ip2location_lookup_init_callback(void *ptr, const char *addr,
 {
     IP2Location *il = (IP2Location *)ptr;
     IP2LocationRecord *rec = NULL;
+    struct ip2location_ref *ref = NULL;
     char *addr_ = NULL;
 
     if (il != NULL && addr != NULL && info != NULL) {
         addr_ = strdup(addr);
         if (addr_ == NULL)
             return (NULL);
+        if ((ref = calloc(1, sizeof(*ref))) == NULL) {
+            free(addr_);
+            return (NULL);
+        }
         if ((rec = IP2Location_get_all(il, addr_)) != NULL) {
             switch(lit) {
             case GEOLOC_COUNTRY:
@@ -67,6 +105,14 @@ ip2location_lookup_init_callback(void *ptr, const char *addr,
             case GEOLOC_MCC:
                 *info = rec->mcc;
                 break;
+            case GEOLOC_CITY:
+                *info = rec->city;
+                break;
+            case GEOLOC_COORDS:
+                snprintf(ref->coords, sizeof(ref->coords), "%.6f %.6f",
+                    rec->latitude, rec->longitude);
+                *info = ref->coords;
+                break;
             default:
                 log_warn("wrong lookup info type");
             }
@@ -74,17 +120,90 @@ ip2location_lookup_init_callback(void *ptr, const char *addr,
         }
 
         free(addr_);
+        if (rec == NULL) {
+            free(ref);
+            return (NULL);
+        }
+        ref->rec = rec;
     }
 
-    return (rec);
+    return (ref);
 }
 
-void
-ip2location_lookup_cleanup_callback(void *arg, void *ptr)
+/*
+ * Lookup decoding the asked field only, through the per field
+ * IP2Location functions, copied to the caller buffer. No record
+ * is kept, the ones IP2Location allocates are freed right away.
+ */
+int
+ip2location_value_callback(void *ptr, const struct geoloc_addr *addr,
+                           enum lookup_info_type lit, char *buf, size_t len)
 {
-    IP2LocationRecord *rec = (IP2LocationRecord *)ptr;
+    IP2Location *il = (IP2Location *)ptr;
+    IP2LocationRecord *rec = NULL, *lon = NULL;
+    const char *info = NULL;
+    char key[GEOLOC_ADDR_MAX];
+    size_t n = 0;
+
+    if (il == NULL || len == 0)
+        return (-1);
+
+    addr_format(addr, key, sizeof(key));
+
+    switch(lit) {
+    case GEOLOC_COUNTRY:
+        if ((rec = IP2Location_get_country_short(il, key)) != NULL)
+            info = rec->country_short;
+        break;
+    case GEOLOC_ISP:
+        if ((rec = IP2Location_get_isp(il, key)) != NULL)
+            info = rec->isp;
+        break;
+    case GEOLOC_MNC:
+        if ((rec = IP2Location_get_mnc(il, key)) != NULL)
+            info = rec->mnc;
+        break;
+    case GEOLOC_MCC:
+        if ((rec = IP2Location_get_mcc(il, key)) != NULL)
+            info = rec->mcc;
+        break;
+    case GEOLOC_CITY:
+        if ((rec = IP2Location_get_city(il, key)) != NULL)
+            info = rec->city;
+        break;
+    case GEOLOC_COORDS:
+        if ((rec = IP2Location_get_latitude(il, key)) != NULL &&
+            (lon = IP2Location_get_longitude(il, key)) != NULL) {
+            n = snprintf(buf, len, "%.6f %.6f", rec->latitude,
+                lon->longitude);
+            if (n >= len)
+                n = len - 1;
+        }
+        break;
+    default:
+        log_warn("wrong lookup info type");
+        return (-1);
+    }
+
+    if (info != NULL && (n = strlcpy(buf, info, len)) >= len)
+        n = len - 1;
+
     if (rec != NULL)
         IP2Location_free_record(rec);
+    if (lon != NULL)
+        IP2Location_free_record(lon);
+
+    return ((int)n);
+}
+
+void
+ip2location_lookup_cleanup_callback(void *arg, void *ptr)
+{
+    struct ip2location_ref *ref = (struct ip2location_ref *)ptr;
+    if (ref != NULL) {
+        IP2Location_free_record(ref->rec);
+        free(ref);
+    }
 }
 
 void
@@ -103,6 +222,7 @@ struct backend ip2location_backend = {
     .gl_blic    = ip2location_lookup_init_callback,
     .gl_blcc    = ip2location_lookup_cleanup_callback,
     .gl_bsc     = ip2location_shutdown_callback,
+    .gl_bvc     = ip2location_value_callback,
     .ipv6capable= 1
 };
 #endif
@@ -21,9 +21,10 @@
 
 #include <geolocd.h>
 
-void *ip2location_init_callback(const char *);
+void *ip2location_init_callback(const char *, enum cache_mode);
 void *ip2location_lookup_init_callback(void *, const char *, enum lookup_info_type, const char **);
 void ip2location_lookup_cleanup_callback(void *, void *);
+int ip2location_value_callback(void *, const struct geoloc_addr *, enum lookup_info_type, char *, size_t);
 void ip2location_shutdown_callback(void *);
 
 struct backend ip2location_backend;
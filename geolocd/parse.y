@@ -22,6 +22,7 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -39,6 +40,10 @@
 #include <stdlib.h>
 
 #include "geoloc.h"
+#include "session.h"
+#include "trace.h"
+#include "hotset.h"
+#include "analytics.h"
 
 TAILQ_HEAD(files, file)		 files = TAILQ_HEAD_INITIALIZER(files);
 static struct file {
@@ -86,16 +91,31 @@ typedef struct {
 
 %}
 
-%token	BACKEND DATAFILE
+%token	BACKEND CACHE DATAFILE HUGEPAGES INDEX INET6 MLOCK PLUGIN PREFAULT TABLE
+%token	BULK CONNECTION CONNECTIONS DEADLINE GLOBAL INTERACTIVE QUEUE
+%token	LISTEN ON PORT POP SLOWLOG CAPTURE COMPACT HOTSET INTERVAL BUDGET
+%token	SOCKET ANALYTICS WINDOW NUMA NODE LOWLATENCY CPU BUILD
 %token	ERROR
 %token	<v.string>	STRING
 %token	<v.number>	NUMBER
+%type	<v.number>	yesno inet6 compact connclass field port
 %%
 
 grammar		: /* empty */
 		| grammar '\n'
 		| grammar conf_backend '\n'
 		| grammar conf_datafile '\n'
+		| grammar conf_plugin '\n'
+		| grammar conf_cache '\n'
+		| grammar conf_residency '\n'
+		| grammar conf_index '\n'
+		| grammar conf_admission '\n'
+		| grammar conf_listen '\n'
+		| grammar conf_pop '\n'
+		| grammar conf_capture '\n'
+		| grammar conf_hotset '\n'
+		| grammar conf_socket '\n'
+		| grammar conf_analytics '\n'
 		| grammar varset '\n'
 		| grammar error '\n'		{ file->errors++; }
 		;
@@ -133,6 +153,281 @@ conf_datafile	: DATAFILE STRING {
 			conf->datafile = strdup($2);
 			free($2);
 }
+
+conf_plugin	: PLUGIN STRING {
+			if (conf->nplugins == GEOLOC_PLUGINS_MAX) {
+				yyerror("too many plugins");
+				free($2);
+				YYERROR;
+			}
+
+			conf->plugins[conf->nplugins++] = $2;
+		}
+		;
+
+yesno		: STRING {
+			if (!strcmp($1, "yes"))
+				$$ = 1;
+			else if (!strcmp($1, "no"))
+				$$ = 0;
+			else {
+				yyerror("syntax error, "
+				    "either yes or no expected");
+				free($1);
+				YYERROR;
+			}
+			free($1);
+		}
+		;
+
+conf_cache	: CACHE STRING {
+			if (!strcmp($2, "standard"))
+				conf->cache = CACHE_STANDARD;
+			else if (!strcmp($2, "memory"))
+				conf->cache = CACHE_MEMORY;
+			else if (!strcmp($2, "mmap"))
+				conf->cache = CACHE_MMAP;
+			else if (!strcmp($2, "shared"))
+				conf->cache = CACHE_SHARED;
+			else {
+				yyerror("unknown cache mode %s", $2);
+				free($2);
+				YYERROR;
+			}
+			free($2);
+		}
+		;
+
+inet6		: /* empty */	{ $$ = 0; }
+		| INET6		{ $$ = 1; }
+		;
+
+compact		: /* empty */	{ $$ = 0; }
+		| COMPACT	{ $$ = 1; }
+		;
+
+field		: STRING {
+			if (!strcmp($1, "ccode"))
+				$$ = GEOLOC_COUNTRY;
+			else if (!strcmp($1, "isp"))
+				$$ = GEOLOC_ISP;
+			else if (!strcmp($1, "mnc"))
+				$$ = GEOLOC_MNC;
+			else if (!strcmp($1, "mcc"))
+				$$ = GEOLOC_MCC;
+			else if (!strcmp($1, "city"))
+				$$ = GEOLOC_CITY;
+			else if (!strcmp($1, "coords"))
+				$$ = GEOLOC_COORDS;
+			else {
+				yyerror("unknown field %s", $1);
+				free($1);
+				YYERROR;
+			}
+			free($1);
+		}
+		;
+
+conf_index	: INDEX field inet6 {
+			conf->indexes |= (1U << $2);
+			if ($3)
+				conf->indexes6 |= (1U << $2);
+		}
+		| TABLE field inet6 compact {
+			conf->tables |= (1U << $2);
+			if ($3)
+				conf->tables6 |= (1U << $2);
+			if ($4)
+				conf->tables_compact |= (1U << $2);
+		}
+		;
+
+conf_residency	: PREFAULT yesno	{ conf->prefault = $2; }
+		| MLOCK yesno		{ conf->mlock = $2; }
+		| HUGEPAGES yesno	{ conf->hugepages = $2; }
+		| NUMA NODE NUMBER {
+			if ($3 < 0 || $3 > 1023) {
+				yyerror("invalid numa node");
+				YYERROR;
+			}
+			conf->numa_node = $3;
+		}
+		| LOWLATENCY yesno	{ conf->lowlatency = $2; }
+		| CPU NUMBER {
+			if ($2 < 0 || $2 > 1023) {
+				yyerror("invalid cpu");
+				YYERROR;
+			}
+			conf->cpu = $2;
+		}
+		| BUILD CPU NUMBER {
+			if ($3 < 0 || $3 > 1023) {
+				yyerror("invalid build cpu");
+				YYERROR;
+			}
+			conf->build_cpu = $3;
+		}
+		;
+
+port		: /* empty */	{ $$ = GEOLOCD_PORT; }
+		| PORT NUMBER {
+			if ($2 <= 0 || $2 > 65535) {
+				yyerror("invalid port");
+				YYERROR;
+			}
+			$$ = $2;
+		}
+		;
+
+conf_listen	: LISTEN ON STRING port {
+			if (conf->listen != NULL) {
+				yyerror("listen already set");
+				free($3);
+				YYERROR;
+			}
+
+			conf->listen = $3;
+			conf->port = $4;
+		}
+		;
+
+conf_pop	: POP STRING STRING {
+			struct geoloc_pop	*pops;
+			double			 lat, lon;
+			char			*end;
+
+			lat = strtod($3, &end);
+			if (end != $3)
+				lon = strtod(end, &end);
+			if (end == $3 || *end != '\0' ||
+			    !(lat >= -90.0 && lat <= 90.0) ||
+			    !(lon >= -180.0 && lon <= 180.0)) {
+				yyerror("invalid coordinates %s", $3);
+				free($2);
+				free($3);
+				YYERROR;
+			}
+			free($3);
+
+			if ((pops = reallocarray(conf->pops, conf->npops + 1,
+			    sizeof(*pops))) == NULL) {
+				yyerror("cannot store the pop");
+				free($2);
+				YYERROR;
+			}
+			conf->pops = pops;
+			pops[conf->npops].name = $2;
+			pops[conf->npops].lat = lat;
+			pops[conf->npops].lon = lon;
+			conf->npops++;
+		}
+		;
+
+conf_capture	: CAPTURE STRING {
+			if (conf->capture != NULL) {
+				yyerror("capture already set");
+				free($2);
+				YYERROR;
+			}
+
+			conf->capture = $2;
+		}
+		;
+
+conf_hotset	: HOTSET STRING {
+			if (conf->hotset != NULL) {
+				yyerror("hotset already set");
+				free($2);
+				YYERROR;
+			}
+
+			conf->hotset = $2;
+		}
+		| HOTSET INTERVAL NUMBER {
+			if ($3 <= 0 || $3 > INT_MAX) {
+				yyerror("invalid hotset interval");
+				YYERROR;
+			}
+			conf->hotset_interval = $3;
+		}
+		| HOTSET BUDGET NUMBER {
+			if ($3 < 0 || $3 > INT_MAX) {
+				yyerror("invalid hotset budget");
+				YYERROR;
+			}
+			conf->hotset_budget = $3;
+		}
+		;
+
+conf_analytics	: ANALYTICS {
+			conf->analytics = 1;
+		}
+		| ANALYTICS WINDOW NUMBER {
+			if ($3 < ANALYTICS_SLOTS || $3 > INT_MAX) {
+				yyerror("invalid analytics window");
+				YYERROR;
+			}
+			conf->analytics = 1;
+			conf->analytics_window = $3;
+		}
+		;
+
+conf_socket	: SOCKET STRING {
+			if (conf->socket != NULL) {
+				yyerror("socket already set");
+				free($2);
+				YYERROR;
+			}
+			if (strlen($2) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+				yyerror("socket path too long");
+				free($2);
+				YYERROR;
+			}
+
+			conf->socket = $2;
+		}
+		;
+
+connclass	: INTERACTIVE		{ $$ = CLASS_INTERACTIVE; }
+		| BULK			{ $$ = CLASS_BULK; }
+		;
+
+conf_admission	: CONNECTIONS NUMBER {
+			if ($2 <= 0 || $2 > INT_MAX) {
+				yyerror("invalid connections limit");
+				YYERROR;
+			}
+			conf->conn_max = $2;
+		}
+		| QUEUE CONNECTION NUMBER {
+			if ($3 <= 0 || $3 > INT_MAX) {
+				yyerror("invalid connection queue size");
+				YYERROR;
+			}
+			conf->queue_conn = $3;
+		}
+		| QUEUE GLOBAL NUMBER {
+			if ($3 <= 0 || $3 > INT_MAX) {
+				yyerror("invalid global queue size");
+				YYERROR;
+			}
+			conf->queue_global = $3;
+		}
+		| SLOWLOG NUMBER {
+			if ($2 < 0 || $2 > INT_MAX) {
+				yyerror("invalid slow requests threshold");
+				YYERROR;
+			}
+			conf->slowlog = $2;
+		}
+		| DEADLINE connclass NUMBER {
+			if ($3 <= 0 || $3 > INT_MAX) {
+				yyerror("invalid deadline");
+				YYERROR;
+			}
+			conf->deadline[$2] = $3;
+		}
+		;
 %%
 
 struct keywords {
@@ -166,8 +461,41 @@ int
 lookup(char *s)
 {
 	static const struct keywords keywords[] = {
+		{ "analytics",		ANALYTICS},
 		{ "backend",		BACKEND},
+		{ "budget",		BUDGET},
+		{ "build",		BUILD},
+		{ "bulk",		BULK},
+		{ "cache",		CACHE},
+		{ "capture",		CAPTURE},
+		{ "compact",		COMPACT},
+		{ "connection",		CONNECTION},
+		{ "connections",	CONNECTIONS},
+		{ "cpu",		CPU},
 		{ "datafile",		DATAFILE},
+		{ "deadline",		DEADLINE},
+		{ "global",		GLOBAL},
+		{ "hotset",		HOTSET},
+		{ "hugepages",		HUGEPAGES},
+		{ "index",		INDEX},
+		{ "inet6",		INET6},
+		{ "interactive",	INTERACTIVE},
+		{ "interval",		INTERVAL},
+		{ "listen",		LISTEN},
+		{ "lowlatency",		LOWLATENCY},
+		{ "mlock",		MLOCK},
+		{ "node",		NODE},
+		{ "numa",		NUMA},
+		{ "on",			ON},
+		{ "plugin",		PLUGIN},
+		{ "pop",		POP},
+		{ "port",		PORT},
+		{ "prefault",		PREFAULT},
+		{ "queue",		QUEUE},
+		{ "slowlog",		SLOWLOG},
+		{ "socket",		SOCKET},
+		{ "table",		TABLE},
+		{ "window",		WINDOW},
 	};
 	const struct keywords	*p;
 
@@ -498,6 +826,19 @@ parse_config(const char *filename)
 		return (NULL);
 	}
 
+	conf->conn_max = SESSION_CONNS_MAX;
+	conf->queue_conn = SESSION_QUEUE_CONN;
+	conf->queue_global = SESSION_QUEUE_GLOBAL;
+	conf->deadline[CLASS_INTERACTIVE] = SESSION_DEADLINE_INTERACTIVE;
+	conf->deadline[CLASS_BULK] = SESSION_DEADLINE_BULK;
+	conf->slowlog = TRACE_SLOWLOG_THRESHOLD;
+	conf->hotset_interval = HOTSET_INTERVAL;
+	conf->hotset_budget = HOTSET_BUDGET;
+	conf->analytics_window = ANALYTICS_WINDOW;
+	conf->numa_node = -1;
+	conf->cpu = -1;
+	conf->build_cpu = -1;
+
 	if ((file = pushfile(filename, 0)) == NULL) {
 		free(conf);
 		return (NULL);
@@ -538,6 +879,24 @@ clear_config(struct geolocd_conf *xconf)
 	if (xconf->datafile != NULL)
 		free(xconf->datafile);
 
+	if (xconf->listen != NULL)
+		free(xconf->listen);
+
+	if (xconf->capture != NULL)
+		free(xconf->capture);
+
+	if (xconf->hotset != NULL)
+		free(xconf->hotset);
+	if (xconf->socket != NULL)
+		free(xconf->socket);
+
+	while (xconf->npops > 0)
+		free(xconf->pops[--xconf->npops].name);
+	free(xconf->pops);
+
+	while (xconf->nplugins > 0)
+		free(xconf->plugins[--xconf->nplugins]);
+
 	free(conf);
 }
 
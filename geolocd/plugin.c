@@ -0,0 +1,109 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <dlfcn.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "plugin.h"
+
+/*
+ * Loads a backend plugin, to be done before the chroot
+ */
+struct backend *
+plugin_load(const char *path)
+{
+    const struct geoloc_plugin  *sym;
+    struct geoloc_plugin        p;
+    struct backend              *b;
+    void                        *dl;
+
+    if ((dl = dlopen(path, RTLD_NOW|RTLD_LOCAL)) == NULL) {
+        log_warnx("plugin %s: %s", path, dlerror());
+        return (NULL);
+    }
+
+    if ((sym = dlsym(dl, GEOLOC_PLUGIN_SYMBOL)) == NULL) {
+        log_warnx("plugin %s: no %s symbol", path, GEOLOC_PLUGIN_SYMBOL);
+        goto fail;
+    }
+
+    if ((sym->abi_version >> 16) != GEOLOC_PLUGIN_ABI_MAJOR ||
+        sym->size < GEOLOC_PLUGIN_SIZE_1_0) {
+        log_warnx("plugin %s: ABI %u.%u, %u.%u expected", path,
+            sym->abi_version >> 16, sym->abi_version & 0xffff,
+            GEOLOC_PLUGIN_ABI_MAJOR, GEOLOC_PLUGIN_ABI_MINOR);
+        goto fail;
+    }
+
+    /* members of a newer minor version are not known here */
+    bzero(&p, sizeof(p));
+    memcpy(&p, sym, (sym->size < sizeof(p) ? sym->size : sizeof(p)));
+
+    if (p.name == NULL || p.init == NULL || p.lookup == NULL ||
+        p.cleanup == NULL || p.shutdown == NULL) {
+        log_warnx("plugin %s: mandatory callbacks missing", path);
+        goto fail;
+    }
+
+    if ((b = calloc(1, sizeof(*b))) == NULL) {
+        log_warn("plugin_load");
+        goto fail;
+    }
+
+    b->name = p.name;
+    b->gl_bic = p.init;
+    b->gl_blic = p.lookup;
+    b->gl_blcc = p.cleanup;
+    b->gl_bsc = p.shutdown;
+    b->gl_bmc = p.memory;
+    b->gl_brc = p.range;
+    b->gl_bac = p.addr;
+    b->gl_bbc = p.batch;
+    b->gl_bfc = p.fields;
+    b->gl_bvc = p.value;
+    b->ipv6capable = (p.flags & GEOLOC_PLUGIN_IPV6) != 0;
+    b->threadsafe = (p.flags & GEOLOC_PLUGIN_THREADSAFE) != 0;
+    b->dl = dl;
+
+    log_info("%s plugin backend added, ABI %u.%u%s%s%s%s%s", b->name,
+        p.abi_version >> 16, p.abi_version & 0xffff,
+        (b->gl_bbc != NULL ? ", batch" : ""),
+        (b->gl_bac != NULL ? ", binary" : ""),
+        (b->gl_bfc != NULL ? ", fields" : ""),
+        (b->gl_bvc != NULL ? ", value" : ""),
+        (b->threadsafe ? ", thread safe" : ""));
+
+    return (b);
+
+fail:
+    dlclose(dl);
+    return (NULL);
+}
+
+void
+plugin_unload(struct backend *b)
+{
+    if (b == NULL || b->dl == NULL)
+        return;
+
+    dlclose(b->dl);
+    free(b);
+}
@@ -0,0 +1,90 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GEOLOC_PLUGIN_H_
+#define _GEOLOC_PLUGIN_H_           1
+
+#include <stddef.h>
+
+#include "geoloc.h"
+
+/*
+ * Backend plugin ABI. A plugin is a shared object exporting a
+ * struct geoloc_plugin under GEOLOC_PLUGIN_SYMBOL, loaded with the
+ * plugin directive. The major version has to match the daemon one,
+ * minor versions only append members, size telling how many the
+ * plugin knows about.
+ */
+#define GEOLOC_PLUGIN_ABI_MAJOR     1
+#define GEOLOC_PLUGIN_ABI_MINOR     1
+#define GEOLOC_PLUGIN_ABI_VERSION   \
+    ((GEOLOC_PLUGIN_ABI_MAJOR << 16) | GEOLOC_PLUGIN_ABI_MINOR)
+#define GEOLOC_PLUGIN_SYMBOL        "geoloc_plugin"
+
+/* capabilities */
+#define GEOLOC_PLUGIN_IPV6          0x0001
+#define GEOLOC_PLUGIN_THREADSAFE    0x0002
+
+/*
+ * The text lookup, init, cleanup and shutdown callbacks are
+ * mandatory, the others are used when set:
+ * - memory: the in memory data region, for residency and reports
+ * - range: lookup giving the last address sharing the data,
+ *   for enumerations and indexes
+ * - addr: lookup of an already parsed address
+ * - batch: lookups of count parsed addresses for one field,
+ *   each info with its cleanup reference
+ * - fields: lookups of several fields for one parsed address
+ * - value (1.1): lookup of a parsed address decoding the field only,
+ *   copied NUL terminated to the caller buffer, returning its length,
+ *   0 when there is none, -1 to fall back to the other lookups
+ * Fields a plugin does not know about are answered with a NULL info.
+ * Parsed addresses are 16 bytes, IPv4 ones being IPv4-mapped. The
+ * batch and fields callbacks return -1 with nothing to clean up on
+ * failure, the lookups are then done one by one.
+ */
+struct geoloc_plugin {
+    uint32_t                        abi_version;
+    uint32_t                        size;
+    const char                      *name;
+    uint32_t                        flags;
+
+    backend_init_callback           init;
+    backend_lookup_init_callback    lookup;
+    backend_lookup_cleanup_callback cleanup;
+    backend_shutdown_callback       shutdown;
+    backend_memory_callback         memory;
+    backend_range_callback          range;
+    backend_addr_callback           addr;
+    backend_batch_callback          batch;
+    backend_fields_callback         fields;
+    /* 1.1 */
+    backend_value_callback          value;
+};
+
+/* size of the ABI 1.0 struct, the oldest one accepted */
+#define GEOLOC_PLUGIN_SIZE_1_0      \
+    (offsetof(struct geoloc_plugin, fields) + sizeof(backend_fields_callback))
+
+#define GEOLOC_PLUGIN_INIT(_name, _flags)           \
+    .abi_version    = GEOLOC_PLUGIN_ABI_VERSION,    \
+    .size           = sizeof(struct geoloc_plugin), \
+    .name           = (_name),                      \
+    .flags          = (_flags)
+
+#endif
@@ -0,0 +1,151 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "reply.h"
+#include "session.h"
+
+/*
+ * The vectors come from the arena, valid for the round
+ */
+int
+reply_init(struct reply *r, struct arena *a, struct backend *b, size_t n)
+{
+    bzero(r, sizeof(*r));
+    r->backend = b;
+    r->iovsz = n + 1;
+
+    if ((r->iov = arena_alloc(a, r->iovsz * sizeof(struct iovec))) == NULL ||
+        (r->refs = arena_alloc(a, n * sizeof(void *))) == NULL) {
+        log_warn("reply_init");
+        r->iov = NULL;
+        return (-1);
+    }
+
+    r->iov[0].iov_base = &r->hdr;
+    r->iov[0].iov_len = sizeof(r->hdr);
+    r->niov = 1;
+    r->hdr.status = MSG_STATUS_OK;
+
+    return (0);
+}
+
+/*
+ * Appends the string to the reply, ref being the backend lookup
+ * data to release once sent
+ */
+int
+reply_add(struct reply *r, const char *info, void *ref)
+{
+    size_t  len;
+
+    if (r->niov == r->iovsz)
+        return (-1);
+
+    if (info == NULL)
+        info = "";
+    len = strlen(info) + 1;
+
+    r->iov[r->niov].iov_base = (void *)info;
+    r->iov[r->niov].iov_len = len;
+    r->niov++;
+    r->hdr.count++;
+    r->hdr.len += len;
+
+    if (ref != NULL)
+        r->refs[r->nrefs++] = ref;
+
+    return (0);
+}
+
+int
+reply_flush(struct reply *r, int fd)
+{
+    return (session_send(fd, r->iov, r->niov));
+}
+
+void
+reply_free(struct reply *r)
+{
+    size_t  i;
+
+    if (r->backend != NULL && r->backend->gl_blcc != NULL)
+        for (i = 0; i < r->nrefs; i++)
+            r->backend->gl_blcc(r->backend->handler, r->refs[i]);
+
+    bzero(r, sizeof(*r));
+}
+
+/*
+ * Plain string reply, for the requests predating the vectored ones
+ */
+int
+reply_string(int fd, const char *info)
+{
+    struct iovec    iov;
+
+    iov.iov_base = (void *)info;
+    iov.iov_len = strlen(info) + 1;
+
+    return (session_send(fd, &iov, 1));
+}
+
+/*
+ * Header only reply, for requests failing before any lookup
+ */
+int
+reply_status(int fd, enum msg_status status)
+{
+    struct msg_ctl_res  hdr;
+    struct iovec        iov;
+
+    bzero(&hdr, sizeof(hdr));
+    hdr.status = status;
+    iov.iov_base = &hdr;
+    iov.iov_len = sizeof(hdr);
+
+    return (session_send(fd, &iov, 1));
+}
+
+/*
+ * One frame of a streamed reply, count strings already
+ * laid out in buf. An empty frame ends the stream.
+ */
+int
+reply_chunk(int fd, const char *buf, size_t len, uint32_t count)
+{
+    struct msg_ctl_res  hdr;
+    struct iovec        iov[2];
+
+    bzero(&hdr, sizeof(hdr));
+    hdr.status = MSG_STATUS_OK;
+    hdr.count = count;
+    hdr.len = (uint32_t)len;
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = len;
+
+    return (session_send(fd, iov, 2));
+}
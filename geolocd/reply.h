@@ -0,0 +1,51 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GEOLOC_REPLY_H_
+#define _GEOLOC_REPLY_H_            1
+
+#include <sys/uio.h>
+
+#include "arena.h"
+#include "geoloc.h"
+
+/*
+ * Vectored reply: a msg_ctl_res header followed by the strings
+ * as returned by the backend, no copy involved. The backend
+ * lookup data are kept until the reply is sent, the vectors
+ * until the arena they come from is reset.
+ */
+struct reply {
+    struct msg_ctl_res  hdr;
+    struct backend      *backend;
+    struct iovec        *iov;
+    size_t              niov;
+    size_t              iovsz;
+    void                **refs;
+    size_t              nrefs;
+};
+
+int reply_init(struct reply *, struct arena *, struct backend *, size_t);
+int reply_add(struct reply *, const char *, void *);
+int reply_flush(struct reply *, int);
+void reply_free(struct reply *);
+int reply_string(int, const char *);
+int reply_status(int, enum msg_status);
+int reply_chunk(int, const char *, size_t, uint32_t);
+
+#endif
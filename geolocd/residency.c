@@ -0,0 +1,296 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+/* cpu_set_t and sched_setaffinity */
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef HAVE_LIBNUMA
+#include <numa.h>
+#endif
+
+#include "geoloc.h"
+
+/* stack grown and locked for the serving thread in low latency mode */
+#define RESIDENCY_STACK     (256 * 1024)
+
+#ifdef __linux__
+/* CPUs allowed before pinning, the serving one left to the workers */
+static cpu_set_t    cpus;
+#endif
+static int          servecpu = -1;
+
+/*
+ * Keeps the backend data resident before the privileges are dropped:
+ * huge pages hint, pre-faulting then locking. When the backend does not
+ * tell where its data live, the whole address space is locked instead.
+ */
+void
+residency_apply(struct backend *b, void *handler, struct geolocd_conf *xconf)
+{
+    struct rusage       ru;
+    struct timeval      start, end;
+    void                *addr = NULL;
+    size_t              len = 0, pgsz, off;
+    uintptr_t           base;
+    volatile const char *p;
+    char                sum = 0;
+
+    if (b->gl_bmc == NULL || b->gl_bmc(handler, &addr, &len) == -1 ||
+        addr == NULL || len == 0) {
+        addr = NULL;
+        len = 0;
+    }
+
+    pgsz = (size_t)sysconf(_SC_PAGESIZE);
+    gettimeofday(&start, NULL);
+
+    if (addr != NULL) {
+        /* madvise and mlock want page aligned regions */
+        base = (uintptr_t)addr & ~(uintptr_t)(pgsz - 1);
+        len += (uintptr_t)addr - base;
+        addr = (void *)base;
+
+        if (xconf->hugepages) {
+#ifdef MADV_HUGEPAGE
+            if (madvise(addr, len, MADV_HUGEPAGE) == -1)
+                log_warn("residency: madvise hugepage");
+#else
+            log_warnx("residency: no transparent huge pages support");
+#endif
+        }
+
+        if (xconf->prefault) {
+            if (madvise(addr, len, MADV_WILLNEED) == -1)
+                log_warn("residency: madvise willneed");
+            p = addr;
+            for (off = 0; off < len; off += pgsz)
+                sum += p[off];
+            (void)sum;
+        }
+
+        if (xconf->mlock && mlock(addr, len) == -1)
+            log_warn("residency: mlock");
+    } else {
+        if (xconf->hugepages || xconf->prefault)
+            log_warnx("residency: '%s' backend data region unknown", b->name);
+        if (xconf->mlock && mlockall(MCL_CURRENT) == -1)
+            log_warn("residency: mlockall");
+    }
+
+    gettimeofday(&end, NULL);
+    timersub(&end, &start, &end);
+
+    bzero(&ru, sizeof(ru));
+    getrusage(RUSAGE_SELF, &ru);
+
+    log_info("backend data %zu bytes%s%s%s in %lld.%06ld s, max rss %ld kB",
+        len, (xconf->prefault ? ", prefaulted" : ""),
+        (xconf->mlock ? ", locked" : ""),
+        (xconf->hugepages ? ", huge pages" : ""),
+        (long long)end.tv_sec, (long)end.tv_usec, ru.ru_maxrss);
+}
+
+/*
+ * Runs the daemon on the CPUs of the NUMA node, its memory coming
+ * from the node first. Done before the backend data are loaded and
+ * before any thread starts, the threads inheriting the policy, so
+ * the data, the tables and the request memory are all node local.
+ */
+int
+residency_numa(int node)
+{
+#ifdef HAVE_LIBNUMA
+    if (numa_available() == -1 || numa_max_node() == 0) {
+        log_info("numa: single node, nothing to bind");
+        return (0);
+    }
+
+    if (node > numa_max_node()) {
+        log_warnx("numa: no node %d, %d nodes", node, numa_max_node() + 1);
+        return (-1);
+    }
+
+    if (numa_run_on_node(node) == -1) {
+        log_warn("numa: run on node %d", node);
+        return (-1);
+    }
+    /* preferred rather than bound, a full node not failing allocations */
+    numa_set_preferred(node);
+
+    log_info("numa: bound to node %d of %d", node, numa_max_node() + 1);
+
+    return (0);
+#else
+    log_warnx("numa: no NUMA support, node %d ignored", node);
+
+    return (-1);
+#endif
+}
+
+/*
+ * Node the page of addr resides on, -1 when unknown
+ */
+int
+residency_node(const void *addr)
+{
+#ifdef HAVE_LIBNUMA
+    void    *page;
+    int     status = -1;
+
+    if (addr == NULL || numa_available() == -1)
+        return (-1);
+
+    page = (void *)((uintptr_t)addr &
+        ~(uintptr_t)(sysconf(_SC_PAGESIZE) - 1));
+    if (numa_move_pages(0, 1, &page, NULL, &status, 0) == -1 || status < 0)
+        return (-1);
+
+    return (status);
+#else
+    (void)addr;
+
+    return (-1);
+#endif
+}
+
+/*
+ * Pins the serving thread to cpu, before any thread starts,
+ * after the NUMA binding which then limits the CPUs allowed
+ */
+int
+residency_pin(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t   set;
+
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) == -1) {
+        log_warn("cpu: affinity");
+        return (-1);
+    }
+
+    if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &cpus)) {
+        log_warnx("cpu: cpu %d not allowed", cpu);
+        return (-1);
+    }
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        log_warn("cpu: pin to cpu %d", cpu);
+        return (-1);
+    }
+    servecpu = cpu;
+
+    log_info("cpu: serving on cpu %d", cpu);
+
+    return (0);
+#else
+    log_warnx("cpu: no CPU affinity support, cpu %d ignored", cpu);
+
+    return (-1);
+#endif
+}
+
+/*
+ * Pins the calling worker thread to cpu or, when -1, keeps it off
+ * the serving CPU it inherited the affinity of
+ */
+int
+residency_worker(int cpu)
+{
+#ifdef __linux__
+    cpu_set_t   set;
+
+    if (cpu != -1) {
+        if (cpu >= CPU_SETSIZE) {
+            log_warnx("cpu: cpu %d not allowed", cpu);
+            return (-1);
+        }
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+    } else if (servecpu != -1) {
+        set = cpus;
+        CPU_CLR(servecpu, &set);
+        /* a single CPU allowed, shared then */
+        if (CPU_COUNT(&set) == 0)
+            return (0);
+    } else
+        return (0);
+
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+        log_warn("cpu: worker affinity");
+        return (-1);
+    }
+
+    return (0);
+#else
+    return (cpu == -1 ? 0 : -1);
+#endif
+}
+
+/*
+ * Low latency mode, set before the privileges are dropped: the
+ * memory mapped from now on is locked and faulted in when mapped,
+ * the serving stack is grown beforehand, and the allocator keeps
+ * the memory freed, serving requests then neither faulting nor
+ * asking the kernel for memory
+ */
+int
+residency_lowlatency(void)
+{
+    struct rlimit   rl;
+    volatile char   stack[RESIDENCY_STACK];
+    size_t          off, pgsz;
+
+    pgsz = (size_t)sysconf(_SC_PAGESIZE);
+    for (off = 0; off < sizeof(stack); off += pgsz)
+        stack[off] = 0;
+
+#ifdef __GLIBC__
+    mallopt(M_TRIM_THRESHOLD, -1);
+    mallopt(M_MMAP_MAX, 0);
+#endif
+
+    rl.rlim_cur = rl.rlim_max = RLIM_INFINITY;
+    if (setrlimit(RLIMIT_MEMLOCK, &rl) == -1)
+        log_warn("lowlatency: memlock limit");
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+        log_warn("lowlatency: mlockall");
+        return (-1);
+    }
+
+    log_info("lowlatency: memory locked, %d kB of stack faulted in",
+        RESIDENCY_STACK / 1024);
+
+    return (0);
+}
@@ -0,0 +1,852 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "control.h"
+#include "reply.h"
+#include "session.h"
+#include "trace.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX             1024
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL        0
+#endif
+
+#define SESSION_IBUF_MIN    4096
+#define SESSION_IBUF_MAX    (sizeof(struct msg_ctl_req) + \
+    sizeof(struct msg_ctl_batch) + GEOLOC_BATCH_MAX * GEOLOC_ADDR_MAX)
+/* replies pending beyond, the session is not served anymore */
+#define SESSION_OBUF_HIGH   (64 * 1024)
+/* and beyond this one, the client is considered gone */
+#define SESSION_OBUF_MAX    (4 * 1024 * 1024)
+/* one bulk request served every so many interactive ones */
+#define SESSION_BULK_SHARE  8
+/* served requests are kept for reuse with payload buffers up to */
+#define SESSION_POOL_PAYLOAD 16384
+
+TAILQ_HEAD(sessions, session);
+TAILQ_HEAD(session_requests, session_request);
+
+static struct sessions          sessions = TAILQ_HEAD_INITIALIZER(sessions);
+static struct session_requests  queues[CLASS_MAX];
+static struct session_requests  pool = TAILQ_HEAD_INITIALIZER(pool);
+static unsigned                 npool = 0;
+static struct session           **sessions_fd = NULL;
+static int                      sessions_fdsz = 0;
+static unsigned                 nsessions = 0;
+static unsigned                 nqueued = 0;
+static unsigned                 nstreams = 0;
+/* upgraded, idle sessions are closed for the clients to reconnect */
+static int                      quiescing = 0;
+static unsigned                 streak = 0;
+static uint32_t                 nextid = 0;
+static struct geolocd_conf      *sconf = NULL;
+
+static struct session *session_get(int);
+static void session_read(struct session *);
+static void session_parse(struct session *);
+static ssize_t session_frame(const char *, size_t, struct msg_ctl_req *, size_t *);
+static struct session_request *session_request_new(size_t);
+static struct session_request *session_eligible(enum conn_class);
+static int session_write(int, struct iovec *, size_t);
+static int session_flush(struct session *);
+static int session_buffer(struct session *, struct iovec *, size_t);
+static void session_free(struct session *);
+
+void
+session_init(struct geolocd_conf *xconf)
+{
+    int     i;
+
+    sconf = xconf;
+    for (i = 0; i < CLASS_MAX; i++)
+        TAILQ_INIT(&queues[i]);
+}
+
+uint64_t
+session_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/*
+ * Accepts the pending connections, over the limit
+ * they are closed right away. Remote ones come from TCP.
+ */
+int
+session_accept(int lfd, int remote)
+{
+    struct session  **sfd, *s;
+    int             fd, sz;
+
+    while ((fd = control_accept(lfd)) != -1) {
+        if (nsessions >= sconf->conn_max) {
+            stats.refused++;
+            close(fd);
+            continue;
+        }
+
+        if (fd >= sessions_fdsz) {
+            sz = (fd + 1 > sessions_fdsz * 2 ? fd + 1 : sessions_fdsz * 2);
+            if ((sfd = reallocarray(sessions_fd, sz, sizeof(*sfd))) == NULL) {
+                log_warn("session_accept");
+                close(fd);
+                continue;
+            }
+            bzero(sfd + sessions_fdsz, (sz - sessions_fdsz) * sizeof(*sfd));
+            sessions_fd = sfd;
+            sessions_fdsz = sz;
+        }
+
+        if ((s = calloc(1, sizeof(*s))) == NULL) {
+            log_warn("session_accept");
+            close(fd);
+            continue;
+        }
+        s->fd = fd;
+        s->id = nextid++;
+        s->class = CLASS_INTERACTIVE;
+        s->remote = remote;
+        s->accepted = session_clock();
+        TRACE_PROBE2(accept, fd, remote);
+
+        sessions_fd[fd] = s;
+        TAILQ_INSERT_TAIL(&sessions, s, entry);
+        nsessions++;
+    }
+
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+        errno != ECONNABORTED) {
+        log_warn("session_accept");
+        return (-1);
+    }
+
+    return (0);
+}
+
+/*
+ * Poll entries from first on, one per session in list order.
+ * Sessions with a full queue are not read, leaving the
+ * client blocked on its own socket buffer.
+ */
+size_t
+session_pollset(struct pollfd **pfd, size_t *pfdsz, size_t first)
+{
+    struct pollfd   *p;
+    struct session  *s;
+    size_t          n = first;
+
+    if (first + nsessions > *pfdsz) {
+        if ((p = reallocarray(*pfd, first + nsessions, sizeof(*p))) == NULL) {
+            log_warn("session_pollset");
+            return (first);
+        }
+        *pfd = p;
+        *pfdsz = first + nsessions;
+    }
+
+    TAILQ_FOREACH(s, &sessions, entry) {
+        p = &(*pfd)[n++];
+        p->fd = s->fd;
+        p->events = 0;
+        p->revents = 0;
+        if (!s->eof && !s->dead && s->ilen < SESSION_IBUF_MAX &&
+            s->queued < sconf->queue_conn)
+            p->events |= POLLIN;
+        if (s->olen > 0)
+            p->events |= POLLOUT;
+    }
+
+    return (n);
+}
+
+void
+session_events(struct pollfd *pfd, size_t n)
+{
+    struct session  *s;
+    size_t          i = 0;
+
+    TAILQ_FOREACH(s, &sessions, entry) {
+        if (i == n)
+            break;
+        if (pfd[i].fd != s->fd)
+            continue;
+
+        if (pfd[i].revents & POLLOUT)
+            session_flush(s);
+        if (pfd[i].revents & (POLLIN|POLLHUP))
+            session_read(s);
+        if (pfd[i].revents & (POLLERR|POLLNVAL))
+            s->dead = 1;
+        i++;
+    }
+}
+
+/*
+ * Requests left in the input buffers, by a full queue or
+ * a class change, are admitted once there is room again
+ */
+void
+session_admit(void)
+{
+    struct session  *s;
+
+    TAILQ_FOREACH(s, &sessions, entry)
+        if (!s->dead && s->ilen > 0)
+            session_parse(s);
+}
+
+/*
+ * First request of a class from a session that can be served, the
+ * ones with too much pending output or streaming being skipped
+ */
+static struct session_request *
+session_eligible(enum conn_class cl)
+{
+    struct session_request  *r;
+
+    TAILQ_FOREACH(r, &queues[cl], entry)
+        if (r->s->dead ||
+            (r->s->olen <= SESSION_OBUF_HIGH && r->s->stream == NULL))
+            break;
+
+    return (r);
+}
+
+/*
+ * Interactive requests first, bulk ones still getting a share.
+ * Sessions with too much pending output are skipped, the ones
+ * behind are from other sessions hence the order per session
+ * is kept. A class with nothing to serve leaves its turn to
+ * the other one.
+ */
+struct session_request *
+session_next(void)
+{
+    struct session_request  *r;
+    enum conn_class         cl;
+
+    if (nqueued == 0)
+        return (NULL);
+
+    if (!TAILQ_EMPTY(&queues[CLASS_INTERACTIVE]) &&
+        (streak < SESSION_BULK_SHARE || TAILQ_EMPTY(&queues[CLASS_BULK])))
+        cl = CLASS_INTERACTIVE;
+    else
+        cl = CLASS_BULK;
+
+    if ((r = session_eligible(cl)) == NULL) {
+        cl = (cl == CLASS_INTERACTIVE ? CLASS_BULK : CLASS_INTERACTIVE);
+        if ((r = session_eligible(cl)) == NULL)
+            return (NULL);
+        /* bulk skipped, its share is owed again after a new streak */
+        if (cl == CLASS_INTERACTIVE)
+            streak = 0;
+    }
+
+    streak = (cl == CLASS_INTERACTIVE ? streak + 1 : 0);
+
+    TAILQ_REMOVE(&queues[cl], r, entry);
+    r->s->queued--;
+    nqueued--;
+
+    return (r);
+}
+
+/*
+ * A served request goes back to the pool, bounded by the global
+ * queue size, so that admitting one does not allocate once the
+ * daemon has seen its load
+ */
+void
+session_request_free(struct session_request *r)
+{
+    if (r->bufsz > SESSION_POOL_PAYLOAD) {
+        free(r->buf);
+        r->buf = NULL;
+        r->bufsz = 0;
+    }
+
+    if (sconf == NULL || npool >= sconf->queue_global) {
+        free(r->buf);
+        free(r);
+        return;
+    }
+
+    TAILQ_INSERT_HEAD(&pool, r, entry);
+    npool++;
+}
+
+/*
+ * Fills the pool up to the global queue size beforehand, with
+ * payload buffers for single addresses, in low latency mode
+ */
+void
+session_prealloc(void)
+{
+    struct session_request  *r;
+
+    while (npool < sconf->queue_global) {
+        if ((r = calloc(1, sizeof(*r))) == NULL ||
+            (r->buf = malloc(GEOLOC_ADDR_MAX)) == NULL) {
+            log_warn("session_prealloc");
+            free(r);
+            return;
+        }
+        r->bufsz = GEOLOC_ADDR_MAX;
+        TAILQ_INSERT_HEAD(&pool, r, entry);
+        npool++;
+    }
+}
+
+static struct session_request *
+session_request_new(size_t plen)
+{
+    struct session_request  *r;
+    char                    *buf;
+
+    if ((r = TAILQ_FIRST(&pool)) != NULL) {
+        TAILQ_REMOVE(&pool, r, entry);
+        npool--;
+    } else {
+        if ((r = calloc(1, sizeof(*r))) == NULL)
+            return (NULL);
+        stats.allocs++;
+    }
+
+    if (plen > r->bufsz) {
+        if ((buf = realloc(r->buf, plen)) == NULL) {
+            free(r->buf);
+            free(r);
+            return (NULL);
+        }
+        stats.allocs++;
+        r->buf = buf;
+        r->bufsz = plen;
+    }
+    r->payload = (plen > 0 ? r->buf : NULL);
+
+    return (r);
+}
+
+/*
+ * Whether a queued request can be served right away
+ */
+int
+session_pending(void)
+{
+    int                     i;
+
+    for (i = 0; i < CLASS_MAX; i++)
+        if (session_eligible(i) != NULL)
+            return (1);
+
+    return (nstreams > 0 && session_streaming(NULL) != NULL);
+}
+
+/*
+ * Closes the broken sessions and the ones the client
+ * finished with, once everything has been answered
+ */
+void
+session_reap(void)
+{
+    struct session  *s, *next;
+
+    for (s = TAILQ_FIRST(&sessions); s != NULL; s = next) {
+        next = TAILQ_NEXT(s, entry);
+        /* the upgraded process connection lasts as long as it runs */
+        if (s->dead || ((s->eof || (quiescing && !s->upgrade)) &&
+            s->queued == 0 && s->olen == 0 && s->stream == NULL &&
+            (s->eof || s->ilen == 0)))
+            session_free(s);
+    }
+}
+
+/*
+ * From now on the sessions are closed as soon as they are idle,
+ * nothing queued, read or left to send
+ */
+void
+session_quiesce(void)
+{
+    quiescing = 1;
+}
+
+/*
+ * Sessions are kept open again, upgrade given up
+ */
+void
+session_resume(void)
+{
+    quiescing = 0;
+}
+
+unsigned
+session_count(void)
+{
+    return (nsessions);
+}
+
+/*
+ * The session streams its reply over the next rounds
+ */
+void
+session_stream_set(struct session *s, void *stream)
+{
+    s->stream = stream;
+    nstreams++;
+}
+
+void
+session_stream_end(struct session *s)
+{
+    if (s->stream == NULL)
+        return;
+
+    free(s->stream);
+    s->stream = NULL;
+    nstreams--;
+}
+
+/*
+ * Next session after s, or the first one, with a stream to go on
+ * with, its pending output low enough
+ */
+struct session *
+session_streaming(struct session *s)
+{
+    if (nstreams == 0)
+        return (NULL);
+
+    for (s = (s == NULL ? TAILQ_FIRST(&sessions) : TAILQ_NEXT(s, entry));
+        s != NULL; s = TAILQ_NEXT(s, entry))
+        if (s->stream != NULL && !s->dead && s->olen <= SESSION_OBUF_HIGH)
+            return (s);
+
+    return (NULL);
+}
+
+/*
+ * Connections of upgraded processes, the sockets handed to them
+ */
+unsigned
+session_upgrading(void)
+{
+    struct session  *s;
+    unsigned        n = 0;
+
+    TAILQ_FOREACH(s, &sessions, entry)
+        if (s->upgrade)
+            n++;
+
+    return (n);
+}
+
+void
+session_closeall(void)
+{
+    struct session          *s;
+    struct session_request  *r;
+
+    while ((s = TAILQ_FIRST(&sessions)) != NULL)
+        session_free(s);
+
+    while ((r = TAILQ_FIRST(&pool)) != NULL) {
+        TAILQ_REMOVE(&pool, r, entry);
+        free(r->buf);
+        free(r);
+    }
+    npool = 0;
+
+    free(sessions_fd);
+    sessions_fd = NULL;
+    sessions_fdsz = 0;
+}
+
+/*
+ * Sends the reply right away when nothing is pending, what the
+ * socket does not take is copied to the session output buffer
+ */
+int
+session_send(int fd, struct iovec *iov, size_t iovcnt)
+{
+    uint64_t    start = session_clock();
+    int         ret;
+
+    ret = session_write(fd, iov, iovcnt);
+    TRACE_PROBE2(reply__sent, fd, ret);
+    trace_send(session_clock() - start);
+
+    return (ret);
+}
+
+static int
+session_write(int fd, struct iovec *iov, size_t iovcnt)
+{
+    struct session  *s;
+    struct msghdr   msg;
+    ssize_t         n;
+
+    if ((s = session_get(fd)) == NULL || s->dead)
+        return (-1);
+
+    if (s->olen > 0)
+        return (session_buffer(s, iov, iovcnt));
+
+    while (iovcnt > 0) {
+        bzero(&msg, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+
+        if ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return (session_buffer(s, iov, iovcnt));
+            log_warn("session_send");
+            s->dead = 1;
+            return (-1);
+        }
+
+        /* partial write, skip what has been sent */
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return (0);
+}
+
+/*
+ * Overloaded answer, in the form the request type expects
+ */
+int
+session_reject(int fd, struct msg_ctl_req *req)
+{
+    switch (req->type) {
+    case MSG_CTL_PROPERTY_BATCH:
+    case MSG_CTL_PROPERTY_ALL:
+    case MSG_CTL_ENUMERATE:
+    case MSG_CTL_REVERSE:
+    case MSG_CTL_NEAREST:
+    case MSG_CTL_RADIUS:
+        return (reply_status(fd, MSG_STATUS_OVERLOADED));
+    default:
+        return (reply_string(fd, GEOLOC_OVERLOADED_INFO));
+    }
+}
+
+static struct session *
+session_get(int fd)
+{
+    if (fd < 0 || fd >= sessions_fdsz)
+        return (NULL);
+
+    return (sessions_fd[fd]);
+}
+
+static void
+session_read(struct session *s)
+{
+    char    *buf;
+    size_t  sz;
+    ssize_t n;
+
+    for (;;) {
+        if (s->ilen == s->isz) {
+            if (s->isz == SESSION_IBUF_MAX)
+                break;
+            sz = (s->isz == 0 ? SESSION_IBUF_MIN : s->isz * 2);
+            if (sz > SESSION_IBUF_MAX)
+                sz = SESSION_IBUF_MAX;
+            if ((buf = realloc(s->ibuf, sz)) == NULL) {
+                log_warn("session_read");
+                s->dead = 1;
+                return;
+            }
+            stats.allocs++;
+            s->ibuf = buf;
+            s->isz = sz;
+        }
+
+        if ((n = recv(s->fd, s->ibuf + s->ilen, s->isz - s->ilen, 0)) == 0) {
+            s->eof = 1;
+            break;
+        }
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            s->dead = 1;
+            return;
+        }
+        s->ilen += n;
+    }
+
+    session_parse(s);
+}
+
+/*
+ * Admits the complete requests of the input buffer. A full session
+ * queue stops the parsing, a full global queue too unless the session
+ * has nothing queued, the request is then rejected: replies must
+ * come in the requests order.
+ */
+static void
+session_parse(struct session *s)
+{
+    struct session_request  *r;
+    struct msg_ctl_req      req;
+    size_t                  off = 0, plen;
+    ssize_t                 n;
+
+    while (off < s->ilen) {
+        if ((n = session_frame(s->ibuf + off, s->ilen - off, &req, &plen)) == 0)
+            break;
+        if (n == -1) {
+            log_debug("session_parse: invalid request");
+            s->dead = 1;
+            return;
+        }
+
+        if (req.type == MSG_CTL_CLASS) {
+            /* applied once the previous requests are answered */
+            if (s->queued > 0)
+                break;
+            if (req.field == MSG_CLASS_BULK)
+                s->class = CLASS_BULK;
+            else
+                s->class = CLASS_INTERACTIVE;
+            reply_string(s->fd, "ok");
+            off += n;
+            continue;
+        }
+
+        if (s->queued >= sconf->queue_conn)
+            break;
+
+        if (nqueued >= sconf->queue_global) {
+            if (s->queued > 0)
+                break;
+            stats.overloaded++;
+            capture_request(session_clock(), s->id, s->class, &req,
+                s->ibuf + off + sizeof(req), plen);
+            session_reject(s->fd, &req);
+            off += n;
+            continue;
+        }
+
+        if ((r = session_request_new(plen)) == NULL) {
+            log_warn("session_parse");
+            break;
+        }
+        r->s = s;
+        r->class = s->class;
+        r->req = req;
+        r->len = plen;
+        if (plen > 0)
+            memcpy(r->payload, s->ibuf + off + sizeof(req), plen);
+        r->received = session_clock();
+        r->deadline = r->received +
+            (uint64_t)sconf->deadline[s->class] * 1000;
+        capture_request(r->received, s->id, s->class, &req, r->payload, plen);
+        TRACE_PROBE3(request__received, s->fd, req.type, req.field);
+
+        TAILQ_INSERT_TAIL(&queues[s->class], r, entry);
+        s->queued++;
+        nqueued++;
+        stats.admitted++;
+        off += n;
+    }
+
+    if (off > 0) {
+        memmove(s->ibuf, s->ibuf + off, s->ilen - off);
+        s->ilen -= off;
+    }
+}
+
+/*
+ * Size of the request at the head of the buffer,
+ * 0 while incomplete and -1 when malformed
+ */
+static ssize_t
+session_frame(const char *buf, size_t len, struct msg_ctl_req *req,
+              size_t *plen)
+{
+    struct msg_ctl_batch    batch;
+    const char              *p, *nul;
+    size_t                  max;
+
+    if (len < sizeof(*req))
+        return (0);
+
+    memcpy(req, buf, sizeof(*req));
+    p = buf + sizeof(*req);
+    len -= sizeof(*req);
+
+    switch (req->type) {
+    case MSG_CTL_PROPERTY:
+    case MSG_CTL_PROPERTY_ALL:
+    case MSG_CTL_ENUMERATE:
+    case MSG_CTL_REVERSE:
+    case MSG_CTL_DELTA:
+    case MSG_CTL_NEAREST:
+    case MSG_CTL_RADIUS:
+        max = (len < GEOLOC_VALUE_MAX ? len : GEOLOC_VALUE_MAX);
+        if ((nul = memchr(p, '\0', max)) == NULL)
+            return (len >= GEOLOC_VALUE_MAX ? -1 : 0);
+        *plen = nul - p + 1;
+        break;
+    case MSG_CTL_PROPERTY_BATCH:
+        if (len < sizeof(batch))
+            return (0);
+        memcpy(&batch, p, sizeof(batch));
+        if (batch.count == 0 || batch.count > GEOLOC_BATCH_MAX ||
+            batch.len == 0 || batch.len > batch.count * GEOLOC_ADDR_MAX)
+            return (-1);
+        *plen = sizeof(batch) + batch.len;
+        if (len < *plen)
+            return (0);
+        break;
+    default:
+        *plen = 0;
+        break;
+    }
+
+    return (sizeof(*req) + *plen);
+}
+
+static int
+session_flush(struct session *s)
+{
+    ssize_t n;
+
+    while (s->olen > 0) {
+        if ((n = send(s->fd, s->obuf + s->ooff, s->olen, MSG_NOSIGNAL)) == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return (0);
+            s->dead = 1;
+            return (-1);
+        }
+        s->ooff += n;
+        s->olen -= n;
+    }
+    s->ooff = 0;
+
+    return (0);
+}
+
+static int
+session_buffer(struct session *s, struct iovec *iov, size_t iovcnt)
+{
+    char    *buf;
+    size_t  i, len = 0, sz;
+
+    for (i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    /*
+     * Never waited for, streams pausing past SESSION_OBUF_HIGH,
+     * only a client not reading gets there
+     */
+    if (s->olen + len > SESSION_OBUF_MAX &&
+        (session_flush(s) == -1 || s->olen + len > SESSION_OBUF_MAX)) {
+        log_debug("session_buffer: client not reading, dropped");
+        s->dead = 1;
+        return (-1);
+    }
+
+    if (s->ooff > 0) {
+        memmove(s->obuf, s->obuf + s->ooff, s->olen);
+        s->ooff = 0;
+    }
+
+    if (s->olen + len > s->osz) {
+        for (sz = (s->osz == 0 ? 4096 : s->osz); sz < s->olen + len; sz *= 2)
+            ;
+        if ((buf = realloc(s->obuf, sz)) == NULL) {
+            log_warn("session_buffer");
+            s->dead = 1;
+            return (-1);
+        }
+        stats.allocs++;
+        s->obuf = buf;
+        s->osz = sz;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(s->obuf + s->olen, iov[i].iov_base, iov[i].iov_len);
+        s->olen += iov[i].iov_len;
+    }
+
+    return (0);
+}
+
+static void
+session_free(struct session *s)
+{
+    struct session_request  *r, *next;
+    int                     i;
+
+    for (i = 0; i < CLASS_MAX; i++)
+        for (r = TAILQ_FIRST(&queues[i]); r != NULL; r = next) {
+            next = TAILQ_NEXT(r, entry);
+            if (r->s != s)
+                continue;
+            TAILQ_REMOVE(&queues[i], r, entry);
+            nqueued--;
+            session_request_free(r);
+        }
+
+    session_stream_end(s);
+    TAILQ_REMOVE(&sessions, s, entry);
+    sessions_fd[s->fd] = NULL;
+    nsessions--;
+    close(s->fd);
+    free(s->ibuf);
+    free(s->obuf);
+    free(s);
+}
@@ -0,0 +1,107 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GEOLOC_SESSION_H_
+#define _GEOLOC_SESSION_H_          1
+
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <poll.h>
+
+#include "geoloc.h"
+
+#define SESSION_CONNS_MAX           256
+#define SESSION_QUEUE_CONN          64
+#define SESSION_QUEUE_GLOBAL        4096
+#define SESSION_DEADLINE_INTERACTIVE 100
+#define SESSION_DEADLINE_BULK       2000
+
+struct session;
+
+/*
+ * A complete request waiting in its class queue
+ */
+struct session_request {
+    TAILQ_ENTRY(session_request)    entry;
+    struct session                  *s;
+    enum conn_class                 class;
+    struct msg_ctl_req              req;
+    char                            *payload;
+    size_t                          len;
+    /* payload buffer, kept along when the request is reused */
+    char                            *buf;
+    size_t                          bufsz;
+    uint64_t                        received;
+    uint64_t                        deadline;
+};
+
+/*
+ * A client connection, kept open across requests
+ */
+struct session {
+    TAILQ_ENTRY(session)            entry;
+    int                             fd;
+    /* sequential, telling the connections apart in captures */
+    uint32_t                        id;
+    enum conn_class                 class;
+    uint64_t                        accepted;
+    char                            *ibuf;
+    size_t                          ilen;
+    size_t                          isz;
+    char                            *obuf;
+    size_t                          olen;
+    size_t                          ooff;
+    size_t                          osz;
+    unsigned                        queued;
+    /* TCP client, lookups only */
+    unsigned                        remote:1;
+    unsigned                        eof:1;
+    unsigned                        dead:1;
+    /* new process the listening sockets were handed to */
+    unsigned                        upgrade:1;
+    /*
+     * reply streamed over several rounds, a single allocation freed
+     * along with the session, its next requests waiting for its end
+     */
+    void                            *stream;
+};
+
+void session_init(struct geolocd_conf *);
+int session_accept(int, int);
+size_t session_pollset(struct pollfd **, size_t *, size_t);
+void session_events(struct pollfd *, size_t);
+void session_admit(void);
+struct session_request *session_next(void);
+void session_request_free(struct session_request *);
+void session_prealloc(void);
+int session_pending(void);
+void session_reap(void);
+void session_closeall(void);
+void session_quiesce(void);
+void session_resume(void);
+unsigned session_count(void);
+unsigned session_upgrading(void);
+void session_stream_set(struct session *, void *);
+void session_stream_end(struct session *);
+struct session *session_streaming(struct session *);
+int session_send(int, struct iovec *, size_t);
+int session_reject(int, struct msg_ctl_req *);
+uint64_t session_clock(void);
+
+#endif
@@ -0,0 +1,386 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "geoloc.h"
+#include "spatial.h"
+
+/*
+ * The k nearest points found so far, max heap on the
+ * squared chord so that the farthest one goes first
+ */
+struct spatial_heap {
+    const struct spatial_point  *points[SPATIAL_K_MAX];
+    double                      d[SPATIAL_K_MAX];
+    size_t                      n;
+    size_t                      k;
+};
+
+static double spatial_chord2(const double *, const double *);
+static void spatial_swap(struct spatial_point *, size_t, size_t);
+static void spatial_select(struct spatial_point *, size_t, size_t, size_t, int);
+static void spatial_split(struct spatial_point *, size_t, size_t, int);
+static void spatial_heap_push(struct spatial_heap *, const struct spatial_point *,
+    double);
+static void spatial_knn(const struct spatial_point *, size_t, size_t, int,
+    const double *, struct spatial_heap *);
+static void spatial_push(struct spatial_cursor *, size_t, size_t, int);
+
+/*
+ * "latitude longitude" in decimal degrees
+ */
+int
+spatial_parse(const char *s, double *lat, double *lon)
+{
+    char    *end;
+
+    *lat = strtod(s, &end);
+    if (end == s)
+        return (-1);
+    s = end;
+    *lon = strtod(s, &end);
+    if (end == s || *end != '\0')
+        return (-1);
+
+    if (!(*lat >= -90.0 && *lat <= 90.0) ||
+        !(*lon >= -180.0 && *lon <= 180.0))
+        return (-1);
+
+    return (0);
+}
+
+void
+spatial_point_set(struct spatial_point *p, double lat, double lon)
+{
+    double  phi = lat * M_PI / 180.0, lambda = lon * M_PI / 180.0;
+
+    p->lat = lat;
+    p->lon = lon;
+    p->v[0] = cos(phi) * cos(lambda);
+    p->v[1] = cos(phi) * sin(lambda);
+    p->v[2] = sin(phi);
+}
+
+/*
+ * Great circle distance in km, haversine formula
+ */
+double
+spatial_distance(double lat1, double lon1, double lat2, double lon2)
+{
+    double  dphi, dlambda, a;
+
+    dphi = (lat2 - lat1) * M_PI / 180.0;
+    dlambda = (lon2 - lon1) * M_PI / 180.0;
+    a = sin(dphi / 2) * sin(dphi / 2) + cos(lat1 * M_PI / 180.0) *
+        cos(lat2 * M_PI / 180.0) * sin(dlambda / 2) * sin(dlambda / 2);
+
+    return (2 * SPATIAL_EARTH_RADIUS * atan2(sqrt(a), sqrt(1 - a)));
+}
+
+/*
+ * Arranges the points in place, the tree owning them afterwards
+ */
+struct spatial_tree *
+spatial_build(struct spatial_point *points, size_t n)
+{
+    struct spatial_tree *t;
+
+    if ((t = calloc(1, sizeof(*t))) == NULL) {
+        log_warn("spatial_build");
+        return (NULL);
+    }
+
+    spatial_split(points, 0, n, 0);
+    t->points = points;
+    t->npoints = n;
+
+    return (t);
+}
+
+/*
+ * Up to k points nearest to the location, closest first,
+ * with their distances in km
+ */
+size_t
+spatial_nearest(const struct spatial_tree *t, double lat, double lon, size_t k,
+                const struct spatial_point **points, double *km)
+{
+    struct spatial_heap     h;
+    struct spatial_point    q;
+    size_t                  n;
+
+    spatial_point_set(&q, lat, lon);
+    h.n = 0;
+    h.k = (k < SPATIAL_K_MAX ? k : SPATIAL_K_MAX);
+    if (h.k == 0)
+        return (0);
+
+    spatial_knn(t->points, 0, t->npoints, 0, q.v, &h);
+
+    /* the farthest leaves the heap first */
+    for (n = h.n; h.n > 0; ) {
+        points[h.n - 1] = h.points[0];
+        km[h.n - 1] = 2 * SPATIAL_EARTH_RADIUS *
+            asin(fmin(1.0, sqrt(h.d[0]) / 2));
+        h.n--;
+        h.points[0] = h.points[h.n];
+        h.d[0] = h.d[h.n];
+        spatial_heap_push(&h, NULL, 0);
+    }
+
+    return (n);
+}
+
+/*
+ * Calls back every point within km of the location, in no
+ * particular order, until the callback returns -1
+ */
+int
+spatial_radius(const struct spatial_tree *t, double lat, double lon, double km,
+               spatial_callback cb, void *arg)
+{
+    struct spatial_cursor   c;
+    int                     ret;
+
+    spatial_radius_init(&c, t, lat, lon, km);
+    while ((ret = spatial_radius_step(t, &c, SIZE_MAX, cb, arg)) == 1)
+        ;
+
+    return (ret);
+}
+
+void
+spatial_radius_init(struct spatial_cursor *c, const struct spatial_tree *t,
+                    double lat, double lon, double km)
+{
+    struct spatial_point    p;
+    double                  chord;
+
+    spatial_point_set(&p, lat, lon);
+    memcpy(c->v, p.v, sizeof(c->v));
+    chord = 2 * sin(fmin(km / SPATIAL_EARTH_RADIUS, M_PI) / 2);
+    c->r2 = chord * chord;
+    c->depth = 0;
+    c->visits = 0;
+    spatial_push(c, 0, t->npoints, 0);
+}
+
+/*
+ * Looks at up to steps points of the search, 1 telling there are
+ * more, either the steps being used up or the callback pausing it,
+ * 0 once done and -1 when the callback stops it
+ */
+int
+spatial_radius_step(const struct spatial_tree *t, struct spatial_cursor *c,
+                    size_t steps, spatial_callback cb, void *arg)
+{
+    const struct spatial_point  *p = t->points;
+    size_t                      lo, hi, mid, n;
+    double                      diff, d;
+    int                         axis, ret;
+
+    for (n = 0; n < steps && c->depth > 0; n++) {
+        c->depth--;
+        lo = c->stack[c->depth].lo;
+        hi = c->stack[c->depth].hi;
+        axis = c->stack[c->depth].axis;
+
+        mid = lo + (hi - lo) / 2;
+        c->visits++;
+
+        /* the lower half goes on top, to be visited first */
+        diff = c->v[axis] - p[mid].v[axis];
+        if (diff >= 0 || diff * diff <= c->r2)
+            spatial_push(c, mid + 1, hi, (axis + 1) % 3);
+        if (diff < 0 || diff * diff <= c->r2)
+            spatial_push(c, lo, mid, (axis + 1) % 3);
+
+        if ((d = spatial_chord2(p[mid].v, c->v)) <= c->r2) {
+            ret = cb(arg, &p[mid], 2 * SPATIAL_EARTH_RADIUS *
+                asin(fmin(1.0, sqrt(d) / 2)));
+            if (ret == -1)
+                return (-1);
+            if (ret == 1)
+                break;
+        }
+    }
+
+    return (c->depth > 0 ? 1 : 0);
+}
+
+void
+spatial_free(struct spatial_tree *t)
+{
+    if (t == NULL)
+        return;
+
+    free(t->points);
+    free(t);
+}
+
+static double
+spatial_chord2(const double *a, const double *b)
+{
+    return ((a[0] - b[0]) * (a[0] - b[0]) + (a[1] - b[1]) * (a[1] - b[1]) +
+        (a[2] - b[2]) * (a[2] - b[2]));
+}
+
+static void
+spatial_swap(struct spatial_point *p, size_t i, size_t j)
+{
+    struct spatial_point    tmp;
+
+    tmp = p[i];
+    p[i] = p[j];
+    p[j] = tmp;
+}
+
+/*
+ * Puts the k-th point of [lo, hi) on the axis at its
+ * sorted position, smaller ones before it
+ */
+static void
+spatial_select(struct spatial_point *p, size_t lo, size_t hi, size_t k,
+               int axis)
+{
+    double  pivot;
+    size_t  i, s;
+
+    while (lo + 1 < hi) {
+        spatial_swap(p, lo + (hi - lo) / 2, hi - 1);
+        pivot = p[hi - 1].v[axis];
+        for (i = s = lo; i < hi - 1; i++)
+            if (p[i].v[axis] < pivot)
+                spatial_swap(p, i, s++);
+        spatial_swap(p, s, hi - 1);
+
+        if (k == s)
+            break;
+        if (k < s)
+            hi = s;
+        else
+            lo = s + 1;
+    }
+}
+
+static void
+spatial_split(struct spatial_point *p, size_t lo, size_t hi, int axis)
+{
+    size_t  mid;
+
+    if (hi - lo <= 1)
+        return;
+
+    mid = lo + (hi - lo) / 2;
+    spatial_select(p, lo, hi, mid, axis);
+    spatial_split(p, lo, mid, (axis + 1) % 3);
+    spatial_split(p, mid + 1, hi, (axis + 1) % 3);
+}
+
+/*
+ * Adds a point when there is room or it is nearer than the
+ * farthest one, a NULL point sifting the root down only
+ */
+static void
+spatial_heap_push(struct spatial_heap *h, const struct spatial_point *p,
+                  double d)
+{
+    const struct spatial_point  *tp;
+    double                      td;
+    size_t                      i, c;
+
+    if (p != NULL) {
+        if (h->n < h->k) {
+            /* sift up */
+            for (i = h->n++; i > 0 && h->d[(i - 1) / 2] < d; i = (i - 1) / 2) {
+                h->points[i] = h->points[(i - 1) / 2];
+                h->d[i] = h->d[(i - 1) / 2];
+            }
+            h->points[i] = p;
+            h->d[i] = d;
+            return;
+        }
+        if (d >= h->d[0])
+            return;
+        h->points[0] = p;
+        h->d[0] = d;
+    }
+
+    /* sift down */
+    tp = h->points[0];
+    td = h->d[0];
+    for (i = 0; (c = 2 * i + 1) < h->n; i = c) {
+        if (c + 1 < h->n && h->d[c + 1] > h->d[c])
+            c++;
+        if (h->d[c] <= td)
+            break;
+        h->points[i] = h->points[c];
+        h->d[i] = h->d[c];
+    }
+    h->points[i] = tp;
+    h->d[i] = td;
+}
+
+static void
+spatial_knn(const struct spatial_point *p, size_t lo, size_t hi, int axis,
+            const double *q, struct spatial_heap *h)
+{
+    size_t  mid;
+    double  diff;
+
+    if (lo >= hi)
+        return;
+
+    mid = lo + (hi - lo) / 2;
+    spatial_heap_push(h, &p[mid], spatial_chord2(p[mid].v, q));
+
+    /* the side of the query first, the other one if it may be nearer */
+    diff = q[axis] - p[mid].v[axis];
+    if (diff < 0) {
+        spatial_knn(p, lo, mid, (axis + 1) % 3, q, h);
+        if (h->n < h->k || diff * diff < h->d[0])
+            spatial_knn(p, mid + 1, hi, (axis + 1) % 3, q, h);
+    } else {
+        spatial_knn(p, mid + 1, hi, (axis + 1) % 3, q, h);
+        if (h->n < h->k || diff * diff < h->d[0])
+            spatial_knn(p, lo, mid, (axis + 1) % 3, q, h);
+    }
+}
+
+/*
+ * Stacks a subtree to visit, the empty ones being left out; a
+ * subtree being stacked in place of its parent, the stack never
+ * holds more than one per level plus one
+ */
+static void
+spatial_push(struct spatial_cursor *c, size_t lo, size_t hi, int axis)
+{
+    if (lo >= hi || c->depth == SPATIAL_DEPTH_MAX)
+        return;
+
+    c->stack[c->depth].lo = lo;
+    c->stack[c->depth].hi = hi;
+    c->stack[c->depth].axis = axis;
+    c->depth++;
+}
@@ -0,0 +1,84 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GEOLOC_SPATIAL_H_
+#define _GEOLOC_SPATIAL_H_          1
+
+#include <stddef.h>
+
+#define SPATIAL_EARTH_RADIUS        6371.0088
+#define SPATIAL_K_MAX               64
+/* subtrees pending in a radius search, one per level at most */
+#define SPATIAL_DEPTH_MAX           64
+
+/*
+ * A located item, on the unit sphere for the searches:
+ * chord lengths order points as great circle distances do
+ */
+struct spatial_point {
+    double                  v[3];
+    double                  lat;
+    double                  lon;
+    const char              *name;
+    const void              *data;
+};
+
+/*
+ * Implicit k-d tree, each subtree being a slice of the array
+ * with its median point in the middle
+ */
+struct spatial_tree {
+    struct spatial_point    *points;
+    size_t                  npoints;
+};
+
+/*
+ * Radius search walked over several calls, the subtrees left to
+ * visit being stacked, the next one on top
+ */
+struct spatial_cursor {
+    double                  v[3];
+    double                  r2;
+    struct {
+        size_t              lo;
+        size_t              hi;
+        int                 axis;
+    }                       stack[SPATIAL_DEPTH_MAX];
+    unsigned                depth;
+    /* points looked at so far */
+    size_t                  visits;
+};
+
+/* returning -1 stops the search, 1 pauses it after that point */
+typedef int (*spatial_callback)(void *, const struct spatial_point *, double);
+
+int spatial_parse(const char *, double *, double *);
+void spatial_point_set(struct spatial_point *, double, double);
+double spatial_distance(double, double, double, double);
+struct spatial_tree *spatial_build(struct spatial_point *, size_t);
+size_t spatial_nearest(const struct spatial_tree *, double, double, size_t,
+    const struct spatial_point **, double *);
+int spatial_radius(const struct spatial_tree *, double, double, double,
+    spatial_callback, void *);
+void spatial_radius_init(struct spatial_cursor *, const struct spatial_tree *,
+    double, double, double);
+int spatial_radius_step(const struct spatial_tree *, struct spatial_cursor *,
+    size_t, spatial_callback, void *);
+void spatial_free(struct spatial_tree *);
+
+#endif
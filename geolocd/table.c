@@ -0,0 +1,703 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "table.h"
+
+struct table_entry {
+    struct geoloc_addr      first;
+    struct geoloc_addr      last;
+    const char              *value;
+};
+
+struct table_expand {
+    struct geoloc_table     *t;
+    const char              *dict;
+};
+
+static int table_entry_cmp(const void *, const void *);
+static int table_covers(const struct geoloc_table *, const struct geoloc_addr *);
+static void table_search(const struct geoloc_addr **, uint32_t *,
+    const struct geoloc_addr *, size_t);
+static struct geoloc_table *table_new(enum lookup_info_type, int, size_t);
+static int table_push(struct geoloc_table *, const struct geoloc_addr *,
+    const struct geoloc_addr *, const char *, uint32_t *);
+static int table_pages_grow(struct geoloc_table *);
+static int table_share(struct geoloc_table *, struct table_page *);
+static int table_merge(struct geoloc_table *, const struct geoloc_table *,
+    uint32_t, uint32_t, const struct delta *, size_t, size_t,
+    const char **, uint32_t *);
+static void table_span_last(const struct geoloc_table *, uint32_t,
+    struct geoloc_addr *);
+static struct geoloc_table *table_expand(const struct geoloc_table *);
+static int table_expand_cb(void *, const struct geoloc_addr *,
+    const struct geoloc_addr *, const char *);
+static void table_page_unref(struct table_page *);
+static void table_strs_unref(struct table_strs *);
+
+/*
+ * Sorts the ranges of every value of the index, the values
+ * being copied once in a single strings area
+ */
+struct geoloc_table *
+table_build(const struct geoloc_index *idx)
+{
+    struct geoloc_table         *t;
+    struct table_entry          *e = NULL;
+    const struct index_value    *v;
+    const struct index_span     *spans;
+    const char                  *name;
+    uint32_t                    i, j, n = 0;
+    size_t                      len, strsz = 0;
+
+    for (i = 0; i < idx->nvalues; i++)
+        strsz += strlen(idx->values[i].name) + 1;
+
+    if ((t = table_new(idx->field, idx->inet6, strsz)) == NULL)
+        return (NULL);
+
+    if ((e = calloc(idx->nspans + 1, sizeof(*e))) == NULL) {
+        log_warn("table_build");
+        goto fail;
+    }
+
+    for (i = 0, len = 0; i < idx->nvalues; i++) {
+        v = &idx->values[i];
+        name = t->strs->buf + len;
+        memcpy(t->strs->buf + len, v->name, strlen(v->name) + 1);
+        len += strlen(v->name) + 1;
+
+        spans = index_value_spans(v);
+        for (j = 0; j < v->nspans && n < idx->nspans; j++, n++) {
+            e[n].first = spans[j].first;
+            e[n].last = spans[j].last;
+            e[n].value = name;
+        }
+    }
+
+    qsort(e, n, sizeof(*e), table_entry_cmp);
+
+    for (i = 0; i < n; i++)
+        if (table_push(t, &e[i].first, &e[i].last, e[i].value, NULL) == -1)
+            goto fail;
+    free(e);
+
+    return (t);
+
+fail:
+    free(e);
+    table_free(t);
+    return (NULL);
+}
+
+/*
+ * New version of the table with the delta applied, copy on write:
+ * the pages the delta ranges fall into are rebuilt, the others shared.
+ * The number of rebuilt pages is given back in copied. A compacted
+ * table is expanded first, then compacted again as a whole.
+ */
+struct geoloc_table *
+table_apply(const struct geoloc_table *old, const struct delta *d,
+            uint32_t *copied)
+{
+    struct geoloc_table *t, *x;
+    struct geoloc_addr  span;
+    const char          **values = NULL;
+    size_t              k, kk, strsz = 0, len = 0;
+    uint32_t            i, j;
+
+    *copied = 0;
+
+    if (old->compact != NULL) {
+        if ((x = table_expand(old)) == NULL)
+            return (NULL);
+        t = table_apply(x, d, copied);
+        table_free(x);
+        if (t != NULL && table_compact(t) == -1) {
+            table_free(t);
+            return (NULL);
+        }
+        return (t);
+    }
+
+    for (k = 0; k < d->nranges; k++)
+        strsz += strlen(d->ranges[k].value) + 1;
+
+    if ((t = table_new(old->field, old->inet6, strsz)) == NULL)
+        return (NULL);
+    t->strs->parent = old->strs;
+    old->strs->refs++;
+
+    /* the delta values, moved to the new area */
+    if ((values = calloc(d->nranges + 1, sizeof(*values))) == NULL) {
+        log_warn("table_apply");
+        goto fail;
+    }
+    for (k = 0; k < d->nranges; k++) {
+        values[k] = t->strs->buf + len;
+        memcpy(t->strs->buf + len, d->ranges[k].value,
+            strlen(d->ranges[k].value) + 1);
+        len += strlen(d->ranges[k].value) + 1;
+    }
+
+    if (old->npages == 0) {
+        if (table_merge(t, old, 0, 0, d, 0, d->nranges, values, copied) == -1)
+            goto fail;
+        free(values);
+        return (t);
+    }
+
+    for (i = 0, k = 0; i < old->npages; i = j + 1, k = kk) {
+        table_span_last(old, i, &span);
+        j = i;
+        kk = k;
+        if (k == d->nranges || addr_cmp(&d->ranges[k].first, &span) > 0) {
+            if (table_share(t, old->pages[i]) == -1)
+                goto fail;
+            continue;
+        }
+
+        /* the pages the following delta ranges reach */
+        while (kk < d->nranges && addr_cmp(&d->ranges[kk].first, &span) <= 0) {
+            while (addr_cmp(&d->ranges[kk].last, &span) > 0 &&
+                j + 1 < old->npages)
+                table_span_last(old, ++j, &span);
+            kk++;
+        }
+
+        if (table_merge(t, old, i, j + 1, d, k, kk, values, copied) == -1)
+            goto fail;
+    }
+    free(values);
+
+    return (t);
+
+fail:
+    free(values);
+    table_free(t);
+    return (NULL);
+}
+
+/*
+ * Table of the given ranges, as read from a ranges file
+ */
+struct geoloc_table *
+table_ranges(enum lookup_info_type field, int inet6, const struct delta *d)
+{
+    struct geoloc_table *empty, *t;
+    uint32_t            copied;
+
+    if ((empty = table_new(field, inet6, 0)) == NULL)
+        return (NULL);
+    t = table_apply(empty, d, &copied);
+    table_free(empty);
+
+    return (t);
+}
+
+/*
+ * Replaces the pages by the compact form, read only: lookups get
+ * slower, the table taking a fraction of the memory. The pages are
+ * kept when the ranges cannot be compacted.
+ */
+int
+table_compact(struct geoloc_table *t)
+{
+    const struct table_page *p;
+    struct compact          *c;
+    uint32_t                i, n;
+
+    if (t->compact != NULL)
+        return (0);
+    if ((c = compact_new()) == NULL)
+        return (-1);
+
+    for (i = 0; i < t->npages; i++) {
+        p = t->pages[i];
+        for (n = 0; n < p->n; n++)
+            if (compact_add(c, &p->firsts[n], &p->lasts[n],
+                p->values[n]) == -1)
+                goto fail;
+    }
+    if (compact_finish(c) == -1)
+        goto fail;
+
+    for (i = 0; i < t->npages; i++)
+        table_page_unref(t->pages[i]);
+    free(t->pages);
+    free(t->pfirsts);
+    table_strs_unref(t->strs);
+    t->pages = NULL;
+    t->pfirsts = NULL;
+    t->npages = 0;
+    t->strs = NULL;
+    t->compact = c;
+
+    return (0);
+
+fail:
+    compact_free(c);
+    return (-1);
+}
+
+/*
+ * Value of the address, NULL when out of the walked space
+ */
+const char *
+table_lookup(const struct geoloc_table *t, const struct geoloc_addr *addr)
+{
+    const struct table_page *p;
+    uint32_t                lo = 0, hi = t->npages, mid;
+
+    if (!table_covers(t, addr))
+        return (NULL);
+    if (t->compact != NULL)
+        return (compact_lookup(t->compact, addr));
+
+    /* last page, then last range, starting at or before the address */
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (addr_cmp(&t->pfirsts[mid], addr) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == 0)
+        return ("");
+    p = t->pages[lo - 1];
+
+    lo = 0;
+    hi = p->n;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (addr_cmp(&p->firsts[mid], addr) <= 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0 || addr_cmp(addr, &p->lasts[lo - 1]) > 0)
+        return ("");
+
+    return (p->values[lo - 1]);
+}
+
+/*
+ * Values of n addresses, as table_lookup gives them. Every lookup
+ * being a chain of dependent cache misses, the searches of a group of
+ * addresses advance one step each in turn, the next probe of each one
+ * being prefetched meanwhile: the misses of the group overlap instead
+ * of adding up.
+ */
+void
+table_lookup_batch(const struct geoloc_table *t, const struct geoloc_addr *addrs,
+                   size_t n, const char **values)
+{
+    const struct table_page     *p[TABLE_BATCH_GROUP];
+    const struct geoloc_addr    *base[TABLE_BATCH_GROUP];
+    const struct geoloc_addr    *a;
+    uint32_t                    len[TABLE_BATCH_GROUP];
+    size_t                      g, gn, i;
+
+    /* small enough to stay in cache, nothing to interleave */
+    if (t->compact != NULL) {
+        for (i = 0; i < n; i++)
+            values[i] = table_lookup(t, &addrs[i]);
+        return;
+    }
+
+    for (g = 0; g < n; g += gn, addrs += gn, values += gn) {
+        gn = (n - g < TABLE_BATCH_GROUP ? n - g : TABLE_BATCH_GROUP);
+
+        /* the page, last one starting at or before the address */
+        for (i = 0; i < gn; i++) {
+            base[i] = t->pfirsts;
+            len[i] = 0;
+            values[i] = NULL;
+            if (table_covers(t, &addrs[i])) {
+                values[i] = "";
+                len[i] = t->npages;
+                __builtin_prefetch(&base[i][len[i] / 2]);
+            }
+        }
+        table_search(base, len, addrs, gn);
+
+        for (i = 0; i < gn; i++) {
+            p[i] = NULL;
+            if (len[i] == 0)
+                continue;
+            len[i] = base[i] - t->pfirsts;
+            if (addr_cmp(base[i], &addrs[i]) <= 0)
+                len[i]++;
+            if (len[i] > 0)
+                __builtin_prefetch(&t->pages[len[i] - 1]);
+        }
+
+        /* then the range within the page */
+        for (i = 0; i < gn; i++) {
+            if (len[i] == 0)
+                continue;
+            p[i] = t->pages[len[i] - 1];
+            base[i] = p[i]->firsts;
+            len[i] = p[i]->n;
+            __builtin_prefetch(&base[i][len[i] / 2]);
+        }
+        table_search(base, len, addrs, gn);
+
+        for (i = 0; i < gn; i++) {
+            if (p[i] == NULL)
+                continue;
+            len[i] = base[i] - p[i]->firsts;
+            if (addr_cmp(base[i], &addrs[i]) <= 0)
+                len[i]++;
+            if (len[i] > 0) {
+                __builtin_prefetch(&p[i]->lasts[len[i] - 1]);
+                __builtin_prefetch(&p[i]->values[len[i] - 1]);
+            }
+        }
+
+        for (i = 0; i < gn; i++) {
+            if (p[i] == NULL || len[i] == 0)
+                continue;
+            a = &p[i]->lasts[len[i] - 1];
+            if (addr_cmp(&addrs[i], a) <= 0)
+                values[i] = p[i]->values[len[i] - 1];
+        }
+    }
+}
+
+/*
+ * Memory of the table, shared pages included
+ */
+size_t
+table_footprint(const struct geoloc_table *t)
+{
+    const struct table_strs *s;
+    struct compact_usage    u;
+    size_t                  len;
+
+    if (t->compact != NULL) {
+        compact_usage(t->compact, &u);
+        return (sizeof(*t) + sizeof(*t->compact) + u.keys + u.ids + u.dict);
+    }
+
+    len = sizeof(*t) + (size_t)t->npages *
+        (sizeof(struct table_page) + sizeof(*t->pages) + sizeof(*t->pfirsts));
+    for (s = t->strs; s != NULL; s = s->parent)
+        len += sizeof(*s) + s->len;
+
+    return (len);
+}
+
+void
+table_free(struct geoloc_table *t)
+{
+    uint32_t    i;
+
+    if (t == NULL)
+        return;
+
+    for (i = 0; i < t->npages; i++)
+        table_page_unref(t->pages[i]);
+    free(t->pages);
+    free(t->pfirsts);
+    table_strs_unref(t->strs);
+    compact_free(t->compact);
+    free(t);
+}
+
+static int
+table_covers(const struct geoloc_table *t, const struct geoloc_addr *addr)
+{
+    return (addr_isv4(addr) ||
+        (t->inet6 && (addr->a[0] & 0xe0) == 0x20));
+}
+
+/*
+ * One step of each of the binary searches in turn, until every one
+ * is down to a single candidate: base[i] then points to the last
+ * address not above addrs[i], unless all the len[i] ones are above
+ */
+static void
+table_search(const struct geoloc_addr **base, uint32_t *len,
+             const struct geoloc_addr *addrs, size_t n)
+{
+    uint32_t    half;
+    size_t      i;
+    int         active;
+
+    do {
+        active = 0;
+        for (i = 0; i < n; i++) {
+            if (len[i] <= 1)
+                continue;
+            half = len[i] / 2;
+            if (addr_cmp(&base[i][half], &addrs[i]) <= 0)
+                base[i] += half;
+            len[i] -= half;
+            __builtin_prefetch(&base[i][len[i] / 2]);
+            active = 1;
+        }
+    } while (active);
+}
+
+static int
+table_entry_cmp(const void *a, const void *b)
+{
+    return (addr_cmp(&((const struct table_entry *)a)->first,
+        &((const struct table_entry *)b)->first));
+}
+
+static struct geoloc_table *
+table_new(enum lookup_info_type field, int inet6, size_t strsz)
+{
+    struct geoloc_table *t;
+
+    if ((t = calloc(1, sizeof(*t))) == NULL ||
+        (t->strs = calloc(1, sizeof(*t->strs) + strsz + 1)) == NULL) {
+        log_warn("table_new");
+        free(t);
+        return (NULL);
+    }
+    t->field = field;
+    t->inet6 = inet6;
+    t->strs->refs = 1;
+    t->strs->len = strsz;
+
+    return (t);
+}
+
+/*
+ * Room for one more page, the arrays growing by powers of two
+ */
+static int
+table_pages_grow(struct geoloc_table *t)
+{
+    struct table_page   **pages;
+    struct geoloc_addr  *pfirsts;
+    uint32_t            sz;
+
+    if (t->npages != 0 && (t->npages & (t->npages - 1)) != 0)
+        return (0);
+    sz = (t->npages == 0 ? 1 : t->npages * 2);
+
+    if ((pages = reallocarray(t->pages, sz, sizeof(*pages))) == NULL)
+        return (-1);
+    t->pages = pages;
+    if ((pfirsts = reallocarray(t->pfirsts, sz, sizeof(*pfirsts))) == NULL)
+        return (-1);
+    t->pfirsts = pfirsts;
+
+    return (0);
+}
+
+/*
+ * Appends a range, to the last page if it is one of this table
+ * and not full, else to a new one
+ */
+static int
+table_push(struct geoloc_table *t, const struct geoloc_addr *first,
+           const struct geoloc_addr *last, const char *value,
+           uint32_t *copied)
+{
+    struct table_page   *p = NULL;
+
+    if (t->npages > 0)
+        p = t->pages[t->npages - 1];
+
+    if (p == NULL || p->refs > 1 || p->n == TABLE_PAGE_RANGES) {
+        if (table_pages_grow(t) == -1 ||
+            (p = calloc(1, sizeof(*p))) == NULL) {
+            log_warn("table_push");
+            return (-1);
+        }
+        p->refs = 1;
+        t->pages[t->npages] = p;
+        t->pfirsts[t->npages] = *first;
+        t->npages++;
+        if (copied != NULL)
+            (*copied)++;
+    }
+
+    p->firsts[p->n] = *first;
+    p->lasts[p->n] = *last;
+    p->values[p->n] = value;
+    p->n++;
+    t->nranges++;
+
+    return (0);
+}
+
+static int
+table_share(struct geoloc_table *t, struct table_page *p)
+{
+    if (table_pages_grow(t) == -1) {
+        log_warn("table_share");
+        return (-1);
+    }
+
+    p->refs++;
+    t->pages[t->npages] = p;
+    t->pfirsts[t->npages] = p->firsts[0];
+    t->npages++;
+    t->nranges += p->n;
+
+    return (0);
+}
+
+/*
+ * Pushes the ranges of the old pages [i, j) with the delta ranges
+ * [k, kk) applied: old ranges are cut where delta ranges fall, the
+ * delta ranges with a value being inserted in between
+ */
+static int
+table_merge(struct geoloc_table *t, const struct geoloc_table *old,
+            uint32_t i, uint32_t j, const struct delta *d, size_t k,
+            size_t kk, const char **values, uint32_t *copied)
+{
+    const struct delta_range    *dr;
+    const struct table_page     *p;
+    struct geoloc_addr          f, l;
+    size_t                      o, q = k;
+    uint32_t                    n;
+    int                         cut;
+
+    for (; i < j; i++) {
+        p = old->pages[i];
+        for (n = 0; n < p->n; n++) {
+            f = p->firsts[n];
+            cut = 0;
+            for (o = k; o < kk; o++) {
+                dr = &d->ranges[o];
+                if (addr_cmp(&dr->first, &p->lasts[n]) > 0)
+                    break;
+                if (addr_cmp(&dr->last, &f) < 0)
+                    continue;
+                if (addr_cmp(&dr->first, &f) > 0) {
+                    l = dr->first;
+                    addr_decr(&l);
+                    /* delta ranges before the piece come first */
+                    for (; q < kk && addr_cmp(&d->ranges[q].first, &f) < 0; q++)
+                        if (*values[q] != '\0' && table_push(t,
+                            &d->ranges[q].first, &d->ranges[q].last,
+                            values[q], copied) == -1)
+                            return (-1);
+                    if (table_push(t, &f, &l, p->values[n], copied) == -1)
+                        return (-1);
+                }
+                if (addr_cmp(&dr->last, &p->lasts[n]) >= 0) {
+                    cut = 1;
+                    break;
+                }
+                f = dr->last;
+                addr_incr(&f);
+            }
+            if (cut)
+                continue;
+
+            for (; q < kk && addr_cmp(&d->ranges[q].first, &f) < 0; q++)
+                if (*values[q] != '\0' && table_push(t, &d->ranges[q].first,
+                    &d->ranges[q].last, values[q], copied) == -1)
+                    return (-1);
+            if (table_push(t, &f, &p->lasts[n], p->values[n], copied) == -1)
+                return (-1);
+
+            /* delta ranges ending within this range are done with */
+            while (k < kk && addr_cmp(&d->ranges[k].last, &p->lasts[n]) < 0)
+                k++;
+        }
+    }
+
+    for (; q < kk; q++)
+        if (*values[q] != '\0' && table_push(t, &d->ranges[q].first,
+            &d->ranges[q].last, values[q], copied) == -1)
+            return (-1);
+
+    return (0);
+}
+
+/*
+ * Last address of the space a page covers, up to the next page
+ */
+static void
+table_span_last(const struct geoloc_table *t, uint32_t i,
+                struct geoloc_addr *last)
+{
+    if (i + 1 < t->npages) {
+        *last = t->pfirsts[i + 1];
+        addr_decr(last);
+    } else {
+        memset(last->a, 0xff, sizeof(last->a));
+    }
+}
+
+/*
+ * Pages form of a compacted table, with its own values area
+ */
+static struct geoloc_table *
+table_expand(const struct geoloc_table *old)
+{
+    struct table_expand x;
+
+    if ((x.t = table_new(old->field, old->inet6,
+        old->compact->dictlen)) == NULL)
+        return (NULL);
+    x.dict = old->compact->dict;
+    memcpy(x.t->strs->buf, x.dict, old->compact->dictlen);
+
+    if (compact_walk(old->compact, table_expand_cb, &x) == -1) {
+        table_free(x.t);
+        return (NULL);
+    }
+
+    return (x.t);
+}
+
+static int
+table_expand_cb(void *arg, const struct geoloc_addr *first,
+                const struct geoloc_addr *last, const char *value)
+{
+    struct table_expand *x = arg;
+
+    /* same offset in the copy of the dictionary */
+    return (table_push(x->t, first, last, x->t->strs->buf + (value - x->dict),
+        NULL));
+}
+
+static void
+table_page_unref(struct table_page *p)
+{
+    if (--p->refs == 0)
+        free(p);
+}
+
+static void
+table_strs_unref(struct table_strs *s)
+{
+    struct table_strs   *parent;
+
+    while (s != NULL && --s->refs == 0) {
+        parent = s->parent;
+        free(s);
+        s = parent;
+    }
+}
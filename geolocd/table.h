@@ -0,0 +1,84 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GEOLOC_TABLE_H_
+#define _GEOLOC_TABLE_H_            1
+
+#include "geoloc.h"
+#include "compact.h"
+#include "delta.h"
+#include "index.h"
+
+#define TABLE_PAGE_RANGES           256
+/* searches a batch lookup interleaves */
+#define TABLE_BATCH_GROUP           16
+
+/*
+ * Sorted ranges, pages being shared between
+ * the table versions a delta produces
+ */
+struct table_page {
+    uint32_t                refs;
+    uint32_t                n;
+    struct geoloc_addr      firsts[TABLE_PAGE_RANGES];
+    struct geoloc_addr      lasts[TABLE_PAGE_RANGES];
+    const char              *values[TABLE_PAGE_RANGES];
+};
+
+/*
+ * Values area, a delta adding its own one on top
+ * of the areas the shared pages point into
+ */
+struct table_strs {
+    uint32_t                refs;
+    struct table_strs       *parent;
+    size_t                  len;
+    char                    buf[];
+};
+
+/*
+ * Lookup table of one field, the ranges of its index sorted by
+ * address. Answers from memory, without going through the backend,
+ * the addresses the walk covered.
+ */
+struct geoloc_table {
+    enum lookup_info_type   field;
+    unsigned                inet6:1;
+    struct table_page       **pages;
+    /* first address of each page */
+    struct geoloc_addr      *pfirsts;
+    uint32_t                npages;
+    uint32_t                nranges;
+    struct table_strs       *strs;
+    /* read only form replacing the pages once compacted */
+    struct compact          *compact;
+};
+
+struct geoloc_table *table_build(const struct geoloc_index *);
+struct geoloc_table *table_apply(const struct geoloc_table *,
+    const struct delta *, uint32_t *);
+struct geoloc_table *table_ranges(enum lookup_info_type, int,
+    const struct delta *);
+int table_compact(struct geoloc_table *);
+const char *table_lookup(const struct geoloc_table *, const struct geoloc_addr *);
+void table_lookup_batch(const struct geoloc_table *, const struct geoloc_addr *,
+    size_t, const char **);
+size_t table_footprint(const struct geoloc_table *);
+void table_free(struct geoloc_table *);
+
+#endif
@@ -0,0 +1,112 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "geoloc.h"
+#include "trace.h"
+
+/*
+ * The request being served, and the ring of the slowest
+ * ones, the oldest entry being overwritten first
+ */
+static struct trace_request cur;
+static int                  active;
+static uint64_t             threshold;
+static struct trace_request slowlog[TRACE_SLOWLOG_MAX];
+static uint64_t             nslow;
+
+/*
+ * Threshold in ms, every request being kept with 0
+ */
+void
+trace_init(unsigned ms)
+{
+    threshold = (uint64_t)ms * 1000;
+}
+
+void
+trace_begin(const struct trace_request *t, uint64_t now)
+{
+    cur = *t;
+    cur.queued = now - t->received;
+    cur.lookup = cur.send = 0;
+    cur.lookups = 0;
+    active = 1;
+}
+
+void
+trace_lookup(uint64_t usec, uint32_t n)
+{
+    if (active) {
+        cur.lookup += usec;
+        cur.lookups += n;
+    }
+}
+
+void
+trace_send(uint64_t usec)
+{
+    if (active)
+        cur.send += usec;
+}
+
+void
+trace_end(uint64_t now)
+{
+    if (!active)
+        return;
+    active = 0;
+
+    cur.total = now - cur.received;
+    if (cur.total >= threshold)
+        slowlog[nslow++ % TRACE_SLOWLOG_MAX] = cur;
+}
+
+/*
+ * One line per slow request, the latest first
+ */
+size_t
+trace_slowlog(char *buf, size_t len)
+{
+    const struct trace_request  *t;
+    uint64_t                    i;
+    size_t                      off;
+
+    off = snprintf(buf, len, "slow requests %llu, threshold %llu ms\n",
+        (unsigned long long)nslow, (unsigned long long)threshold / 1000);
+
+    for (i = nslow; i > 0 && nslow - i < TRACE_SLOWLOG_MAX && off < len; i--) {
+        t = &slowlog[(i - 1) % TRACE_SLOWLOG_MAX];
+        off += snprintf(buf + off, len - off, "type %u field %u %s%s "
+            "key %s total %llu us: queued %llu lookup %llu (%u) send %llu "
+            "other %llu, connection age %llu us\n", t->type, t->field,
+            (t->class == CLASS_BULK ? "bulk" : "interactive"),
+            (t->remote ? " remote" : ""), (t->key[0] ? t->key : "-"),
+            (unsigned long long)t->total, (unsigned long long)t->queued,
+            (unsigned long long)t->lookup, t->lookups,
+            (unsigned long long)t->send,
+            (unsigned long long)(t->total - t->queued - t->lookup - t->send),
+            (unsigned long long)t->age);
+    }
+
+    return (off < len ? off : len - 1);
+}
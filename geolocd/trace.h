@@ -0,0 +1,75 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _GEOLOC_TRACE_H_
+#define _GEOLOC_TRACE_H_            1
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Statically defined tracepoints of the geolocd provider, nops
+ * unless enabled by a tracer (dtrace, bpftrace, systemtap)
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_PROBE(n)              DTRACE_PROBE(geolocd, n)
+#define TRACE_PROBE1(n, a)          DTRACE_PROBE1(geolocd, n, a)
+#define TRACE_PROBE2(n, a, b)       DTRACE_PROBE2(geolocd, n, a, b)
+#define TRACE_PROBE3(n, a, b, c)    DTRACE_PROBE3(geolocd, n, a, b, c)
+#else
+/* the arguments are still evaluated, parameters only traced being used */
+#define TRACE_PROBE(n)              do { } while (0)
+#define TRACE_PROBE1(n, a)          do { (void)(a); } while (0)
+#define TRACE_PROBE2(n, a, b)       do { (void)(a); (void)(b); } while (0)
+#define TRACE_PROBE3(n, a, b, c) \
+    do { (void)(a); (void)(b); (void)(c); } while (0)
+#endif
+
+#define TRACE_SLOWLOG_THRESHOLD     50
+#define TRACE_SLOWLOG_MAX           128
+#define TRACE_KEY_MAX               48
+
+/*
+ * Stages of a served request, in us: connection age and
+ * queue wait when dispatched, then time spent in the backend,
+ * in sending the reply and in total since it was received
+ */
+struct trace_request {
+    uint64_t                received;
+    uint32_t                type;
+    uint32_t                field;
+    uint32_t                class;
+    uint32_t                remote;
+    uint64_t                age;
+    uint64_t                queued;
+    uint64_t                lookup;
+    uint32_t                lookups;
+    uint64_t                send;
+    uint64_t                total;
+    char                    key[TRACE_KEY_MAX];
+};
+
+void trace_init(unsigned);
+void trace_begin(const struct trace_request *, uint64_t);
+void trace_lookup(uint64_t, uint32_t);
+void trace_send(uint64_t);
+void trace_end(uint64_t);
+size_t trace_slowlog(char *, size_t);
+
+#endif
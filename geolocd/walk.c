@@ -0,0 +1,170 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#ifdef  HAVE_NO_BSDFUNCS
+#include <bsd/string.h>
+#endif
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "geoloc.h"
+
+/*
+ * Granularity of the walk for backends without range callback,
+ * the data are assumed identical within such blocks
+ */
+#define WALK_V4_STEP        (96 + 24)
+#define WALK_V6_STEP        48
+#define WALK_STEPS_MAX      (1 << 24)
+
+static int walk_steps_check(const struct geoloc_addr *, const struct geoloc_addr *);
+
+/*
+ * Walks the backend data from first to last, calling back once per
+ * run of adjacent addresses sharing the same (non empty) value
+ */
+int
+walk_range(struct backend *b, const struct geoloc_addr *first,
+           const struct geoloc_addr *last, enum lookup_info_type li,
+           walk_callback cb, void *arg)
+{
+    struct walk_cursor  wc;
+
+    if (walk_init(&wc, b, first, last, li) == -1)
+        return (-1);
+
+    return (walk_step(b, &wc, SIZE_MAX, cb, arg));
+}
+
+int
+walk_init(struct walk_cursor *wc, struct backend *b,
+          const struct geoloc_addr *first, const struct geoloc_addr *last,
+          enum lookup_info_type li)
+{
+    if (b->gl_brc == NULL && walk_steps_check(first, last) == -1)
+        return (-1);
+
+    bzero(wc, sizeof(*wc));
+    wc->cur = *first;
+    wc->last = *last;
+    wc->li = li;
+
+    return (0);
+}
+
+/*
+ * Goes on with the walk for up to steps backend lookups, 1 telling
+ * there is more to walk, 0 that the walk is over, its last run
+ * called back, and -1 that the callback failed
+ */
+int
+walk_step(struct backend *b, struct walk_cursor *wc, size_t steps,
+          walk_callback cb, void *arg)
+{
+    struct geoloc_addr  end;
+    char                key[GEOLOC_ADDR_MAX];
+    const char          *info;
+    void                *ptr;
+
+    if (wc->done)
+        return (0);
+
+    for (; steps > 0; steps--) {
+        info = NULL;
+        if (b->gl_brc != NULL) {
+            ptr = b->gl_brc(b->handler, &wc->cur, wc->li, &info, &end);
+        } else {
+            addr_format(&wc->cur, key, sizeof(key));
+            ptr = b->gl_blic(b->handler, key, wc->li, &info);
+            addr_prefix_last(&wc->cur,
+                (addr_isv4(&wc->cur) ? WALK_V4_STEP : WALK_V6_STEP), &end);
+        }
+
+        if (addr_cmp(&end, &wc->last) > 0 || addr_cmp(&end, &wc->cur) < 0)
+            end = wc->last;
+
+        if (wc->merged && info != NULL && strcmp(info, wc->value) == 0) {
+            wc->mlast = end;
+        } else {
+            if (wc->merged &&
+                cb(arg, &wc->mfirst, &wc->mlast, wc->value) == -1) {
+                if (ptr != NULL && b->gl_blcc != NULL)
+                    b->gl_blcc(b->handler, ptr);
+                return (-1);
+            }
+            wc->merged = 0;
+            if (info != NULL && *info != '\0') {
+                strlcpy(wc->value, info, sizeof(wc->value));
+                wc->mfirst = wc->cur;
+                wc->mlast = end;
+                wc->merged = 1;
+            }
+        }
+
+        if (ptr != NULL && b->gl_blcc != NULL)
+            b->gl_blcc(b->handler, ptr);
+
+        if (addr_cmp(&end, &wc->last) >= 0) {
+            wc->done = 1;
+            if (wc->merged &&
+                cb(arg, &wc->mfirst, &wc->mlast, wc->value) == -1)
+                return (-1);
+            return (0);
+        }
+        wc->cur = end;
+        addr_incr(&wc->cur);
+    }
+
+    return (1);
+}
+
+/*
+ * Bounds the number of lookups of a stepped walk
+ */
+static int
+walk_steps_check(const struct geoloc_addr *first,
+                 const struct geoloc_addr *last)
+{
+    uint8_t     diff[16];
+    uint64_t    steps = 0;
+    int         i, n, v, borrow = 0;
+
+    /* last - first, on the step bits only */
+    n = (addr_isv4(first) ? WALK_V4_STEP : WALK_V6_STEP) / 8;
+    for (i = n - 1; i >= 0; i--) {
+        v = last->a[i] - first->a[i] - borrow;
+        borrow = (v < 0);
+        diff[i] = (uint8_t)v;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (i < n - 8 && diff[i] != 0)
+            break;
+        steps = (steps << 8) | diff[i];
+    }
+
+    if (i < n || steps > WALK_STEPS_MAX) {
+        log_warnx("walk_range: range too large without backend ranges");
+        return (-1);
+    }
+
+    return (0);
+}
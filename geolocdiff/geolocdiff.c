@@ -0,0 +1,102 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <geoloc.h>
+#include <delta.h>
+
+void usage(void);
+struct delta *ranges_load(const char *);
+
+void
+usage(void)
+{
+    extern char *__progname;
+
+    fprintf(stderr, "usage: %s [-o delta] old new\n", __progname);
+    exit(1);
+}
+
+struct delta *
+ranges_load(const char *path)
+{
+    struct delta *d;
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL)
+        err(1, "%s", path);
+
+    if ((d = delta_read(fp, 0)) == NULL)
+        errx(1, "%s: invalid ranges", path);
+
+    fclose(fp);
+
+    return (d);
+}
+
+/*
+ * Diffs two range databases, one "first last value" line per range,
+ * into the delta geolocd applies to its tables
+ */
+int
+main(int argc, char *argv[])
+{
+    struct delta *old, *new;
+    const char *output = NULL;
+    FILE *out = stdout;
+    int c;
+
+    log_init(1);
+
+    while ((c = getopt(argc, argv, "o:")) != -1) {
+        switch (c) {
+        case 'o':
+            output = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 2)
+        usage();
+
+    old = ranges_load(argv[0]);
+    new = ranges_load(argv[1]);
+
+    if (output != NULL && (out = fopen(output, "w")) == NULL)
+        err(1, "%s", output);
+
+    if (delta_diff(old, new, out) == -1 || fflush(out) == EOF)
+        errx(1, "cannot write the delta");
+
+    if (out != stdout)
+        fclose(out);
+
+    delta_free(old);
+    delta_free(new);
+
+    return (0);
+}
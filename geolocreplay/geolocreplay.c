@@ -0,0 +1,590 @@
+/*	$NetBSD: $ */
+
+/*
+ * Copyright (c) 2014, 2015 David Carlier <devnexen@gmail.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF MIND, USE, DATA OR PROFITS, WHETHER
+ * IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef HAVE_NO_BSDFUNCS
+#include <bsd/stdlib.h>
+#include <bsd/string.h>
+#endif
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <geoloc.h>
+#include <capture.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL            0
+#endif
+
+/* connections opened, the captured ones beyond being shared */
+#define REPLAY_CONNS            256
+/* requests in flight per connection, as geolocd queues them */
+#define REPLAY_WINDOW           64
+/* how long to wait for replies without any progress, ms */
+#define REPLAY_TIMEOUT          10000
+#define REPLAY_TYPES            (MSG_CTL_SLOWLOG + 1)
+
+enum replay_kind {
+    REPLY_STRING,
+    REPLY_VECTOR,
+    REPLY_STREAM
+};
+
+struct replay_pending {
+    uint64_t                sent;
+    enum msg_type           type;
+    enum replay_kind        kind;
+    /* class changes are not measured */
+    unsigned                counted:1;
+};
+
+struct replay_conn {
+    int                     fd;
+    enum conn_class         class;
+    char                    *obuf;
+    size_t                  olen;
+    size_t                  ooff;
+    size_t                  osz;
+    char                    *ibuf;
+    size_t                  ilen;
+    size_t                  isz;
+    struct replay_pending   pending[REPLAY_WINDOW + 1];
+    size_t                  phead;
+    size_t                  npending;
+};
+
+struct replay_lat {
+    uint32_t                *v;
+    size_t                  n;
+    size_t                  sz;
+};
+
+void usage(void);
+uint64_t replay_clock(void);
+int replay_connect(void);
+struct replay_conn *replay_conn(uint32_t);
+enum replay_kind replay_kind(enum msg_type);
+void replay_queue(struct replay_conn *, enum msg_type, enum msg_field,
+    const char *, size_t, int, uint64_t);
+void replay_write(struct replay_conn *);
+void replay_read(struct replay_conn *, uint64_t);
+int replay_reply(struct replay_conn *, uint64_t);
+void replay_done(struct replay_conn *, int, int, uint64_t);
+void replay_lat_add(struct replay_lat *, uint32_t);
+int replay_lat_cmp(const void *, const void *);
+void replay_report(const char *, struct replay_lat *);
+
+static const char *replay_names[REPLAY_TYPES] = {
+    [MSG_CTL_BACKEND_INFO] = "backend",
+    [MSG_CTL_PROPERTY] = "property",
+    [MSG_CTL_PROPERTY_BATCH] = "batch",
+    [MSG_CTL_PROPERTY_ALL] = "all",
+    [MSG_CTL_ENUMERATE] = "enumerate",
+    [MSG_CTL_REVERSE] = "reverse",
+    [MSG_CTL_NEAREST] = "nearest",
+    [MSG_CTL_RADIUS] = "radius"
+};
+
+static const char *path = GEOLOCD_SOCKET;
+static const char *host = NULL;
+static const char *port = NULL;
+static struct replay_conn *conns[REPLAY_CONNS];
+static size_t inflight = 0;
+static struct replay_lat lat;
+static struct replay_lat lats[REPLAY_TYPES];
+static size_t nreplies = 0;
+static size_t noverloaded = 0;
+static size_t nerrors = 0;
+
+void
+usage(void)
+{
+    extern char *__progname;
+
+    fprintf(stderr, "usage: %s [-m | -s speed] [-S socket | -t host "
+        "[-P port]] capture\n", __progname);
+    exit(1);
+}
+
+uint64_t
+replay_clock(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/*
+ * Connects to the unix socket, or to the TCP listener
+ * with a host set, the socket left non blocking
+ */
+int
+replay_connect(void)
+{
+    struct sockaddr_un sun;
+    struct addrinfo hints, *res, *ai;
+    char sport[8];
+    int fd = -1, on = 1, error;
+
+    if (host == NULL) {
+        bzero(&sun, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+            err(1, "socket");
+        if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) == -1)
+            err(1, "%s", path);
+    } else {
+        bzero(&hints, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (port == NULL)
+            snprintf(sport, sizeof(sport), "%u", GEOLOCD_PORT);
+        else
+            strlcpy(sport, port, sizeof(sport));
+
+        if ((error = getaddrinfo(host, sport, &hints, &res)) != 0)
+            errx(1, "%s: %s", host, gai_strerror(error));
+
+        for (ai = res; ai != NULL; ai = ai->ai_next) {
+            if ((fd = socket(ai->ai_family, ai->ai_socktype,
+                ai->ai_protocol)) == -1)
+                continue;
+            if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                break;
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+
+        if (fd == -1)
+            errx(1, "cannot connect to %s port %s", host, sport);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    }
+
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1)
+        err(1, "fcntl");
+
+    return (fd);
+}
+
+/*
+ * Connection replaying the captured one, opened on first use
+ */
+struct replay_conn *
+replay_conn(uint32_t id)
+{
+    struct replay_conn *c;
+
+    if ((c = conns[id % REPLAY_CONNS]) != NULL)
+        return (c);
+
+    if ((c = calloc(1, sizeof(*c))) == NULL)
+        err(1, "calloc");
+    c->fd = replay_connect();
+    c->class = CLASS_INTERACTIVE;
+    conns[id % REPLAY_CONNS] = c;
+
+    return (c);
+}
+
+/*
+ * Shape of the reply, overloaded ones included
+ */
+enum replay_kind
+replay_kind(enum msg_type type)
+{
+    switch (type) {
+    case MSG_CTL_PROPERTY_BATCH:
+    case MSG_CTL_PROPERTY_ALL:
+    case MSG_CTL_NEAREST:
+        return (REPLY_VECTOR);
+    case MSG_CTL_ENUMERATE:
+    case MSG_CTL_REVERSE:
+    case MSG_CTL_RADIUS:
+        return (REPLY_STREAM);
+    default:
+        return (REPLY_STRING);
+    }
+}
+
+void
+replay_queue(struct replay_conn *c, enum msg_type type, enum msg_field field,
+    const char *payload, size_t len, int counted, uint64_t now)
+{
+    struct replay_pending *p;
+    struct msg_ctl_req req;
+    size_t sz;
+    char *buf;
+
+    if (c->olen + sizeof(req) + len > c->osz) {
+        for (sz = (c->osz == 0 ? 4096 : c->osz);
+            c->olen + sizeof(req) + len > sz; sz *= 2)
+            ;
+        if ((buf = realloc(c->obuf, sz)) == NULL)
+            err(1, "realloc");
+        c->obuf = buf;
+        c->osz = sz;
+    }
+
+    bzero(&req, sizeof(req));
+    req.type = type;
+    req.field = field;
+    memcpy(c->obuf + c->olen, &req, sizeof(req));
+    if (len > 0)
+        memcpy(c->obuf + c->olen + sizeof(req), payload, len);
+    c->olen += sizeof(req) + len;
+
+    p = &c->pending[(c->phead + c->npending) % nitems(c->pending)];
+    p->sent = now;
+    p->type = type;
+    p->kind = replay_kind(type);
+    p->counted = counted;
+    c->npending++;
+    inflight++;
+}
+
+void
+replay_write(struct replay_conn *c)
+{
+    ssize_t n;
+
+    while (c->ooff < c->olen) {
+        n = send(c->fd, c->obuf + c->ooff, c->olen - c->ooff, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            err(1, "send");
+        }
+        c->ooff += n;
+    }
+    c->ooff = c->olen = 0;
+}
+
+void
+replay_read(struct replay_conn *c, uint64_t now)
+{
+    ssize_t n;
+    char *buf;
+
+    for (;;) {
+        if (c->ilen == c->isz) {
+            if ((buf = realloc(c->ibuf, c->isz == 0 ? 4096 : c->isz * 2))
+                == NULL)
+                err(1, "realloc");
+            c->ibuf = buf;
+            c->isz = (c->isz == 0 ? 4096 : c->isz * 2);
+        }
+
+        if ((n = recv(c->fd, c->ibuf + c->ilen, c->isz - c->ilen, 0)) == 0)
+            errx(1, "connection closed by geolocd");
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            err(1, "recv");
+        }
+        c->ilen += n;
+    }
+
+    while (c->npending > 0 && (n = replay_reply(c, now)) > 0) {
+        memmove(c->ibuf, c->ibuf + n, c->ilen - n);
+        c->ilen -= n;
+    }
+    if (c->ilen > 0 && c->npending == 0)
+        errx(1, "unexpected reply data");
+}
+
+/*
+ * Consumes the reply, or a frame of it, at the head of the
+ * input buffer, returning its size or 0 while incomplete
+ */
+int
+replay_reply(struct replay_conn *c, uint64_t now)
+{
+    struct replay_pending *p = &c->pending[c->phead];
+    struct msg_ctl_res res;
+    char *end;
+
+    if (p->kind == REPLY_STRING) {
+        if ((end = memchr(c->ibuf, '\0', c->ilen)) == NULL)
+            return (0);
+        replay_done(c, strcmp(c->ibuf, GEOLOC_OVERLOADED_INFO) == 0, 0,
+            now);
+        return (end - c->ibuf + 1);
+    }
+
+    if (c->ilen < sizeof(res))
+        return (0);
+    memcpy(&res, c->ibuf, sizeof(res));
+    if (c->ilen - sizeof(res) < res.len)
+        return (0);
+
+    /* streams end with an empty frame, a status one included */
+    if (p->kind == REPLY_VECTOR || res.count == 0)
+        replay_done(c, res.status == MSG_STATUS_OVERLOADED,
+            res.status == MSG_STATUS_INVALID, now);
+
+    return (sizeof(res) + res.len);
+}
+
+void
+replay_done(struct replay_conn *c, int overloaded, int error, uint64_t now)
+{
+    struct replay_pending *p = &c->pending[c->phead];
+    uint32_t usec;
+
+    if (p->counted) {
+        usec = (now - p->sent > UINT32_MAX ? UINT32_MAX : now - p->sent);
+        nreplies++;
+        if (overloaded)
+            noverloaded++;
+        else if (error)
+            nerrors++;
+        else {
+            replay_lat_add(&lat, usec);
+            replay_lat_add(&lats[p->type], usec);
+        }
+    }
+
+    c->phead = (c->phead + 1) % nitems(c->pending);
+    c->npending--;
+    inflight--;
+}
+
+void
+replay_lat_add(struct replay_lat *l, uint32_t usec)
+{
+    uint32_t *v;
+    size_t sz;
+
+    if (l->n == l->sz) {
+        sz = (l->sz == 0 ? 1024 : l->sz * 2);
+        if ((v = reallocarray(l->v, sz, sizeof(*v))) == NULL)
+            err(1, "reallocarray");
+        l->v = v;
+        l->sz = sz;
+    }
+    l->v[l->n++] = usec;
+}
+
+int
+replay_lat_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return (x < y ? -1 : x > y);
+}
+
+/*
+ * Latency percentiles of the served requests, in microseconds
+ */
+void
+replay_report(const char *name, struct replay_lat *l)
+{
+    if (l->n == 0)
+        return;
+
+    qsort(l->v, l->n, sizeof(*l->v), replay_lat_cmp);
+    printf("%-10s %10zu %8u %8u %8u %8u %8u\n", name, l->n,
+        l->v[l->n * 50 / 100], l->v[l->n * 90 / 100],
+        l->v[l->n * 99 / 100], l->v[l->n * 999 / 1000], l->v[l->n - 1]);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct capture_record rec;
+    struct replay_conn *c;
+    struct pollfd pfd[REPLAY_CONNS];
+    struct replay_conn *pconn[REPLAY_CONNS];
+    const char *errstr;
+    char *payload;
+    double speed = 1.0, elapsed;
+    uint64_t start, first = 0, now, due = 0, lag = 0;
+    size_t nrequests = 0, npfd, i;
+    int ch, maxspeed = 0, more, blocked, timeout, n;
+    FILE *fp;
+
+    while ((ch = getopt(argc, argv, "mP:S:s:t:")) != -1) {
+        switch (ch) {
+        case 'm':
+            maxspeed = 1;
+            break;
+        case 'P':
+            strtonum(optarg, 1, 65535, &errstr);
+            if (errstr != NULL)
+                errx(1, "port %s: %s", optarg, errstr);
+            port = optarg;
+            break;
+        case 'S':
+            if (strlen(optarg) >= sizeof(((struct sockaddr_un *)0)->sun_path))
+                errx(1, "%s: socket path too long", optarg);
+            path = optarg;
+            break;
+        case 's':
+            speed = strtod(optarg, NULL);
+            if (!(speed > 0.0))
+                errx(1, "invalid speed %s", optarg);
+            break;
+        case 't':
+            host = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc != 1 || (port != NULL && host == NULL))
+        usage();
+
+    if ((fp = fopen(argv[0], "r")) == NULL)
+        err(1, "%s", argv[0]);
+    if (capture_header(fp) == -1)
+        errx(1, "%s: not a capture file", argv[0]);
+    if ((payload = malloc(CAPTURE_PAYLOAD_MAX + 1)) == NULL)
+        err(1, "malloc");
+
+    bzero(&rec, sizeof(rec));
+    if ((more = capture_read(fp, &rec, payload, CAPTURE_PAYLOAD_MAX + 1))
+        == -1)
+        err(1, "%s", argv[0]);
+    first = rec.usec;
+    start = replay_clock();
+
+    while (more || inflight > 0) {
+        now = replay_clock();
+        blocked = 0;
+
+        /* the due requests, in the capture order */
+        while (more) {
+            due = (maxspeed ? now :
+                start + (uint64_t)((rec.usec - first) / speed));
+            if (due > now)
+                break;
+            if (rec.type >= REPLAY_TYPES || replay_names[rec.type] == NULL)
+                errx(1, "%s: invalid request type %d", argv[0], rec.type);
+            c = replay_conn(rec.conn);
+            if (c->npending + 1 >= nitems(c->pending)) {
+                blocked = 1;
+                break;
+            }
+            if (now - due > lag)
+                lag = now - due;
+            if (rec.class != c->class) {
+                replay_queue(c, MSG_CTL_CLASS, rec.class == CLASS_BULK ?
+                    MSG_CLASS_BULK : MSG_CLASS_INTERACTIVE, NULL, 0, 0, now);
+                c->class = rec.class;
+            }
+            replay_queue(c, rec.type, rec.field, payload, rec.len, 1, now);
+            nrequests++;
+
+            if ((more = capture_read(fp, &rec, payload,
+                CAPTURE_PAYLOAD_MAX + 1)) == -1)
+                err(1, "%s", argv[0]);
+        }
+
+        for (i = npfd = 0; i < REPLAY_CONNS; i++) {
+            if ((c = conns[i]) == NULL)
+                continue;
+            if (c->olen > c->ooff)
+                replay_write(c);
+            if (c->npending == 0 && c->olen == 0)
+                continue;
+            pfd[npfd].fd = c->fd;
+            pfd[npfd].events = POLLIN | (c->olen > c->ooff ? POLLOUT : 0);
+            pfd[npfd].revents = 0;
+            pconn[npfd++] = c;
+        }
+
+        if (more && !blocked && due > now)
+            timeout = (due - now + 999) / 1000;
+        else if (npfd > 0)
+            timeout = REPLAY_TIMEOUT;
+        else
+            continue;
+
+        if ((n = poll(pfd, npfd, timeout)) == -1) {
+            if (errno == EINTR)
+                continue;
+            err(1, "poll");
+        }
+        now = replay_clock();
+        if (n == 0 && timeout == REPLAY_TIMEOUT)
+            errx(1, "no reply for %d ms, %zu requests in flight",
+                REPLAY_TIMEOUT, inflight);
+
+        for (i = 0; i < npfd; i++) {
+            if (pconn[i]->olen > pconn[i]->ooff &&
+                (pfd[i].revents & POLLOUT))
+                replay_write(pconn[i]);
+            if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+                replay_read(pconn[i], now);
+        }
+    }
+
+    elapsed = (replay_clock() - start) / 1e6;
+    fclose(fp);
+
+    printf("requests %zu, overloaded %zu, errors %zu\n",
+        nrequests, noverloaded, nerrors);
+    printf("elapsed %.3fs, %.1f requests/s, max lag %.3fms\n", elapsed,
+        elapsed > 0 ? nreplies / elapsed : 0.0, lag / 1e3);
+    printf("%-10s %10s %8s %8s %8s %8s %8s\n", "usec", "count",
+        "p50", "p90", "p99", "p99.9", "max");
+    replay_report("total", &lat);
+    for (i = 0; i < REPLAY_TYPES; i++)
+        if (replay_names[i] != NULL)
+            replay_report(replay_names[i], &lats[i]);
+
+    for (i = 0; i < REPLAY_CONNS; i++) {
+        if ((c = conns[i]) == NULL)
+            continue;
+        close(c->fd);
+        free(c->obuf);
+        free(c->ibuf);
+        free(c);
+    }
+    free(payload);
+
+    return (0);
+}